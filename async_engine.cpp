@@ -0,0 +1,713 @@
+#include "async_engine.hpp"
+
+#include "message.hpp"
+#include "network.hpp"
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace network
+{
+        namespace
+        {
+                using boost::asio::ip::tcp;
+                using boost::system::error_code;
+
+                using clock = std::chrono::steady_clock;
+
+                clock::duration to_clock(std::chrono::duration<double> d)
+                {
+                        return std::chrono::duration_cast<clock::duration>(d);
+                }
+
+                // State shared by all the connections of one download. Only
+                // the io_context thread touches it, so it needs no locking.
+                struct async_download
+                {
+                        boost::asio::io_context io;
+                        tcp::resolver::results_type endpoints;
+                        std::string host;
+                        // The requests each connection makes, rendered into
+                        // its own buffer as they're sent
+                        message::request_template requests;
+                        chunk_scheduler& scheduler;
+                        output_file& out;
+                        transfer_limits limits;
+                        std::chrono::duration<double> connect_timeout;
+                        size_t total_downloaded = 0;
+                        // How many requests a connection may have outstanding,
+                        // and whether the server has shown it can cope with
+                        // more than one.
+                        size_t pipeline_depth = 1;
+                        bool pipelining = true;
+                        // Connections waiting for the scheduler to have work
+                        // for them, since it can't block this thread.
+                        std::vector<std::function<void()>> parked;
+
+                        async_download(const std::string& host, const std::string& path,
+                                       chunk_scheduler& scheduler, output_file& out,
+                                       const transfer_limits& limits,
+                                       std::chrono::duration<double> connect_timeout)
+                                : host(host), requests(range_requests(host, path)),
+                                  scheduler(scheduler), out(out), limits(limits),
+                                  connect_timeout(connect_timeout)
+                        {
+                        }
+
+                        size_t depth() const
+                        {
+                                return pipelining ? pipeline_depth : 1;
+                        }
+
+                        // Give the parked connections another go, after a
+                        // response may have changed what the scheduler has.
+                        void wake_parked()
+                        {
+                                for (auto& resume : parked)
+                                {
+                                        boost::asio::post(io, std::move(resume));
+                                }
+                                parked.clear();
+                        }
+                };
+
+                // A range that has been asked for on a connection, but whose
+                // response hasn't been read yet.
+                struct requested_range
+                {
+                        network::chunk c;
+                        chunk_scheduler::active_handle active;
+                        clock::time_point sent;
+                };
+
+                // One socket that repeatedly fetches chunks until there are
+                // none left. Every step schedules the next one as a completion
+                // handler, and the handlers hold a shared_ptr to keep the
+                // connection alive between steps.
+                class async_connection
+                        : public std::enable_shared_from_this<async_connection>
+                {
+                        async_download& download;
+                        tcp::socket socket;
+                        // Closes the socket if the step in progress takes too
+                        // long, which fails it. Each deadline set has a
+                        // number, so one that fires just as the next step
+                        // starts is ignored.
+                        boost::asio::steady_timer deadline;
+                        size_t deadlines = 0;
+                        bool timed_out = false;
+                        // Waits before trying again after a failure, and
+                        // counts the failures since the last range finished
+                        boost::asio::steady_timer pause;
+                        int failures = 0;
+                        boost::asio::streambuf response_buf;
+                        message::response_parser header_parser;
+                        std::vector<uint8_t> block;
+                        std::string request;
+                        // The ranges this connection has taken, in the order
+                        // their responses arrive. The first sent of them have
+                        // been requested on socket.
+                        std::deque<requested_range> in_flight;
+                        size_t sent = 0;
+                        connection_rate& rate;
+                        // When the current response's header arrived, and
+                        // when the one before it was finished, since a
+                        // pipelined response can't start arriving before that.
+                        clock::time_point answered;
+                        clock::time_point last_finished;
+                        // The length of the response body, how much of it
+                        // belongs in the file, and how much of that has been
+                        // written.
+                        size_t body_length = 0;
+                        size_t file_length = 0;
+                        size_t received = 0;
+                        // Follows the framing of a body sent in chunks
+                        bool chunked = false;
+                        message::chunk_parser chunks;
+                        bool keep_alive = false;
+                        // Whether the socket has already served a request, and
+                        // so might have been closed by the server since.
+                        bool reused = false;
+                        size_t answered_here = 0;
+                public:
+                        explicit async_connection(async_download& download)
+                                : download(download), socket(download.io),
+                                  deadline(download.io), pause(download.io),
+                                  rate(download.scheduler.add_connection())
+                        {
+                        }
+
+                        void start()
+                        {
+                                fetch_next_chunk();
+                        }
+
+                private:
+                        void set_deadline(std::chrono::duration<double> d)
+                        {
+                                timed_out = false;
+                                deadline.expires_after(to_clock(d));
+                                auto self(shared_from_this());
+                                deadline.async_wait(
+                                        [this, self, armed = ++deadlines](const error_code& ec) {
+                                                if (!ec && armed == deadlines)
+                                                {
+                                                        timed_out = true;
+                                                        error_code ignored;
+                                                        socket.close(ignored);
+                                                }
+                                        });
+                        }
+
+                        void clear_deadline()
+                        {
+                                ++deadlines;
+                                deadline.cancel();
+                        }
+
+                        // The error for a socket that broke or timed out
+                        connection_error lost_connection() const
+                        {
+                                if (timed_out)
+                                {
+                                        return connection_error("Timed out waiting for "
+                                                                + download.host);
+                                }
+                                return connection_error("Lost the connection to "
+                                                        + download.host);
+                        }
+
+                        // Whether the body of the current response is
+                        // arriving too slowly, so it's worth asking for the
+                        // rest on another connection
+                        bool too_slow() const
+                        {
+                                const transfer_limits& limits = download.limits;
+                                std::chrono::duration<double> elapsed = clock::now() - answered;
+                                return limits.min_rate > 0
+                                        && elapsed >= limits.min_rate_window
+                                        && received < limits.min_rate * elapsed.count();
+                        }
+
+                        void fetch_next_chunk()
+                        {
+                                bool wait = false;
+                                while (in_flight.size() < download.depth())
+                                {
+                                        requested_range r;
+                                        if (!download.scheduler.try_next(r.c, r.active, wait, &rate))
+                                        {
+                                                break;
+                                        }
+                                        in_flight.push_back(std::move(r));
+                                }
+                                if (in_flight.empty())
+                                {
+                                        clear_deadline();
+                                        if (wait)
+                                        {
+                                                auto self(shared_from_this());
+                                                download.parked.push_back(
+                                                        [this, self]() { fetch_next_chunk(); });
+                                                return;
+                                        }
+                                        error_code ignored;
+                                        socket.close(ignored);
+                                        return;
+                                }
+                                if (socket.is_open())
+                                {
+                                        write_requests();
+                                }
+                                else
+                                {
+                                        connect();
+                                }
+                        }
+
+                        void connect()
+                        {
+                                set_deadline(download.connect_timeout);
+                                auto self(shared_from_this());
+                                boost::asio::async_connect(
+                                        socket, download.endpoints,
+                                        [this, self](const error_code& ec,
+                                                     const tcp::endpoint&) {
+                                                if (ec)
+                                                {
+                                                        return fail(connection_error(
+                                                                (timed_out ? "Timed out connecting to "
+                                                                 : "Unable to connect to ")
+                                                                + download.host));
+                                                }
+                                                reused = false;
+                                                sent = 0;
+                                                answered_here = 0;
+                                                write_requests();
+                                        });
+                        }
+
+                        // Write the requests for the ranges that haven't been
+                        // asked for on this socket, as far as the pipeline
+                        // allows, then read the next response.
+                        void write_requests()
+                        {
+                                request.clear();
+                                clock::time_point now = clock::now();
+                                size_t depth = std::min(in_flight.size(), download.depth());
+                                for (; sent < depth; ++sent)
+                                {
+                                        const network::chunk& c = in_flight[sent].c;
+                                        request.append(download.requests.with_range(
+                                                               c.first_byte, c.last_byte));
+                                        in_flight[sent].sent = now;
+                                }
+                                if (request.empty())
+                                {
+                                        return read_header();
+                                }
+                                set_deadline(download.limits.first_byte);
+                                auto self(shared_from_this());
+                                boost::asio::async_write(
+                                        socket, boost::asio::buffer(request),
+                                        [this, self](const error_code& ec, size_t) {
+                                                if (ec)
+                                                {
+                                                        return retry_or_fail();
+                                                }
+                                                read_header();
+                                        });
+                        }
+
+                        void read_header()
+                        {
+                                set_deadline(download.limits.first_byte);
+                                header_parser.reset();
+                                parse_header();
+                        }
+
+                        // Parse what has arrived of the header, which may
+                        // have come in with the previous response, and read
+                        // more until it's all there.
+                        void parse_header()
+                        {
+                                auto data = response_buf.data();
+                                if (header_parser.parse(static_cast<const char*>(data.data()),
+                                                        data.size()))
+                                {
+                                        return accept_header();
+                                }
+                                const size_t block_size = 16 * 1024;
+                                auto self(shared_from_this());
+                                socket.async_read_some(
+                                        response_buf.prepare(block_size),
+                                        [this, self](const error_code& ec, size_t n) {
+                                                if (ec)
+                                                {
+                                                        return retry_or_fail();
+                                                }
+                                                response_buf.commit(n);
+                                                parse_header();
+                                        });
+                        }
+
+                        void accept_header()
+                        {
+                                answered = clock::now();
+                                message::response_message header(header_parser);
+                                response_buf.consume(header_parser.header_size());
+                                requested_range& r = in_flight.front();
+                                if (out_of_order(header, r.c))
+                                {
+                                        if (sent == 1)
+                                        {
+                                                throw std::runtime_error(
+                                                        "Remote host " + download.host
+                                                        + " sent the wrong range.");
+                                        }
+                                        // Ask again one at a time
+                                        download.pipelining = false;
+                                        drop_socket();
+                                        return fetch_next_chunk();
+                                }
+                                // accept_range_response deals with 416 at the
+                                // end of the file
+                                if (!header && header.status_code() != 416)
+                                {
+                                        throw std::runtime_error(
+                                                "Remote host " + download.host
+                                                + " didn't succeed.");
+                                }
+                                keep_alive = header.keep_alive();
+                                if (!keep_alive && sent > 1)
+                                {
+                                        // The server drops the requests queued
+                                        // behind this one.
+                                        download.pipelining = false;
+                                }
+                                chunked = header.chunked();
+                                chunks = message::chunk_parser();
+                                // A 416 response may leave out the length of
+                                // its empty body
+                                if (!chunked)
+                                {
+                                        body_length = header.status_code() == 416
+                                                && !header.find_field(message::fields::content_length)
+                                                ? 0 : header.content_length();
+                                }
+                                file_length = accept_range_response(
+                                        header, r.c, r.active,
+                                        download.scheduler, download.out);
+                                // A chunked body only says where it ends when it
+                                // gets there, so it's taken to be as long as
+                                // its Content-Range says
+                                if (chunked)
+                                {
+                                        body_length = file_length;
+                                }
+                                // If the range loses a hedge race, the read
+                                // waiting on it is cancelled.
+                                download.scheduler.on_stop(r.active, [this]() {
+                                        error_code ignored;
+                                        socket.cancel(ignored);
+                                });
+                                download.wake_parked();
+                                received = 0;
+                                read_block();
+                        }
+
+                        // The body is claimed from the scheduler a block at a
+                        // time, so that the part not read yet can be handed to
+                        // another connection.
+                        void read_block()
+                        {
+                                const size_t block_size = 16 * 1024;
+                                const requested_range& r = in_flight.front();
+                                size_t n = 0;
+                                if (received < file_length)
+                                {
+                                        n = download.scheduler.claim(
+                                                r.active,
+                                                std::min(block_size, file_length - received));
+                                }
+                                if (n == 0)
+                                {
+                                        if (chunked && received == body_length)
+                                        {
+                                                return read_last_chunk();
+                                        }
+                                        return finish_chunk();
+                                }
+                                size_t offset = r.c.first_byte + received;
+                                uint8_t* destination = download.out.direct(offset, n);
+                                if (!destination)
+                                {
+                                        block.resize(n);
+                                        destination = block.data();
+                                }
+                                if (chunked)
+                                {
+                                        return read_chunks(offset, destination, n, 0);
+                                }
+                                // Part of the body may have arrived along with
+                                // the header. The rest goes straight from the
+                                // socket into the destination.
+                                size_t buffered = boost::asio::buffer_copy(
+                                        boost::asio::buffer(destination, n),
+                                        response_buf.data());
+                                response_buf.consume(buffered);
+                                set_deadline(download.limits.idle);
+                                auto self(shared_from_this());
+                                boost::asio::async_read(
+                                        socket,
+                                        boost::asio::buffer(destination + buffered,
+                                                            n - buffered),
+                                        [this, self, offset, buffered, destination](
+                                                const error_code& ec, size_t got) {
+                                                block_read(offset, destination, got + buffered, ec);
+                                        });
+                        }
+
+                        // Fill the n bytes at destination from a chunked
+                        // body, of which filled have been read already. Chunk
+                        // data that came in with the framing is copied out of
+                        // the buffer, and the rest of a chunk is read straight
+                        // from the socket, while the framing between chunks is
+                        // read into the buffer to be parsed.
+                        void read_chunks(size_t offset, uint8_t* destination, size_t n,
+                                         size_t filled)
+                        {
+                                const size_t block_size = 16 * 1024;
+                                auto self(shared_from_this());
+                                while (filled < n)
+                                {
+                                        if (chunks.data_left() == 0)
+                                        {
+                                                auto data = response_buf.data();
+                                                response_buf.consume(chunks.parse(
+                                                        static_cast<const char*>(data.data()),
+                                                        data.size()));
+                                        }
+                                        if (chunks.done())
+                                        {
+                                                // The body ended before the
+                                                // range did
+                                                return block_read(offset, destination, filled,
+                                                                  boost::asio::error::eof);
+                                        }
+                                        if (chunks.data_left() == 0)
+                                        {
+                                                set_deadline(download.limits.idle);
+                                                socket.async_read_some(
+                                                        response_buf.prepare(block_size),
+                                                        [this, self, offset, destination, n, filled](
+                                                                const error_code& ec, size_t got) {
+                                                                if (ec)
+                                                                {
+                                                                        return block_read(offset, destination,
+                                                                                          filled, ec);
+                                                                }
+                                                                response_buf.commit(got);
+                                                                read_chunks(offset, destination, n, filled);
+                                                        });
+                                                return;
+                                        }
+                                        size_t wanted = std::min(n - filled, chunks.data_left());
+                                        size_t buffered = boost::asio::buffer_copy(
+                                                boost::asio::buffer(destination + filled, wanted),
+                                                response_buf.data());
+                                        response_buf.consume(buffered);
+                                        chunks.consume(buffered);
+                                        filled += buffered;
+                                        if (buffered == 0)
+                                        {
+                                                set_deadline(download.limits.idle);
+                                                socket.async_read_some(
+                                                        boost::asio::buffer(destination + filled, wanted),
+                                                        [this, self, offset, destination, n, filled](
+                                                                const error_code& ec, size_t got) {
+                                                                chunks.consume(got);
+                                                                if (ec)
+                                                                {
+                                                                        return block_read(offset, destination,
+                                                                                          filled + got, ec);
+                                                                }
+                                                                read_chunks(offset, destination, n,
+                                                                            filled + got);
+                                                        });
+                                                return;
+                                        }
+                                }
+                                block_read(offset, destination, filled, error_code());
+                        }
+
+                        // got bytes of the body have been read into
+                        // destination for offset in the file, and ec says why
+                        // that's fewer than were claimed, if it is.
+                        void block_read(size_t offset, uint8_t* destination, size_t got,
+                                        const error_code& ec)
+                        {
+                                if (destination == block.data())
+                                {
+                                        download.out.write_at(offset, destination, got);
+                                }
+                                download.out.commit(offset, got);
+                                received += got;
+                                download.total_downloaded += got;
+                                // A read cancelled because the range lost a
+                                // hedge race isn't a failure.
+                                if (ec && download.scheduler.stopped(in_flight.front().active))
+                                {
+                                        return requeue_front();
+                                }
+                                if (ec)
+                                {
+                                        return fail(lost_connection());
+                                }
+                                if (too_slow())
+                                {
+                                        return requeue_front();
+                                }
+                                read_block();
+                        }
+
+                        // All of a chunked body's data has been read, but the
+                        // socket can only be used for the next response once
+                        // the last chunk and the trailer have been too.
+                        void read_last_chunk()
+                        {
+                                const size_t block_size = 16 * 1024;
+                                auto data = response_buf.data();
+                                response_buf.consume(chunks.parse(
+                                        static_cast<const char*>(data.data()), data.size()));
+                                // Data after the end of the range leaves the
+                                // socket to be dropped
+                                if (chunks.done() || chunks.data_left() > 0)
+                                {
+                                        return finish_chunk();
+                                }
+                                set_deadline(download.limits.idle);
+                                auto self(shared_from_this());
+                                socket.async_read_some(
+                                        response_buf.prepare(block_size),
+                                        [this, self](const error_code& ec, size_t got) {
+                                                if (ec)
+                                                {
+                                                        keep_alive = false;
+                                                        return finish_chunk();
+                                                }
+                                                response_buf.commit(got);
+                                                read_last_chunk();
+                                        });
+                        }
+
+                        void finish_chunk()
+                        {
+                                clear_deadline();
+                                const requested_range& r = in_flight.front();
+                                clock::time_point finished = clock::now();
+                                download.scheduler.measure(
+                                        rate, received,
+                                        answered - std::max(r.sent, last_finished),
+                                        finished - answered);
+                                last_finished = finished;
+                                download.scheduler.finish(r.active);
+                                download.wake_parked();
+                                in_flight.pop_front();
+                                failures = 0;
+                                --sent;
+                                reused = true;
+                                ++answered_here;
+                                // If the tail of the range was stolen, or the
+                                // server sent more than was asked for, the rest
+                                // of the body is left unread and the socket
+                                // can't be reused. Anything queued behind it is
+                                // asked for again on a new one.
+                                if (!keep_alive || received < body_length
+                                    || (chunked && !chunks.done()))
+                                {
+                                        drop_socket();
+                                }
+                                received = 0;
+                                fetch_next_chunk();
+                        }
+
+                        // Give the rest of the first range back to the
+                        // scheduler, keeping what was written, and carry on
+                        // with a new socket.
+                        void requeue_front()
+                        {
+                                download.scheduler.requeue(in_flight.front().active, received);
+                                download.wake_parked();
+                                in_flight.pop_front();
+                                received = 0;
+                                drop_socket();
+                                fetch_next_chunk();
+                        }
+
+                        // The socket failed to open, broke or timed out. As
+                        // in download_chunks, the ranges this connection took
+                        // go back to the scheduler, keeping what was written
+                        // of the first, and it tries again on a new socket
+                        // after limits.backoff, twice as long after the next
+                        // failure, and so on. After limits.retries failures
+                        // in a row the download fails.
+                        void fail(const connection_error& error)
+                        {
+                                for (size_t i = in_flight.size(); i-- > 0; )
+                                {
+                                        download.scheduler.requeue(in_flight[i].active,
+                                                                   i == 0 ? received : 0);
+                                }
+                                in_flight.clear();
+                                received = 0;
+                                download.wake_parked();
+                                drop_socket();
+                                if (++failures > download.limits.retries)
+                                {
+                                        throw error;
+                                }
+                                pause.expires_after(to_clock(
+                                        download.limits.backoff * std::pow(2.0, failures - 1)));
+                                auto self(shared_from_this());
+                                pause.async_wait([this, self](const error_code&) {
+                                        fetch_next_chunk();
+                                });
+                        }
+
+                        void drop_socket()
+                        {
+                                clear_deadline();
+                                error_code ignored;
+                                socket.close(ignored);
+                                response_buf.consume(response_buf.size());
+                                sent = 0;
+                        }
+
+                        // Resend requests that failed before any of the
+                        // response arrived on a socket that has been used
+                        // before straight away, since the server may simply
+                        // have closed the connection in between.
+                        void retry_or_fail()
+                        {
+                                if (!reused)
+                                {
+                                        return fail(lost_connection());
+                                }
+                                // It dropped requests queued behind ones it
+                                // answered.
+                                if (answered_here > 0 && sent > 1 && !timed_out)
+                                {
+                                        download.pipelining = false;
+                                }
+                                drop_socket();
+                                connect();
+                        }
+                };
+        }
+
+        size_t download_file_async(
+                const std::string& host, uint16_t port, const std::string& path,
+                chunk_scheduler& scheduler, int connections, int pipeline_depth,
+                output_file& out, const transfer_limits& limits,
+                std::chrono::duration<double> connect_timeout)
+        {
+                async_download download(host, path, scheduler, out, limits, connect_timeout);
+                download.pipeline_depth = std::max(pipeline_depth, 1);
+
+                tcp::resolver resolver(download.io);
+                download.endpoints = resolver.resolve(host, std::to_string(port));
+
+                for (int i = 0; i < std::max(1, connections); ++i)
+                {
+                        std::make_shared<async_connection>(download)->start();
+                }
+                // A connection that runs out of retries, or gets a response
+                // the download can't use, throws from its handler, which
+                // fails the download. As in download_file_parallel, the
+                // scheduler is cancelled so nothing else is taken from it, and
+                // the other connections are stopped where they are: their
+                // handlers are dropped unrun and their sockets closed along
+                // with download, before the error is passed on.
+                try
+                {
+                        download.io.run();
+                }
+                catch (...)
+                {
+                        scheduler.cancel();
+                        download.io.stop();
+                        throw;
+                }
+
+                out.finish(scheduler.length());
+                return download.total_downloaded;
+        }
+}
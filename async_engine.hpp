@@ -0,0 +1,35 @@
+#ifndef ASYNC_ENGINE_HPP
+#define ASYNC_ENGINE_HPP
+
+#include "network.hpp"
+#include "output.hpp"
+#include "scheduler.hpp"
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <iterator>
+#include <string>
+
+namespace network
+{
+        // Download a file the same way as download_file_parallel, but instead
+        // of a thread per chunk, every connection is a non-blocking socket
+        // driven by a single io_context on the calling thread. Each
+        // connection keeps its socket open and takes the next range from a
+        // shared chunk_scheduler as soon as the previous one has been read,
+        // so up to connections ranges are in flight at once without a thread
+        // stack each. Requests are pipelined the same way too, and each
+        // connection is held to limits, and to connect_timeout while it
+        // opens, by a timer that closes its socket. If any connection runs
+        // out of retries or gets a response it can't use, every connection is
+        // stopped, the scheduler is cancelled and the error is thrown.
+        // Returns the amount of data downloaded.
+        size_t download_file_async(
+                const std::string& host, uint16_t port, const std::string& path,
+                chunk_scheduler& scheduler, int connections, int pipeline_depth,
+                output_file& out, const transfer_limits& limits = transfer_limits(),
+                std::chrono::duration<double> connect_timeout = std::chrono::seconds(10));
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "ci_string.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compare the ASCII case-insensitive routines with the character traits they
+// replaced, which called std::toupper on every character.
+
+namespace
+{
+        struct toupper_traits : public std::char_traits<char> {
+                static int compare(const char* s1, const char* s2, size_t n) {
+                        while ( n-- != 0 ) {
+                                if ( std::toupper(*s1) < std::toupper(*s2) ) return -1;
+                                if ( std::toupper(*s1) > std::toupper(*s2) ) return 1;
+                                ++s1; ++s2;
+                        }
+                        return 0;
+                }
+                static const char* find(const char* s, size_t n, char a) {
+                        auto const ua (std::toupper(a));
+                        while ( n-- != 0 )
+                        {
+                                if (std::toupper(*s) == ua)
+                                        return s;
+                                s++;
+                        }
+                        return nullptr;
+                }
+        };
+
+        // Header names of the usual lengths, and a few long values
+        const std::vector<std::string> names = {
+                "TE", "Date", "ETag", "Content-Length", "Content-Range",
+                "Transfer-Encoding", "Access-Control-Allow-Origin",
+                "Strict-Transport-Security",
+        };
+        const std::vector<std::string> values = {
+                "keep-alive",
+                "gzip, deflate, br, chunked",
+                "multipart/byteranges; boundary=3d6b6a416f9b5",
+                "max-age=31536000; includeSubDomains; preload; report-uri=https://example.com/r",
+        };
+
+        std::string upper(std::string s)
+        {
+                std::transform(s.begin(), s.end(), s.begin(),
+                               [](char c) { return std::toupper(c); });
+                return s;
+        }
+
+        template <typename F>
+        void run(const char* name, size_t iterations, F work)
+        {
+                // Keep the compiler from dropping the work
+                size_t checksum = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < iterations; ++i)
+                {
+                        checksum += work();
+                }
+                std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                std::cout << name << ": " << elapsed.count() / iterations * 1e9
+                          << " ns (" << checksum << ")\n";
+        }
+}
+
+int main(int argc, char* argv[])
+{
+        size_t iterations = argc > 1 ? std::stoul(argv[1]) : 200000;
+        std::vector<std::string> shouted;
+        for (const auto& name : names)
+        {
+                shouted.push_back(upper(name));
+        }
+
+        std::cout << "Comparing " << names.size() << " header names to their upper case\n";
+        run("  toupper traits", iterations, [&]() {
+                size_t same = 0;
+                for (size_t i = 0; i < names.size(); ++i)
+                {
+                        same += toupper_traits::compare(names[i].data(), shouted[i].data(),
+                                                        names[i].size()) == 0;
+                }
+                return same;
+        });
+        run("  ci::compare", iterations, [&]() {
+                size_t same = 0;
+                for (size_t i = 0; i < names.size(); ++i)
+                {
+                        same += ci::compare(names[i].data(), shouted[i].data(),
+                                            names[i].size()) == 0;
+                }
+                return same;
+        });
+
+        std::cout << "Looking for 'B' in " << values.size() << " field values\n";
+        run("  toupper traits", iterations, [&]() {
+                size_t found = 0;
+                for (const auto& value : values)
+                {
+                        found += toupper_traits::find(value.data(), value.size(), 'B') != nullptr;
+                }
+                return found;
+        });
+        run("  ci::find", iterations, [&]() {
+                size_t found = 0;
+                for (const auto& value : values)
+                {
+                        found += ci::find(value.data(), value.size(), 'B') != nullptr;
+                }
+                return found;
+        });
+
+        std::cout << "Hashing " << names.size() << " header names\n";
+        run("  upper case copy and std::hash", iterations, [&]() {
+                size_t h = 0;
+                for (const auto& name : names)
+                {
+                        h ^= std::hash<std::string>()(upper(name));
+                }
+                return h & 1;
+        });
+        run("  ci::hash", iterations, [&]() {
+                size_t h = 0;
+                for (const auto& name : names)
+                {
+                        h ^= ci::hash(name);
+                }
+                return h & 1;
+        });
+
+        std::cout << "Converting " << values.size() << " values to ci::string\n";
+        run("  through iterators", iterations, [&]() {
+                size_t size = 0;
+                for (const auto& value : values)
+                {
+                        size += ci::string(value.cbegin(), value.cend()).size();
+                }
+                return size;
+        });
+        run("  ci::from_string", iterations, [&]() {
+                size_t size = 0;
+                for (const auto& value : values)
+                {
+                        size += ci::from_string(value).size();
+                }
+                return size;
+        });
+}
@@ -0,0 +1,79 @@
+#include "message.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Compare reading a typical response header through an istream with parsing
+// it straight from the receive buffer, whole or as it trickles in.
+
+namespace
+{
+        const std::string header =
+                "HTTP/1.1 206 Partial Content\r\n"
+                "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n"
+                "Server: Apache/2.4.57 (Unix)\r\n"
+                "Last-Modified: Mon, 12 Oct 2026 08:30:00 GMT\r\n"
+                "ETag: \"5f2a-1e8480-5b1c\"\r\n"
+                "Accept-Ranges: bytes\r\n"
+                "Content-Length: 1048576\r\n"
+                "Content-Range: bytes 1048576-2097151/20000000\r\n"
+                "Cache-Control: max-age=3600\r\n"
+                "Connection: keep-alive\r\n"
+                "Content-Type: application/octet-stream\r\n"
+                "\r\n";
+
+        template <typename F>
+        void run(const char* name, size_t iterations, F parse_one)
+        {
+                // Keep the compiler from dropping the work
+                size_t checksum = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < iterations; ++i)
+                {
+                        checksum += parse_one();
+                }
+                std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                std::cout << name << ": "
+                          << elapsed.count() / iterations * 1e9 << " ns per header, "
+                          << header.size() * iterations / elapsed.count() / 1e6
+                          << " MB/s (" << checksum << ")\n";
+        }
+}
+
+int main(int argc, char* argv[])
+{
+        size_t iterations = argc > 1 ? std::stoul(argv[1]) : 200000;
+
+        run("istream read_header", iterations, []() {
+                std::istringstream is(header);
+                auto response = message::response_message::read_header(is);
+                return size_t(response.status_code());
+        });
+
+        run("response_parser, whole buffer", iterations, []() {
+                message::response_parser parser;
+                parser.parse(header.data(), header.size());
+                return parser.field_count() + parser.find_field("Content-Length").size();
+        });
+
+        run("response_parser, 64-byte reads", iterations, []() {
+                message::response_parser parser;
+                for (size_t size = 64;
+                     !parser.parse(header.data(), std::min(size, header.size()));
+                     size += 64)
+                {
+                }
+                return parser.field_count() + parser.find_field("Content-Length").size();
+        });
+
+        message::response_parser parsed;
+        parsed.parse(header.data(), header.size());
+        run("response_message from the parser", iterations, [&parsed]() {
+                message::response_message response(parsed);
+                return response.content_length();
+        });
+}
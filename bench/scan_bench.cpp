@@ -0,0 +1,134 @@
+#include "message.hpp"
+#include "scan.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Compare finding the line ends and colons in some typical response headers,
+// and parsing them, with the scalar, SSE2 and AVX2 kernels, against reading
+// them through an istream.
+
+namespace
+{
+        struct sample
+        {
+                const char* name;
+                std::string header;
+        };
+
+        std::vector<sample> samples()
+        {
+                std::vector<sample> s;
+                s.push_back({"small 206",
+                        "HTTP/1.1 206 Partial Content\r\n"
+                        "Content-Length: 1048576\r\n"
+                        "Content-Range: bytes 1048576-2097151/20000000\r\n"
+                        "\r\n"});
+                s.push_back({"object store",
+                        "HTTP/1.1 206 Partial Content\r\n"
+                        "x-amz-id-2: 4Hq7u0dMuVZbGfFv0q2vCZ1QnJ1bK8cYl8m0qWk1T8rY3C2y7Yp9Q3v4X0aE1hZpQ6o9VtL2sA=\r\n"
+                        "x-amz-request-id: 7C1A4F2E9B3D5A60\r\n"
+                        "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n"
+                        "Last-Modified: Mon, 12 Oct 2026 08:30:00 GMT\r\n"
+                        "ETag: \"9b2cf535f27731c974343645a3985328-12\"\r\n"
+                        "x-amz-server-side-encryption: AES256\r\n"
+                        "x-amz-version-id: 3HL4kqtJlcpXroDTDmJ-rmSpXd3dIbrHY\r\n"
+                        "Accept-Ranges: bytes\r\n"
+                        "Content-Range: bytes 1048576-2097151/20000000\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Content-Length: 1048576\r\n"
+                        "Server: AmazonS3\r\n"
+                        "\r\n"});
+                std::string cookies;
+                for (int i = 0; i < 4; ++i)
+                {
+                        cookies += "X-Session-" + std::to_string(i) + ": "
+                                + std::string(180, 'a' + i)
+                                + "; Path=/; Secure; HttpOnly; SameSite=Lax\r\n";
+                }
+                s.push_back({"CDN with long values",
+                        "HTTP/1.1 206 Partial Content\r\n"
+                        "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n"
+                        "Content-Type: application/octet-stream\r\n"
+                        "Content-Length: 1048576\r\n"
+                        "Content-Range: bytes 1048576-2097151/20000000\r\n"
+                        "Connection: keep-alive\r\n"
+                        + cookies +
+                        "X-Content-Security-Policy: default-src 'self'; img-src 'self' https://img.example.com; "
+                        "script-src 'self' https://cdn.example.com 'sha256-q1w2e3r4t5y6u7i8o9p0'; "
+                        "style-src 'self' 'unsafe-inline'; frame-ancestors 'none'\r\n"
+                        "Cache-Control: public, max-age=31536000, immutable\r\n"
+                        "Age: 1234\r\n"
+                        "X-Cache: Hit from cloudfront\r\n"
+                        "Via: 1.1 5f2a.cloudfront.net (CloudFront)\r\n"
+                        "\r\n"});
+                return s;
+        }
+
+        template <typename F>
+        void run(const std::string& name, size_t bytes, size_t iterations, F work)
+        {
+                // Keep the compiler from dropping the work
+                size_t checksum = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < iterations; ++i)
+                {
+                        checksum += work();
+                }
+                std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                std::cout << "  " << name << ": "
+                          << elapsed.count() / iterations * 1e9 << " ns, "
+                          << bytes * iterations / elapsed.count() / 1e6
+                          << " MB/s (" << checksum << ")\n";
+        }
+}
+
+int main(int argc, char* argv[])
+{
+        size_t iterations = argc > 1 ? std::stoul(argv[1]) : 200000;
+        const std::pair<scan::level, const char*> levels[] = {
+                {scan::level::scalar, "scalar"},
+                {scan::level::sse2, "sse2"},
+                {scan::level::avx2, "avx2"},
+        };
+
+        for (const auto& s : samples())
+        {
+                const std::string& header = s.header;
+                std::cout << s.name << " (" << header.size() << " bytes)\n";
+                run("istream read_header", header.size(), iterations / 10, [&]() {
+                        std::istringstream is(header);
+                        auto response = message::response_message::read_header(is);
+                        return size_t(response.status_code());
+                });
+                for (const auto& l : levels)
+                {
+                        if (!scan::use(l.first))
+                        {
+                                std::cout << "  " << l.second << ": not supported\n";
+                                continue;
+                        }
+                        run(std::string(l.second) + " classify", header.size(), iterations, [&]() {
+                                size_t found = 0;
+                                for (size_t i = 0; i < header.size(); i += scan::block_size)
+                                {
+                                        scan::masks m = scan::classify(
+                                                header.data() + i, header.data() + header.size());
+                                        found += __builtin_popcountll(m.newlines | m.colons);
+                                }
+                                return found;
+                        });
+                        run(std::string(l.second) + " response_parser", header.size(),
+                            iterations, [&]() {
+                                message::response_parser parser;
+                                parser.parse(header.data(), header.size());
+                                return parser.field_count();
+                        });
+                }
+                scan::use(scan::level::avx2) || scan::use(scan::level::sse2);
+        }
+}
@@ -1,19 +1,179 @@
 #include "ci_string.hpp"
 
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+        const uint64_t ones = 0x0101010101010101;
+        const uint64_t highs = 0x8080808080808080;
+
+        uint64_t load_word(const char* s)
+        {
+                uint64_t word;
+                std::memcpy(&word, s, sizeof(word));
+                return word;
+        }
+
+        // Every a-z byte of the word made upper case. Adding to the low
+        // seven bits of each byte sets its top bit if it's at least 'a', or
+        // more than 'z', without carrying into the next byte. Bytes with the
+        // top bit already set aren't ASCII, and are left alone.
+        uint64_t upper_word(uint64_t word)
+        {
+                uint64_t low_bits = word & ~highs;
+                uint64_t from_a = low_bits + ones * (0x80 - 'a');
+                uint64_t past_z = low_bits + ones * (0x80 - 'z' - 1);
+                uint64_t lower = from_a & ~past_z & ~word & highs;
+                return word - (lower >> 2);
+        }
+
+        // Whether any byte of the word is zero
+        bool has_zero(uint64_t word)
+        {
+                return (word - ones) & ~word & highs;
+        }
+
+#ifdef __SSE2__
+        __m128i load_block(const char* s)
+        {
+                return _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        }
+
+        // Bytes compare as signed, so the ones that aren't ASCII are never
+        // between 'a' and 'z'
+        __m128i upper_block(__m128i block)
+        {
+                __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('a' - 1)),
+                                              _mm_cmplt_epi8(block, _mm_set1_epi8('z' + 1)));
+                return _mm_sub_epi8(block, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+        }
+#endif
+
+        uint64_t mix(uint64_t h)
+        {
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccd;
+                h ^= h >> 33;
+                h *= 0xc4ceb9fe1a85ec53;
+                h ^= h >> 33;
+                return h;
+        }
+}
+
 namespace ci
 {
+        // Skip along a register, then a word, at a time while everything
+        // matches, and find where it stops a byte at a time.
+        int compare(const char* s1, const char* s2, size_t n)
+        {
+                size_t i = 0;
+#ifdef __SSE2__
+                for (; n - i >= 16; i += 16)
+                {
+                        __m128i same = _mm_cmpeq_epi8(upper_block(load_block(s1 + i)),
+                                                      upper_block(load_block(s2 + i)));
+                        if (_mm_movemask_epi8(same) != 0xffff)
+                        {
+                                break;
+                        }
+                }
+#endif
+                for (; n - i >= 8; i += 8)
+                {
+                        if (upper_word(load_word(s1 + i)) != upper_word(load_word(s2 + i)))
+                        {
+                                break;
+                        }
+                }
+                for (; i < n; ++i)
+                {
+                        unsigned char c1 = to_upper(s1[i]);
+                        unsigned char c2 = to_upper(s2[i]);
+                        if (c1 != c2)
+                        {
+                                return c1 < c2 ? -1 : 1;
+                        }
+                }
+                return 0;
+        }
+
+        bool equal(std::string_view s1, std::string_view s2)
+        {
+                return s1.size() == s2.size() && compare(s1.data(), s2.data(), s1.size()) == 0;
+        }
+
+        const char* find(const char* s, size_t n, char a)
+        {
+                const char wanted = to_upper(a);
+                size_t i = 0;
+#ifdef __SSE2__
+                const __m128i wanted_block = _mm_set1_epi8(wanted);
+                for (; n - i >= 16; i += 16)
+                {
+                        unsigned found = _mm_movemask_epi8(
+                                _mm_cmpeq_epi8(upper_block(load_block(s + i)), wanted_block));
+                        if (found)
+                        {
+                                return s + i + __builtin_ctz(found);
+                        }
+                }
+#endif
+                const uint64_t wanted_word = ones * static_cast<unsigned char>(wanted);
+                for (; n - i >= 8; i += 8)
+                {
+                        if (has_zero(upper_word(load_word(s + i)) ^ wanted_word))
+                        {
+                                break;
+                        }
+                }
+                for (; i < n; ++i)
+                {
+                        if (to_upper(s[i]) == wanted)
+                        {
+                                return s + i;
+                        }
+                }
+                return nullptr;
+        }
+
+        // Each upper case word is folded in with a multiply, and the
+        // result mixed so that every bit depends on every byte
+        size_t hash(std::string_view s)
+        {
+                uint64_t h = 0x9e3779b97f4a7c15 ^ s.size();
+                size_t i = 0;
+                for (; s.size() - i >= 8; i += 8)
+                {
+                        h = (h ^ upper_word(load_word(s.data() + i))) * 0x100000001b3;
+                        h ^= h >> 29;
+                }
+                if (i < s.size())
+                {
+                        uint64_t last = 0;
+                        std::memcpy(&last, s.data() + i, s.size() - i);
+                        h = (h ^ upper_word(last)) * 0x100000001b3;
+                }
+                return mix(h);
+        }
+
         ci::string from_string(const std::string& s)
         {
-                return ci::string(s.cbegin(), s.cend());
+                return ci::string(s.data(), s.size());
         }
-        
+
         std::string to_string(const ci::string& s)
         {
-                return std::string(s.cbegin(), s.cend());
+                return std::string(s.data(), s.size());
         }
-        
+
         std::ostream& operator<<(std::ostream& os, ci::string s)
         {
-                return os << to_string(s);
+                return os << std::string_view(s.data(), s.size());
         }
 }
@@ -1,36 +1,61 @@
 #ifndef CI_STRING_HPP
 #define CI_STRING_HPP
 
+#include <cstddef>
 #include <string>
+#include <string_view>
 
 namespace ci
 {
-        // Case-insensitive characters, copied from
+        // Case folding here is ASCII only, whatever the locale, which is
+        // what HTTP wants: only A-Z and a-z are the same letters. The
+        // functions below work a word or an SSE2 register at a time.
+
+        inline char to_upper(char c)
+        {
+                return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+        }
+
+        // Compare the first n characters of s1 and s2, like memcmp
+        int compare(const char* s1, const char* s2, size_t n);
+        bool equal(std::string_view s1, std::string_view s2);
+        // The first character of the n at s that is a, or nullptr
+        const char* find(const char* s, size_t n, char a);
+        // A hash that's the same for strings that are equal
+        size_t hash(std::string_view s);
+
+        // For hash tables keyed without regard to case
+        struct hasher
+        {
+                size_t operator()(std::string_view s) const
+                {
+                        return hash(s);
+                }
+        };
+
+        struct equal_to
+        {
+                bool operator()(std::string_view s1, std::string_view s2) const
+                {
+                        return equal(s1, s2);
+                }
+        };
+
+        // Case-insensitive characters, after
         // http://en.cppreference.com/w/cpp/string/char_traits
         struct ci_char_traits : public std::char_traits<char> {
                 static bool eq(char c1, char c2) {
-                        return std::toupper(c1) == std::toupper(c2);
+                        return to_upper(c1) == to_upper(c2);
                 }
                 static bool lt(char c1, char c2) {
-                        return std::toupper(c1) <  std::toupper(c2);
+                        return static_cast<unsigned char>(to_upper(c1))
+                                < static_cast<unsigned char>(to_upper(c2));
                 }
                 static int compare(const char* s1, const char* s2, size_t n) {
-                        while ( n-- != 0 ) {
-                                if ( std::toupper(*s1) < std::toupper(*s2) ) return -1;
-                                if ( std::toupper(*s1) > std::toupper(*s2) ) return 1;
-                                ++s1; ++s2;
-                        }
-                        return 0;
+                        return ci::compare(s1, s2, n);
                 }
-                static const char* find(const char* s, int n, char a) {
-                        auto const ua (std::toupper(a));
-                        while ( n-- != 0 ) 
-                        {
-                                if (std::toupper(*s) == ua)
-                                        return s;
-                                s++;
-                        }
-                        return nullptr;
+                static const char* find(const char* s, size_t n, char a) {
+                        return ci::find(s, n, a);
                 }
         };
         using string = std::basic_string<char, ci_char_traits>;
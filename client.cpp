@@ -1,6 +1,11 @@
 #include <fstream>
 #include "network.hpp"
+#include "async_engine.hpp"
+#include "journal.hpp"
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
 #include <unistd.h>
 
 #include <boost/program_options.hpp>
@@ -12,10 +17,28 @@ int main(int argc, const char* argv[]) {
         po::options_description desc("Options");
         desc.add_options()
                 ("chunk-size", po::value<size_t>()->default_value(1024*1024), "the size of chunk to download")
-                ("chunk-number", po::value<int>()->default_value(4), "the number of chunks to download")
-                ("url", po::value<std::string>()->required(), "where to download from")
+                ("chunk-number", po::value<int>()->default_value(0), "the number of chunks to download, or 0 for the whole file")
+                ("adaptive", po::bool_switch()->default_value(false), "size each chunk of a parallel download from how fast its connection is, starting at chunk-size")
+                ("min-chunk-size", po::value<size_t>()->default_value(64*1024), "the smallest chunk an adaptive download requests")
+                ("max-chunk-size", po::value<size_t>()->default_value(64*1024*1024), "the largest chunk an adaptive download requests")
+                ("hedge", po::value<double>()->default_value(5), "at the end of a parallel download, let idle connections ask again for the tail of the slowest range, duplicating at most this percentage of the file (0 to turn it off)")
+                ("connections", po::value<int>()->default_value(4), "the number of connections a parallel download uses at once")
+                ("pipeline", po::value<int>()->default_value(1), "the number of requests a parallel download sends on a connection before reading the first response")
+                ("ranges", po::value<std::string>(), "download only these byte ranges of the file, e.g. 0-99,500-599, batching them into multipart requests")
+                ("connect-timeout", po::value<double>()->default_value(10), "seconds to wait for a connection to open")
+                ("first-byte-timeout", po::value<double>()->default_value(30), "seconds to wait for a response to start once its request has been sent")
+                ("idle-timeout", po::value<double>()->default_value(30), "seconds a response body may go without any data arriving")
+                ("min-rate", po::value<double>()->default_value(0), "the slowest a response body may arrive in bytes per second, or 0 for no minimum; slower connections are replaced")
+                ("min-rate-window", po::value<double>()->default_value(10), "seconds a response body has to arrive before it's held to --min-rate")
+                ("retries", po::value<int>()->default_value(5), "how many times in a row to retry a connection that fails or times out before giving up on the server")
+                ("retry-backoff", po::value<double>()->default_value(0.1), "seconds to wait before the first retry, doubling for each retry after that")
+                ("url", po::value<std::vector<std::string>>()->required(), "where to download from; give it more than once to spread a parallel download across mirrors of the file")
                 ("outfile", po::value<std::string>()->default_value("download"), "the path to write the downloaded file to")
                 ("serial", po::bool_switch()->default_value(false), "use serial download instead of the default parallel")
+                ("engine", po::value<std::string>()->default_value("threads"), "how to run parallel downloads: 'threads' for a thread per connection, 'async' for non-blocking sockets on a single thread")
+                ("output", po::value<std::string>()->default_value("memory"), "how a parallel download writes the file: 'memory' to buffer it all and write it at the end, 'pwrite' to write each chunk to its offset as it arrives, 'mmap' to read chunks straight into a memory-mapped file")
+                ("resume", po::bool_switch()->default_value(false), "carry on with an interrupted download of outfile, fetching only the ranges its journal doesn't have (needs --output=pwrite or mmap)")
+                ("stats", po::bool_switch()->default_value(false), "print connection statistics when the download finishes")
                 ;
         po::variables_map vars;
         try
@@ -30,24 +53,178 @@ int main(int argc, const char* argv[]) {
                 return 1;
         }
         
+        std::string engine(vars["engine"].as<std::string>());
+        if (engine != "threads" && engine != "async")
+        {
+                std::cerr << "Bad options: unknown engine " << engine << '\n';
+                std::cerr << desc << '\n';
+                return 1;
+        }
+        std::string output(vars["output"].as<std::string>());
+        if (output != "memory" && output != "pwrite" && output != "mmap")
+        {
+                std::cerr << "Bad options: unknown output " << output << '\n';
+                std::cerr << desc << '\n';
+                return 1;
+        }
+
+        bool resume = vars["resume"].as<bool>();
+        if (resume && (output == "memory" || vars["serial"].as<bool>()))
+        {
+                std::cerr << "Bad options: --resume needs a parallel download with --output=pwrite or mmap\n";
+                std::cerr << desc << '\n';
+                return 1;
+        }
+
+        std::vector<network::mirror> mirrors;
+        for (const std::string& url : vars["url"].as<std::vector<std::string>>())
+        {
+                network::mirror m;
+                std::tie(m.host, m.path) = network::parse_url(url);
+                m.port = 80;
+                mirrors.push_back(m);
+        }
+        if (mirrors.size() > 1
+            && (vars["serial"].as<bool>() || engine == "async" || vars.count("ranges")))
+        {
+                std::cerr << "Bad options: more than one --url needs a parallel download with --engine=threads\n";
+                std::cerr << desc << '\n';
+                return 1;
+        }
+
         size_t chunk_size = vars["chunk-size"].as<size_t>();
         int chunk_number = vars["chunk-number"].as<int>();
+        int connections = vars["connections"].as<int>();
+        int pipeline = vars["pipeline"].as<int>();
         std::string outfile(vars["outfile"].as<std::string>());
-        std::string host, path;
-        std::tie(host, path) = network::parse_url(vars["url"].as<std::string>());
+        const std::string& host = mirrors[0].host;
+        const std::string& path = mirrors[0].path;
         
-        std::ofstream fs(outfile, std::ios::out | std::ios::binary | std::ios::trunc);
-        std::ostream_iterator<uint8_t> os(fs);
-        if (vars["serial"].as<bool>())
+        network::transfer_limits limits;
+        limits.first_byte = std::chrono::duration<double>(vars["first-byte-timeout"].as<double>());
+        limits.idle = std::chrono::duration<double>(vars["idle-timeout"].as<double>());
+        limits.min_rate = vars["min-rate"].as<double>();
+        limits.min_rate_window = std::chrono::duration<double>(vars["min-rate-window"].as<double>());
+        limits.retries = vars["retries"].as<int>();
+        limits.backoff = std::chrono::duration<double>(vars["retry-backoff"].as<double>());
+        network::connection_pool pool(
+                std::chrono::duration<double>(vars["connect-timeout"].as<double>()));
+        try
+        {
+                if (vars["serial"].as<bool>())
+                {
+                        std::ofstream fs(outfile, std::ios::out | std::ios::binary | std::ios::trunc);
+                        std::ostream_iterator<uint8_t> os(fs);
+                        network::download_file_sequential(
+                                pool, host, 80, path,
+                                chunk_number, chunk_size, os, limits);
+                }
+                else
+                {
+                        std::ofstream fs;
+                        std::ostream_iterator<uint8_t> os(fs);
+                        // Downloads straight to a file keep a journal next to it, so
+                        // they can be resumed if they're interrupted.
+                        std::string journal_path = outfile + ".journal";
+                        network::journal_contents resumed;
+                        bool resuming = resume && network::read_journal(journal_path, resumed);
+                        std::unique_ptr<network::output_file> file;
+                        std::unique_ptr<network::output_file> out;
+                        if (output == "pwrite")
+                        {
+                                file.reset(new network::pwrite_output(outfile, !resuming));
+                        }
+                        else if (output == "mmap")
+                        {
+                                file.reset(new network::mmap_output(outfile, !resuming));
+                        }
+                        if (file)
+                        {
+                                out.reset(new network::journaled_output(
+                                                  *file, journal_path,
+                                                  resuming ? &resumed : nullptr));
+                        }
+                        else
+                        {
+                                fs.open(outfile, std::ios::out | std::ios::binary | std::ios::trunc);
+                                out.reset(new network::memory_output(os));
+                        }
+                        network::chunk_scheduler scheduler(
+                                chunk_size,
+                                chunk_number > 0 ? chunk_number * chunk_size : SIZE_MAX);
+                        if (resuming)
+                        {
+                                scheduler.skip(resumed.completed);
+                        }
+                        if (vars["adaptive"].as<bool>())
+                        {
+                                scheduler.adapt(vars["min-chunk-size"].as<size_t>(),
+                                                vars["max-chunk-size"].as<size_t>());
+                        }
+                        scheduler.hedge(vars["hedge"].as<double>());
+                        if (vars.count("ranges"))
+                        {
+                                std::vector<network::chunk> ranges;
+                                std::istringstream spec(vars["ranges"].as<std::string>());
+                                for (std::string range; std::getline(spec, range, ','); )
+                                {
+                                        network::chunk c;
+                                        char dash;
+                                        std::istringstream is(range);
+                                        if (!(is >> c.first_byte >> dash >> c.last_byte)
+                                            || dash != '-' || c.last_byte < c.first_byte)
+                                        {
+                                                std::cerr << "Bad options: invalid range " << range << '\n';
+                                                return 1;
+                                        }
+                                        ranges.push_back(c);
+                                }
+                                network::download_ranges(pool, host, 80, path, ranges, *out, limits);
+                        }
+                        else if (engine == "async")
+                        {
+                                network::download_file_async(
+                                        host, 80, path, scheduler, connections, pipeline, *out,
+                                        limits,
+                                        std::chrono::duration<double>(
+                                                vars["connect-timeout"].as<double>()));
+                        }
+                        else
+                        {
+                                network::download_file_parallel(
+                                        pool, mirrors, scheduler, connections, pipeline,
+                                        *out, limits);
+                                for (const network::mirror& m : mirrors)
+                                {
+                                        if (!m.error.empty())
+                                        {
+                                                std::cerr << "Dropped mirror " << m.host << m.path
+                                                          << ": " << m.error << '\n';
+                                        }
+                                }
+                        }
+                        if (vars["stats"].as<bool>() && !vars.count("ranges"))
+                        {
+                                std::cerr << "Hedged requests: " << scheduler.hedges()
+                                          << ", bytes read twice: " << scheduler.wasted() << '\n';
+                        }
+                }
+        }
+        catch (std::exception& e)
         {
-                network::download_file_sequential(
-                        host, 80, path,
-                        chunk_number, chunk_size, os);
+                // Failing here rather than in terminate unwinds the stack, so
+                // the journal records everything that was written.
+                std::cerr << "Download failed: " << e.what() << '\n';
+                return 1;
         }
-        else
+        if (vars["stats"].as<bool>())
         {
-                network::download_file_parallel(
-                        host, 80, path,
-                        chunk_number, chunk_size, os);
+                std::cerr << "Connections reused: " << pool.hits()
+                          << ", opened: " << pool.misses() << '\n';
+                for (const auto& address : pool.connect_latencies())
+                {
+                        std::cerr << "Connect time to " << address.first << ": "
+                                  << address.second.count() * 1000 << " ms\n";
+                }
         }
 }
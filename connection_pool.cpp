@@ -0,0 +1,90 @@
+#include "connection_pool.hpp"
+
+#include <stdexcept>
+
+namespace network
+{
+        connection_pool::connection_pool(connector::duration connect_timeout)
+                : racer(std::chrono::milliseconds(250), connect_timeout)
+        {
+        }
+
+        connection_pool::connection
+        connection_pool::checkout(const std::string& host, uint16_t port,
+                                  bool& reused)
+        {
+                {
+                        std::lock_guard<std::mutex> guard(idle_lock);
+                        auto it = idle.find(key(host, port));
+                        if (it != idle.end() && !it->second.empty())
+                        {
+                                connection c = std::move(it->second.back());
+                                it->second.pop_back();
+                                ++hit_count;
+                                reused = true;
+                                return c;
+                        }
+                }
+                reused = false;
+                return open(host, port);
+        }
+
+        connection_pool::connection
+        connection_pool::open(const std::string& host, uint16_t port)
+        {
+                ++miss_count;
+                std::vector<tcp::endpoint> endpoints = racer.order(names.rotate(host, port));
+                try
+                {
+                        return connection(new tcp::iostream(racer.connect(io, endpoints)));
+                }
+                catch (const std::runtime_error&)
+                {
+                        throw connection_error("Unable to connect to " + host);
+                }
+        }
+
+        resolver_cache& connection_pool::resolver()
+        {
+                return names;
+        }
+
+        std::map<tcp::endpoint, connector::duration>
+        connection_pool::connect_latencies() const
+        {
+                return racer.latencies();
+        }
+
+        void connection_pool::checkin(const std::string& host, uint16_t port,
+                                      connection c)
+        {
+                if (!c || !*c || c->error())
+                {
+                        return;
+                }
+                std::lock_guard<std::mutex> guard(idle_lock);
+                idle[key(host, port)].push_back(std::move(c));
+        }
+
+        bool connection_pool::pipelining(const std::string& host, uint16_t port) const
+        {
+                std::lock_guard<std::mutex> guard(hosts_lock);
+                return unpipelined.count(key(host, port)) == 0;
+        }
+
+        void connection_pool::disable_pipelining(const std::string& host, uint16_t port)
+        {
+                std::lock_guard<std::mutex> guard(hosts_lock);
+                unpipelined.insert(key(host, port));
+        }
+
+        size_t connection_pool::hits() const
+        {
+                return hit_count;
+        }
+
+        size_t connection_pool::misses() const
+        {
+                return miss_count;
+        }
+}
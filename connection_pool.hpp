@@ -0,0 +1,107 @@
+#ifndef CONNECTION_POOL_HPP
+#define CONNECTION_POOL_HPP
+
+#include "connector.hpp"
+#include "resolver_cache.hpp"
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace network
+{
+        using boost::asio::ip::tcp;
+
+        // Thrown when a connection can't be opened, or breaks or times out
+        // before a response has been read, which may well not happen again
+        // on another connection.
+        class connection_error : public std::runtime_error
+        {
+        public:
+                using std::runtime_error::runtime_error;
+        };
+
+        // A connection_pool keeps idle HTTP/1.1 connections to each host so
+        // that successive chunk requests can reuse them instead of paying for
+        // name resolution, a TCP handshake and slow start every time. New
+        // connections take the host's addresses from a shared resolver_cache,
+        // starting at a different address each time, and race them with a
+        // connector, which puts addresses that have been slow to connect
+        // last.
+        //
+        // Connections are checked out for the duration of one request and
+        // checked back in once the response has been read completely. A
+        // connection that the server asked to close, or that is in an error
+        // state, must not be returned.
+        class connection_pool
+        {
+        public:
+                using connection = std::unique_ptr<tcp::iostream>;
+
+                // Give up on opening a connection after connect_timeout.
+                explicit connection_pool(
+                        connector::duration connect_timeout = std::chrono::seconds(10));
+
+                // Take an idle connection to host:port if there is one,
+                // otherwise open a new one. reused is set to whether the
+                // connection came from the pool, since a pooled connection may
+                // have been closed by the server while it sat idle.
+                connection checkout(const std::string& host, uint16_t port,
+                                    bool& reused);
+
+                // Open a new connection to host:port, bypassing the idle list.
+                // Throws connection_error if it can't be opened.
+                connection open(const std::string& host, uint16_t port);
+
+                // Where the addresses of hosts are looked up.
+                resolver_cache& resolver();
+
+                // How long connections to each address took to connect.
+                std::map<tcp::endpoint, connector::duration> connect_latencies() const;
+
+                // Return a connection to the pool so it can be reused.
+                void checkin(const std::string& host, uint16_t port,
+                             connection c);
+
+                // Whether several requests may be written to a connection to
+                // host:port before their responses are read. That's assumed
+                // until disable_pipelining is called because the server
+                // closed a connection with requests outstanding, or answered
+                // them out of order.
+                bool pipelining(const std::string& host, uint16_t port) const;
+                void disable_pipelining(const std::string& host, uint16_t port);
+
+                // Number of checkouts that were satisfied from the pool, and
+                // the number that needed a new connection.
+                size_t hits() const;
+                size_t misses() const;
+
+        private:
+                using key = std::pair<std::string, uint16_t>;
+
+                resolver_cache names;
+                // The pool's connections belong to io, which is never run;
+                // the connector only uses it to hand over the sockets.
+                boost::asio::io_context io;
+                connector racer;
+
+                std::mutex idle_lock;
+                std::map<key, std::vector<connection>> idle;
+
+                mutable std::mutex hosts_lock;
+                std::set<key> unpipelined;
+
+                std::atomic<size_t> hit_count{0};
+                std::atomic<size_t> miss_count{0};
+        };
+}
+
+#endif
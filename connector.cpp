@@ -0,0 +1,221 @@
+#include "connector.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+namespace network
+{
+        namespace
+        {
+                using clock = std::chrono::steady_clock;
+
+                // Alternate between the address families, keeping the order
+                // within each and starting with the family of the first
+                // address.
+                std::vector<tcp::endpoint> interleave(const std::vector<tcp::endpoint>& endpoints)
+                {
+                        if (endpoints.empty())
+                        {
+                                return endpoints;
+                        }
+                        std::vector<tcp::endpoint> first, second;
+                        for (const tcp::endpoint& e : endpoints)
+                        {
+                                (e.protocol() == endpoints[0].protocol() ? first : second)
+                                        .push_back(e);
+                        }
+                        std::vector<tcp::endpoint> result;
+                        for (size_t i = 0; i < std::max(first.size(), second.size()); ++i)
+                        {
+                                if (i < first.size())
+                                {
+                                        result.push_back(first[i]);
+                                }
+                                if (i < second.size())
+                                {
+                                        result.push_back(second[i]);
+                                }
+                        }
+                        return result;
+                }
+
+                clock::duration to_clock(connector::duration d)
+                {
+                        return std::chrono::duration_cast<clock::duration>(d);
+                }
+        }
+
+        connector::connector(duration stagger, duration timeout)
+                : stagger(stagger), timeout(timeout)
+        {
+        }
+
+        std::vector<tcp::endpoint> connector::order(
+                const std::vector<tcp::endpoint>& endpoints) const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                duration best{0};
+                for (const tcp::endpoint& e : endpoints)
+                {
+                        auto it = stats.find(e);
+                        if (it != stats.end() && it->second.connected && !it->second.failed
+                            && (best == duration(0) || it->second.latency < best))
+                        {
+                                best = it->second.latency;
+                        }
+                }
+                std::vector<tcp::endpoint> good, slow, failed;
+                for (const tcp::endpoint& e : endpoints)
+                {
+                        auto it = stats.find(e);
+                        if (it == stats.end())
+                        {
+                                good.push_back(e);
+                        }
+                        else if (it->second.failed)
+                        {
+                                failed.push_back(e);
+                        }
+                        // A few milliseconds either way is just noise
+                        else if (it->second.latency
+                                 > best * 2 + std::chrono::milliseconds(20))
+                        {
+                                slow.push_back(e);
+                        }
+                        else
+                        {
+                                good.push_back(e);
+                        }
+                }
+                std::vector<tcp::endpoint> result = interleave(good);
+                for (const tcp::endpoint& e : interleave(slow))
+                {
+                        result.push_back(e);
+                }
+                for (const tcp::endpoint& e : interleave(failed))
+                {
+                        result.push_back(e);
+                }
+                return result;
+        }
+
+        tcp::socket connector::connect(boost::asio::io_context& io,
+                                       const std::vector<tcp::endpoint>& endpoints)
+        {
+                // The attempts run on an io_context of their own, so that
+                // connections being opened at the same time don't run each
+                // other's handlers.
+                boost::asio::io_context race;
+                boost::asio::steady_timer next_attempt(race);
+                std::vector<std::unique_ptr<tcp::socket>> attempts;
+                std::vector<clock::time_point> started;
+                std::vector<bool> failed;
+                size_t failures = 0;
+                bool won = false;
+                size_t winner = 0;
+
+                std::function<void()> start_next = [&]() {
+                        size_t i = attempts.size();
+                        if (i == endpoints.size())
+                        {
+                                return;
+                        }
+                        attempts.emplace_back(new tcp::socket(race));
+                        started.push_back(clock::now());
+                        failed.push_back(false);
+                        attempts[i]->async_connect(
+                                endpoints[i],
+                                [&, i](const boost::system::error_code& error) {
+                                        if (won || error == boost::asio::error::operation_aborted)
+                                        {
+                                                return;
+                                        }
+                                        if (!error)
+                                        {
+                                                won = true;
+                                                winner = i;
+                                                clock::time_point now = clock::now();
+                                                record(endpoints[i], false, now - started[i]);
+                                                next_attempt.cancel();
+                                                for (size_t j = 0; j < attempts.size(); ++j)
+                                                {
+                                                        // An address that had a head
+                                                        // start and still lost takes
+                                                        // at least this long.
+                                                        if (j < i && !failed[j])
+                                                        {
+                                                                record(endpoints[j], false,
+                                                                       now - started[j]);
+                                                        }
+                                                        if (j != i)
+                                                        {
+                                                                boost::system::error_code ignored;
+                                                                attempts[j]->close(ignored);
+                                                        }
+                                                }
+                                                return;
+                                        }
+                                        failed[i] = true;
+                                        record(endpoints[i], true, duration(0));
+                                        // Don't wait out the delay for an
+                                        // address that has already failed.
+                                        if (++failures == endpoints.size())
+                                        {
+                                                next_attempt.cancel();
+                                        }
+                                        else if (i + 1 == attempts.size())
+                                        {
+                                                start_next();
+                                        }
+                                });
+                        next_attempt.expires_after(to_clock(stagger));
+                        next_attempt.async_wait([&](const boost::system::error_code& error) {
+                                if (!error && !won)
+                                {
+                                        start_next();
+                                }
+                        });
+                };
+
+                start_next();
+                race.run_for(to_clock(timeout));
+                if (!won)
+                {
+                        throw std::runtime_error("Unable to connect");
+                }
+                tcp protocol = endpoints[winner].protocol();
+                return tcp::socket(io, protocol, attempts[winner]->release());
+        }
+
+        std::map<tcp::endpoint, connector::duration> connector::latencies() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                std::map<tcp::endpoint, duration> result;
+                for (const auto& s : stats)
+                {
+                        if (s.second.connected && !s.second.failed)
+                        {
+                                result[s.first] = s.second.latency;
+                        }
+                }
+                return result;
+        }
+
+        void connector::record(const tcp::endpoint& endpoint, bool failed,
+                               duration latency)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                address_stats& s = stats[endpoint];
+                s.failed = failed;
+                if (failed)
+                {
+                        return;
+                }
+                // Each connection counts for half, like the scheduler's
+                // throughput measurements.
+                s.latency = s.connected ? (s.latency + latency) / 2 : latency;
+                s.connected = true;
+        }
+}
@@ -0,0 +1,74 @@
+#ifndef CONNECTOR_HPP
+#define CONNECTOR_HPP
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace network
+{
+        using boost::asio::ip::tcp;
+
+        // A connector opens a connection to whichever of a host's addresses
+        // answers first, in the style of RFC 8305 ("happy eyeballs"): it
+        // starts with one address, and if that hasn't connected within the
+        // stagger delay, or has failed, starts the next one as well, without
+        // giving up on the first. The first to connect wins and the rest are
+        // closed, so an address that is slow or drops packets only costs a
+        // connection the stagger delay rather than a full connect timeout.
+        //
+        // The time each address took to connect is remembered, along with
+        // how long the addresses that lost a race had been trying, and later
+        // connections try addresses that were much slower than the best, or
+        // failed, after the others.
+        class connector
+        {
+        public:
+                using duration = std::chrono::duration<double>;
+
+                explicit connector(
+                        duration stagger = std::chrono::milliseconds(250),
+                        duration timeout = std::chrono::seconds(30));
+
+                // Put endpoints in the order connect should try them in: the
+                // addresses that did well so far in their given order, then
+                // the slow ones, then the ones that failed. The address
+                // families are interleaved, so that one broken family doesn't
+                // hold up the other.
+                std::vector<tcp::endpoint> order(
+                        const std::vector<tcp::endpoint>& endpoints) const;
+
+                // Race connections to endpoints in the order given, and return
+                // the winner as a socket on io. Throws if none of them connect
+                // within the timeout.
+                tcp::socket connect(boost::asio::io_context& io,
+                                    const std::vector<tcp::endpoint>& endpoints);
+
+                // How long connections to each address have taken to
+                // connect, smoothed, leaving out addresses whose last attempt
+                // failed.
+                std::map<tcp::endpoint, duration> latencies() const;
+
+        private:
+                struct address_stats
+                {
+                        duration latency{0};
+                        // Whether latency has been measured
+                        bool connected = false;
+                        bool failed = false;
+                };
+
+                void record(const tcp::endpoint& endpoint, bool failed,
+                            duration latency);
+
+                duration stagger;
+                duration timeout;
+                mutable std::mutex lock;
+                std::map<tcp::endpoint, address_stats> stats;
+        };
+}
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef FIELD_REGISTRY_HPP
+#define FIELD_REGISTRY_HPP
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+
+// The header field names this client knows. Each one has a small ID, which is
+// found with a single probe of a perfect hash table built as the code
+// compiles, so fields can be kept and compared as IDs rather than strings, and
+// a name written in the code can be checked before it ever runs.
+namespace message {
+
+        enum class field_id : uint8_t {};
+
+        struct known_field_name
+        {
+                std::string_view name;
+                // Whether it may be sent in a request, and received in a
+                // response
+                bool request;
+                bool response;
+        };
+
+        constexpr known_field_name known_field_names[] = {
+                {"Accept", true, false},
+                {"Accept-Charset", true, false},
+                {"Accept-Encoding", true, false},
+                {"Accept-Language", true, false},
+                {"Accept-Datetime", true, false},
+                {"Authorization", true, false},
+                {"Cache-Control", true, true},
+                {"Connection", true, true},
+                {"Keep-Alive", true, true},
+                {"Cookie", true, false},
+                {"Content-Length", true, true},
+                {"Content-MD5", true, true},
+                {"Content-Type", true, true},
+                {"Date", true, true},
+                {"Expect", true, false},
+                {"Forwarded", true, false},
+                {"From", true, false},
+                {"Host", true, false},
+                {"If-Match", true, false},
+                {"If-Modified-Since", true, false},
+                {"If-None-Match", true, false},
+                {"If-Range", true, false},
+                {"If-Unmodified-Since", true, false},
+                {"Max-Forwards", true, false},
+                {"Origin", true, false},
+                {"Pragma", true, true},
+                {"Proxy-Authorization", true, false},
+                {"Range", true, false},
+                {"Referer", true, false},
+                {"TE", true, false},
+                {"User-Agent", true, false},
+                {"Upgrade", true, true},
+                {"Via", true, true},
+                {"Warning", true, true},
+                {"Access-Control-Allow-Origin", false, true},
+                {"Accept-Patch", false, true},
+                {"Accept-Ranges", false, true},
+                {"Age", false, true},
+                {"Allow", false, true},
+                {"Alt-Svc", false, true},
+                {"Content-Disposition", false, true},
+                {"Content-Encoding", false, true},
+                {"Content-Language", false, true},
+                {"Content-Location", false, true},
+                {"Content-Range", false, true},
+                {"ETag", false, true},
+                {"Expires", false, true},
+                {"Last-Modified", false, true},
+                {"Link", false, true},
+                {"Location", false, true},
+                {"P3P", false, true},
+                {"Proxy-Authenticate", false, true},
+                {"Public-Key-Pins", false, true},
+                {"Refresh", false, true},
+                {"Retry-After", false, true},
+                {"Permanent", false, true},
+                {"Server", false, true},
+                {"Set-Cookie", false, true},
+                {"Status", false, true},
+                {"Strict-Transport-Security", false, true},
+                {"Trailer", false, true},
+                {"Transfer-Encoding", false, true},
+                {"TSV", false, true},
+                {"Vary", false, true},
+                {"WWW-Authenticate", false, true},
+                {"X-Frame-Options", false, true},
+        };
+
+        constexpr size_t known_field_count = std::size(known_field_names);
+
+        // The ID of any name that isn't known, such as an X- extension field
+        constexpr field_id unknown_field = field_id(known_field_count);
+
+        namespace field_hash {
+                constexpr char lower(char c)
+                {
+                        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+                }
+
+                constexpr bool equal(std::string_view a, std::string_view b)
+                {
+                        if (a.size() != b.size())
+                        {
+                                return false;
+                        }
+                        for (size_t i = 0; i < a.size(); ++i)
+                        {
+                                if (lower(a[i]) != lower(b[i]))
+                                {
+                                        return false;
+                                }
+                        }
+                        return true;
+                }
+
+                // FNV-1a of the name in lower case, starting from seed. The
+                // top bits pick the slot, since they depend on every byte.
+                const int table_bits = 9;
+                constexpr size_t slot(std::string_view name, uint32_t seed)
+                {
+                        uint32_t h = seed;
+                        for (char c : name)
+                        {
+                                h = (h ^ uint8_t(lower(c))) * 16777619u;
+                        }
+                        return h >> (32 - table_bits);
+                }
+
+                // Each slot holds one more than the ID of the name that
+                // hashes to it, or 0 if none does
+                struct table
+                {
+                        uint32_t seed;
+                        std::array<uint8_t, 1 << table_bits> slots;
+                };
+
+                // Try seeds until one gives every known name a slot of its own
+                constexpr table build()
+                {
+                        for (uint32_t seed = 2166136261u; ; ++seed)
+                        {
+                                table t{seed, {}};
+                                bool clash = false;
+                                for (size_t id = 0; id < known_field_count && !clash; ++id)
+                                {
+                                        uint8_t& s = t.slots[slot(known_field_names[id].name, seed)];
+                                        clash = s != 0;
+                                        s = uint8_t(id + 1);
+                                }
+                                if (!clash)
+                                {
+                                        return t;
+                                }
+                        }
+                }
+
+                constexpr table lookup = build();
+        }
+
+        // The ID of name, compared without regard to case, or unknown_field.
+        constexpr field_id find_field_id(std::string_view name)
+        {
+                uint8_t s = field_hash::lookup.slots[field_hash::slot(name, field_hash::lookup.seed)];
+                return s != 0 && field_hash::equal(known_field_names[s - 1].name, name)
+                        ? field_id(s - 1)
+                        : unknown_field;
+        }
+
+        // The ID of a name that must be known. Throws if it isn't, which in a
+        // constant expression means the code doesn't compile.
+        constexpr field_id known_field(std::string_view name)
+        {
+                field_id id = find_field_id(name);
+                if (id == unknown_field)
+                {
+                        throw std::invalid_argument("Not a known HTTP header field");
+                }
+                return id;
+        }
+
+        // The usual spelling of a known field's name
+        constexpr std::string_view field_spelling(field_id id)
+        {
+                return known_field_names[size_t(id)].name;
+        }
+
+        // The fields the client itself reads and writes
+        namespace fields {
+                constexpr field_id connection = known_field("Connection");
+                constexpr field_id content_length = known_field("Content-Length");
+                constexpr field_id content_range = known_field("Content-Range");
+                constexpr field_id content_type = known_field("Content-Type");
+                constexpr field_id etag = known_field("ETag");
+                constexpr field_id host = known_field("Host");
+                constexpr field_id keep_alive = known_field("Keep-Alive");
+                constexpr field_id last_modified = known_field("Last-Modified");
+                constexpr field_id range = known_field("Range");
+                constexpr field_id transfer_encoding = known_field("Transfer-Encoding");
+                constexpr field_id user_agent = known_field("User-Agent");
+        }
+}
+
+#endif
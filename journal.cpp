@@ -0,0 +1,294 @@
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace network
+{
+        namespace
+        {
+                const char* const journal_header = "multi-get journal";
+
+                std::runtime_error journal_error(const std::string& what,
+                                                 const std::string& path)
+                {
+                        return std::runtime_error(what + " " + path + ": "
+                                                  + std::strerror(errno));
+                }
+
+                // Sort ranges and merge the ones that overlap or touch.
+                void merge(std::vector<chunk>& ranges)
+                {
+                        std::sort(ranges.begin(), ranges.end(),
+                                  [](const chunk& a, const chunk& b) {
+                                          return a.first_byte < b.first_byte;
+                                  });
+                        std::vector<chunk> merged;
+                        for (const chunk& c : ranges)
+                        {
+                                if (!merged.empty()
+                                    && c.first_byte <= merged.back().last_byte + 1)
+                                {
+                                        merged.back().last_byte = std::max(
+                                                merged.back().last_byte, c.last_byte);
+                                }
+                                else
+                                {
+                                        merged.push_back(c);
+                                }
+                        }
+                        ranges = std::move(merged);
+                }
+
+                std::string range_line(const chunk& c)
+                {
+                        return "range " + std::to_string(c.first_byte) + " "
+                                + std::to_string(c.last_byte) + "\n";
+                }
+        }
+
+        bool read_journal(const std::string& path, journal_contents& contents)
+        {
+                std::ifstream fs(path);
+                std::string line;
+                if (!std::getline(fs, line) || line != journal_header)
+                {
+                        return false;
+                }
+                contents = journal_contents();
+                // A crash may have cut the last line short, so anything that
+                // doesn't parse is ignored.
+                while (std::getline(fs, line) && !fs.eof())
+                {
+                        std::istringstream is(line);
+                        std::string kind;
+                        is >> kind;
+                        chunk c;
+                        if (kind == "validator")
+                        {
+                                std::getline(is >> std::ws, contents.validator);
+                        }
+                        else if (kind == "range" && is >> c.first_byte >> c.last_byte
+                                 && c.first_byte <= c.last_byte)
+                        {
+                                contents.completed.push_back(c);
+                        }
+                }
+                merge(contents.completed);
+                return true;
+        }
+
+        journaled_output::journaled_output(output_file& out, const std::string& path,
+                                           const journal_contents* resumed)
+                : out(out), path(path),
+                  fd(::open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)),
+                  last_flush(std::chrono::steady_clock::now())
+        {
+                // The journal is written next to the old one and renamed
+                // over it once it's on disk, so a crash while it's being
+                // written leaves the old one as it was.
+                std::string temporary = path + ".tmp";
+                if (fd < 0)
+                {
+                        throw journal_error("Unable to open", temporary);
+                }
+                // A resumed journal is written out again in one go, which
+                // also drops the ranges that were recorded piecemeal.
+                std::string text = std::string(journal_header) + "\n";
+                if (resumed)
+                {
+                        validator = resumed->validator;
+                        validator_resumed = true;
+                        if (!validator.empty())
+                        {
+                                text += "validator " + validator + "\n";
+                        }
+                        for (const chunk& c : resumed->completed)
+                        {
+                                text += range_line(c);
+                        }
+                }
+                try
+                {
+                        append(text);
+                        if (::fdatasync(fd) != 0)
+                        {
+                                throw journal_error("Unable to write to", temporary);
+                        }
+                        if (::rename(temporary.c_str(), path.c_str()) != 0)
+                        {
+                                throw journal_error("Unable to replace", path);
+                        }
+                }
+                catch (...)
+                {
+                        ::close(fd);
+                        ::unlink(temporary.c_str());
+                        throw;
+                }
+                sync_directory();
+        }
+
+        journaled_output::~journaled_output()
+        {
+                // Record what has been written before the download failed
+                try
+                {
+                        if (fd >= 0)
+                        {
+                                sync();
+                        }
+                }
+                catch (const std::exception&)
+                {
+                }
+                if (fd >= 0)
+                {
+                        ::close(fd);
+                }
+        }
+
+        // Make the rename of the journal into place durable.
+        void journaled_output::sync_directory()
+        {
+                size_t slash = path.find_last_of('/');
+                std::string directory = slash == std::string::npos ? "."
+                        : slash == 0 ? "/" : path.substr(0, slash);
+                int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+                if (dir < 0)
+                {
+                        throw journal_error("Unable to open", directory);
+                }
+                int synced = ::fsync(dir);
+                ::close(dir);
+                if (synced != 0)
+                {
+                        throw journal_error("Unable to write to", directory);
+                }
+        }
+
+        void journaled_output::append(const std::string& text)
+        {
+                const char* data = text.data();
+                size_t length = text.size();
+                while (length > 0)
+                {
+                        ssize_t written = ::write(fd, data, length);
+                        if (written < 0)
+                        {
+                                if (errno == EINTR)
+                                {
+                                        continue;
+                                }
+                                throw journal_error("Unable to write to", path);
+                        }
+                        data += written;
+                        length -= written;
+                }
+        }
+
+        // Record the unrecorded ranges, once the output has them on disk.
+        void journaled_output::flush()
+        {
+                last_flush = std::chrono::steady_clock::now();
+                if (unrecorded.empty())
+                {
+                        return;
+                }
+                out.sync();
+                merge(unrecorded);
+                std::string text;
+                for (const chunk& c : unrecorded)
+                {
+                        text += range_line(c);
+                }
+                unrecorded.clear();
+                append(text);
+                if (::fdatasync(fd) != 0)
+                {
+                        throw journal_error("Unable to write to", path);
+                }
+        }
+
+        void journaled_output::reserve(size_t length)
+        {
+                out.reserve(length);
+        }
+
+        uint8_t* journaled_output::direct(size_t offset, size_t length)
+        {
+                return out.direct(offset, length);
+        }
+
+        void journaled_output::write_at(size_t offset, const uint8_t* data,
+                                        size_t length)
+        {
+                out.write_at(offset, data, length);
+        }
+
+        void journaled_output::commit(size_t offset, size_t length)
+        {
+                if (length == 0)
+                {
+                        return;
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                // Blocks of a chunk arrive in order, so most of them extend
+                // the range before.
+                if (!unrecorded.empty()
+                    && unrecorded.back().last_byte + 1 == offset)
+                {
+                        unrecorded.back().last_byte += length;
+                }
+                else
+                {
+                        unrecorded.push_back({offset, offset + length - 1});
+                }
+                if (std::chrono::steady_clock::now() - last_flush
+                    >= std::chrono::seconds(1))
+                {
+                        flush();
+                }
+        }
+
+        void journaled_output::set_validator(const std::string& value)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (validator.empty())
+                {
+                        validator = value;
+                        append("validator " + validator + "\n");
+                }
+                else if (value != validator)
+                {
+                        throw std::runtime_error(
+                                validator_resumed
+                                ? "The file has changed since the download was interrupted"
+                                : "The file changed during the download");
+                }
+        }
+
+        void journaled_output::sync()
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                flush();
+        }
+
+        void journaled_output::finish(size_t length)
+        {
+                out.finish(length);
+                // The download is complete, so there's nothing to resume
+                std::lock_guard<std::mutex> guard(lock);
+                unrecorded.clear();
+                ::close(fd);
+                fd = -1;
+                ::unlink(path.c_str());
+        }
+}
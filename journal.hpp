@@ -0,0 +1,70 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include "output.hpp"
+#include "scheduler.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace network
+{
+        // What the journal of an interrupted download says it had done: the
+        // validator of the file it was downloading, and the ranges of it that
+        // had been written.
+        struct journal_contents
+        {
+                std::string validator;
+                std::vector<chunk> completed;
+        };
+
+        // Read the journal at path. Returns false if there isn't one.
+        bool read_journal(const std::string& path, journal_contents& contents);
+
+        // A journaled_output passes everything through to another output,
+        // and keeps a journal at path of the ranges written to it, so that an
+        // interrupted download can pick up where it left off. The output is
+        // synced before the journal records anything written to it, so the
+        // journal never claims data that a crash could have lost. Ranges are
+        // recorded at most a second after they were written, and the journal
+        // is removed once the download is complete.
+        class journaled_output : public output_file
+        {
+                output_file& out;
+                std::string path;
+                int fd;
+                std::mutex lock;
+                std::string validator;
+                bool validator_resumed = false;
+                // Ranges that have been committed but not recorded yet
+                std::vector<chunk> unrecorded;
+                std::chrono::steady_clock::time_point last_flush;
+
+                void append(const std::string& text);
+                void flush();
+                void sync_directory();
+        public:
+                // Start a new journal at path for out, or carry on from
+                // resumed if that's given. Any journal already at path is
+                // only replaced once the new one is on disk.
+                journaled_output(output_file& out, const std::string& path,
+                                 const journal_contents* resumed = nullptr);
+                ~journaled_output();
+                journaled_output(const journaled_output&) = delete;
+                journaled_output& operator=(const journaled_output&) = delete;
+                void reserve(size_t length) override;
+                uint8_t* direct(size_t offset, size_t length) override;
+                void write_at(size_t offset, const uint8_t* data,
+                              size_t length) override;
+                void commit(size_t offset, size_t length) override;
+                // Throws if the journal is for a different version of the
+                // file.
+                void set_validator(const std::string& validator) override;
+                void sync() override;
+                void finish(size_t length) override;
+        };
+}
+
+#endif
@@ -1,183 +1,171 @@
 #include "message.hpp"
+#include "scan.hpp"
 
-#include <set>
 #include <stdexcept>
 #include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
 #include <iterator>
+#include <sstream>
+
+#include <unistd.h>
 
 namespace message {
-        std::istream& getline(std::istream& is, std::string& str)
+        namespace
         {
-                std::istream::sentry s(is);
-                char c;
-                std::getline(is, str, '\r');
-                if (!is.get(c) || c != '\n')
+                // How much of a body is read at a time when it doesn't go
+                // straight to its destination
+                const size_t body_block_size = 16 * 1024;
+
+                // Read a body into a vector, growing it a block at a time
+                class vector_sink : public body_sink
                 {
-                        is.setstate(std::ios_base::failbit);
+                        std::vector<uint8_t>& body;
+                        size_t start = 0;
+                public:
+                        explicit vector_sink(std::vector<uint8_t>& body)
+                                : body(body)
+                        {
+                        }
+
+                        uint8_t* prepare(size_t& n) override
+                        {
+                                n = std::min(n, body_block_size);
+                                start = body.size();
+                                body.resize(start + n);
+                                return body.data() + start;
+                        }
+
+                        void commit(size_t n) override
+                        {
+                                body.resize(start + n);
+                        }
+                };
+
+                bool non_standard_field(std::string_view s)
+                {
+                        return s.size() > 2 &&
+                                (s[0] == 'X' || s[0] == 'x') &&
+                                s[1] == '-';
                 }
-                return is;
-        }
 
-        void drop_newline(std::istream& is)
-        {
-                char c;
-                if (!is.get(c) || c != '\r')
+                bool is_request_field(field_id id)
                 {
-                        is.setstate(std::ios_base::failbit);
-                        throw std::runtime_error("Missing \\r");
+                        return id != unknown_field && known_field_names[size_t(id)].request;
                 }
-                if (!is.get(c) || c != '\n')
+
+                bool is_response_field(field_id id)
                 {
-                        is.setstate(std::ios_base::failbit);
-                        throw std::runtime_error("Missing \\n");
-                }
-        }
-
-        const std::set<ci::string>& get_valid_request_header_fields()
-        {
-                static const std::set<ci::string> standard_request_fields = {
-                        "accept",
-                        "accept-charset",
-                        "accept-encoding",
-                        "accept-language",
-                        "accept-datetime",
-                        "authorization",
-                        "cache-control",
-                        "connection",
-                        "cookie",
-                        "content-length",
-                        "content-md5",
-                        "content-type",
-                        "date",
-                        "expect",
-                        "forwarded",
-                        "from",
-                        "host",
-                        "if-match",
-                        "if-modified-since",
-                        "if-none-match",
-                        "if-range",
-                        "if-unmodified-since",
-                        "max-forwards",
-                        "origin",
-                        "pragma",
-                        "proxy-authorization",
-                        "range",
-                        "referer",
-                        "te",
-                        "user-agent",
-                        "upgrade",
-                        "via",
-                        "warning",
-                };
-                return standard_request_fields;
-        }
-
-        const std::set<ci::string>& get_valid_response_header_fields()
-        {
-                static const std::set<ci::string> standard_response_fields = {
-			"access-control-allow-origin",
-			"accept-patch",
-			"accept-ranges",
-			"age",
-			"allow",
-			"alt-svc",
-			"cache-control",
-			"connection",
-			"content-disposition",
-			"content-encoding",
-			"content-language",
-			"content-length",
-			"content-location",
-			"content-md5",
-			"content-range",
-			"content-type",
-			"date",
-			"etag",
-			"expires",
-			"last-modified",
-			"link",
-			"location",
-			"p3p",
-			"pragma",
-			"proxy-authenticate",
-			"public-key-pins",
-			"refresh",
-			"retry-after",
-			"permanent",
-			"server",
-			"set-cookie",
-			"status",
-			"strict-transport-security",
-			"trailer",
-			"transfer-encoding",
-			"tsv",
-			"tsv",
-			"upgrade",
-			"vary",
-			"via",
-			"warning",
-			"www-authenticate",
-			"x-frame-options",
-                };
-                return standard_response_fields;
-        }
+                        return id != unknown_field && known_field_names[size_t(id)].response;
+                }
 
-        bool non_standard_field(const ci::string& s)
-        {
-                return s.size() > 2 &&
-                        s.find('X') == 0 &&
-                        s.find('-') == 1;
+                // Look name up in the registry, keeping it only if it's an
+                // extension. Throws if it's neither a field allowed here nor an
+                // extension.
+                field_id identify(std::string_view name, bool (*allowed)(field_id),
+                                  std::string& extension, const char* kind)
+                {
+                        field_id id = find_field_id(name);
+                        if (allowed(id))
+                        {
+                                return id;
+                        }
+                        if (!non_standard_field(name))
+                        {
+                                throw std::invalid_argument(std::string(name) + " is not an HTTP "
+                                                            + kind + " header");
+                        }
+                        extension = name;
+                        return unknown_field;
+                }
+
+                // Whether a field a response arrived with can be kept: one
+                // that's allowed in responses, or an extension
+                bool known_response_field(std::string_view name)
+                {
+                        return is_response_field(find_field_id(name)) || non_standard_field(name);
+                }
+
+                // Extension names in order without regard to case
+                int compare_extensions(std::string_view a, std::string_view b)
+                {
+                        int order = ci::compare(a.data(), b.data(), std::min(a.size(), b.size()));
+                        if (order != 0 || a.size() == b.size())
+                        {
+                                return order;
+                        }
+                        return a.size() < b.size() ? -1 : 1;
+                }
         }
 
-        request_field_name::request_field_name(std::string name)
-                : name(ci::from_string(name))
+        request_field_name::request_field_name(field_id id)
+                : id(id)
         {
-
-                if (!get_valid_request_header_fields().count(this->name) &&
-                    !non_standard_field(this->name))
+                if (!is_request_field(id))
                 {
-                        throw std::invalid_argument(name + " is not an HTTP request header");
+                        throw std::invalid_argument("Not an HTTP request header");
                 }
         }
 
-        request_field_name::request_field_name(const char* name) : request_field_name(std::string(name)) {}
+        request_field_name::request_field_name(std::string_view name)
+                : id(identify(name, is_request_field, extension, "request"))
+        {
+        }
+
+        request_field_name::request_field_name(const std::string& name) : request_field_name(std::string_view(name)) {}
+
+        request_field_name::request_field_name(const char* name) : request_field_name(std::string_view(name)) {}
 
         std::string request_field_name::to_string() const
         {
-                return ci::to_string(name);
+                return id == unknown_field ? extension : std::string(field_spelling(id));
         }
 
-        response_field_name::response_field_name(std::string name)
-                : name(ci::from_string(name))
+        response_field_name::response_field_name(field_id id)
+                : id(id)
         {
-                if (!get_valid_response_header_fields().count(this->name) &&
-                    !non_standard_field(this->name))
+                if (!is_response_field(id))
                 {
-                        throw std::invalid_argument(name + " is not an HTTP response header");
+                        throw std::invalid_argument("Not an HTTP response header");
                 }
         }
 
-        response_field_name::response_field_name(const char* name) : response_field_name(std::string(name)) {}
+        response_field_name::response_field_name(std::string_view name)
+                : id(identify(name, is_response_field, extension, "response"))
+        {
+        }
+
+        response_field_name::response_field_name(const std::string& name) : response_field_name(std::string_view(name)) {}
+
+        response_field_name::response_field_name(const char* name) : response_field_name(std::string_view(name)) {}
 
         std::string response_field_name::to_string() const
         {
-                return ci::to_string(name);
+                return id == unknown_field ? extension : std::string(field_spelling(id));
         }
 
         bool response_field_name::operator<(const response_field_name& rhs) const
         {
-                return name < rhs.name;
+                if (id != rhs.id)
+                {
+                        return id < rhs.id;
+                }
+                return id == unknown_field && compare_extensions(extension, rhs.extension) < 0;
         }
         
         bool response_field_name::operator==(const response_field_name& rhs) const
         {
-                return name == rhs.name;
+                return id == rhs.id
+                        && (id != unknown_field || compare_extensions(extension, rhs.extension) == 0);
         }
 
         std::ostream& operator<<(std::ostream& os, const response_field_name& field)
         {
-                return os << field.name;
+                return os << (field.id == unknown_field
+                              ? std::string_view(field.extension)
+                              : field_spelling(field.id));
         }
 
         request_field::operator pair_type() const
@@ -245,7 +233,7 @@ namespace message {
         {
         }
 
-        std::ostream& operator<<(std::ostream& os, request_message m)
+        std::ostream& operator<<(std::ostream& os, const request_message& m)
         {
                 os << m.request_method << " " << m.path << " HTTP/1.1\r\n";
                 for (const auto& field : m.header_fields)
@@ -257,6 +245,51 @@ namespace message {
                 return os;
         }
 
+        request_template::request_template(method request_method, const std::string& path,
+                                           const std::vector<request_field>& header_fields)
+        {
+                std::ostringstream prefix;
+                prefix << request_method << " " << path << " HTTP/1.1\r\n";
+                for (const auto& field : header_fields)
+                {
+                        prefix << field.name.to_string() << ": " << field.value << "\r\n";
+                }
+                prefix << request_field_name(fields::range).to_string() << ": bytes=";
+                buffer = prefix.str();
+                prefix_size = buffer.size();
+                // Room for a range of the largest numbers and the end of the
+                // header
+                buffer.reserve(prefix_size + 2 * std::numeric_limits<size_t>::digits10 + 8);
+        }
+
+        void request_template::add_range(size_t first_byte, size_t last_byte)
+        {
+                // "first-last", after a comma if it isn't the first range
+                char digits[std::numeric_limits<size_t>::digits10 + 1];
+                if (buffer.size() > prefix_size)
+                {
+                        buffer += ',';
+                }
+                buffer.append(digits, std::to_chars(std::begin(digits), std::end(digits),
+                                                    first_byte).ptr);
+                buffer += '-';
+                buffer.append(digits, std::to_chars(std::begin(digits), std::end(digits),
+                                                    last_byte).ptr);
+        }
+
+        std::string_view request_template::finish()
+        {
+                buffer += "\r\n\r\n";
+                return buffer;
+        }
+
+        std::string_view request_template::with_range(size_t first_byte, size_t last_byte)
+        {
+                buffer.resize(prefix_size);
+                add_range(first_byte, last_byte);
+                return finish();
+        }
+
         response_code::response_code(int code, std::string message)
                 : code(code), message(std::move(message))
         {
@@ -272,6 +305,11 @@ namespace message {
                 return 200 <= code && code < 300;
         }
 
+        int response_code::value() const
+        {
+                return code;
+        }
+
         std::istream& operator>>(std::istream& is, response_code& code)
         {
                 is >> code.code;
@@ -295,41 +333,849 @@ namespace message {
         response_message::response_message(std::istream& is)
                 : status(0,"")
         {
-                if (!(is >> version)) throw std::runtime_error("Malformed HTTP version");
-                if (!(is >> status)) throw std::runtime_error("Malformed HTTP status");
-                for (std::string field_name, field_value; is.peek() != '\r'; )
+                read_header_fields(is);
+                if (!is)
+                {
+                        throw std::runtime_error("Incomplete HTTP header");
+                }
+                if (chunked())
+                {
+                        vector_sink sink(message_body);
+                        read_body(is, sink);
+                        return;
+                }
+                message_body.resize(content_length());
+                span_sink sink(message_body.data(), message_body.size());
+                message_body.resize(read_body(is, sink).length);
+        }
+
+        response_message response_message::read_header(std::istream& is)
+        {
+                response_message header;
+                header.read_header_fields(is);
+                return header;
+        }
+
+        response_message::response_message(const response_parser& parser)
+                : version(parser.version()),
+                  status(parser.status_code(), std::string(parser.reason()))
+        {
+                for (size_t i = 0; i < parser.field_count(); ++i)
+                {
+                        // Servers send all sorts of fields this client has no
+                        // use for, and they don't make the response invalid
+                        if (!known_response_field(parser.field_name(i)))
+                        {
+                                continue;
+                        }
+                        header_fields.insert(std::make_pair(
+                                                     response_field_name(parser.field_name(i)),
+                                                     std::string(parser.field_value(i))));
+                }
+        }
+
+        void response_message::read_header_fields(std::istream& is)
+        {
+                // A line at a time, so that nothing after the header is taken
+                // from the stream
+                response_parser parser;
+                std::string data, line;
+                while (!parser.parse(data.data(), data.size()))
+                {
+                        if (!std::getline(is, line))
+                        {
+                                return;
+                        }
+                        data += line;
+                        data += '\n';
+                }
+                *this = response_message(parser);
+        }
+
+        size_t response_message::content_length() const
+        {
+                auto it = header_fields.find(fields::content_length);
+                if (it == header_fields.end())
+                {
+                        throw std::runtime_error("No known content-length");
+                }
+                return std::stoul(it->second);
+        }
+
+        bool response_message::chunked() const
+        {
+                auto it = header_fields.find(fields::transfer_encoding);
+                return it != header_fields.end()
+                        && ci::from_string(it->second).find("chunked") != ci::string::npos;
+        }
+
+        int response_message::status_code() const
+        {
+                return status.value();
+        }
+
+        const std::string* response_message::find_field(const response_field_name& name) const
+        {
+                auto it = header_fields.find(name);
+                return it == header_fields.end() ? nullptr : &it->second;
+        }
+
+        bool parse_content_range(const std::string& value, content_range& range)
+        {
+                std::istringstream is(value);
+                std::string unit;
+                if (!(is >> unit) || ci::from_string(unit) != "bytes")
+                {
+                        return false;
+                }
+                is >> std::ws;
+                range.has_range = is.peek() != '*';
+                if (range.has_range)
+                {
+                        char dash;
+                        if (!(is >> range.first_byte >> dash >> range.last_byte)
+                            || dash != '-' || range.last_byte < range.first_byte)
+                        {
+                                return false;
+                        }
+                }
+                else
+                {
+                        is.get();
+                }
+                char slash;
+                if (!(is >> slash) || slash != '/')
+                {
+                        return false;
+                }
+                is >> std::ws;
+                range.has_length = is.peek() != '*';
+                if (range.has_length)
+                {
+                        if (!(is >> range.complete_length))
+                        {
+                                return false;
+                        }
+                        if (range.has_range && range.last_byte >= range.complete_length)
+                        {
+                                return false;
+                        }
+                }
+                // "bytes */*" says nothing at all
+                return range.has_range || range.has_length;
+        }
+
+        bool parse_multipart_boundary(const std::string& content_type,
+                                      std::string& boundary)
+        {
+                const ci::string type = ci::from_string(content_type);
+                const ci::string multipart = "multipart/byteranges";
+                if (type.compare(0, multipart.size(), multipart) != 0)
+                {
+                        return false;
+                }
+                const ci::string parameter = "boundary=";
+                size_t start = type.find(parameter);
+                if (start == ci::string::npos)
+                {
+                        return false;
+                }
+                start += parameter.size();
+                size_t end;
+                if (start < content_type.size() && content_type[start] == '"')
+                {
+                        end = content_type.find('"', ++start);
+                }
+                else
+                {
+                        end = content_type.find_first_of("; \t", start);
+                }
+                boundary = content_type.substr(start, end == std::string::npos
+                                               ? std::string::npos : end - start);
+                return !boundary.empty();
+        }
+
+        namespace
+        {
+                // Reads the lines of a body that is length bytes long, so
+                // that nothing past the end of it is taken from the stream.
+                class body_reader
                 {
-                        is >> field_name;
-                        getline(is, field_value);
+                        std::istream& is;
+                        size_t remaining;
+                public:
+                        body_reader(std::istream& is, size_t length)
+                                : is(is), remaining(length)
+                        {
+                        }
+
+                        // Read a line without its CRLF.
+                        std::string line()
+                        {
+                                std::string result;
+                                char c;
+                                while (remaining > 0 && is.get(c))
+                                {
+                                        --remaining;
+                                        if (c == '\n')
+                                        {
+                                                if (!result.empty() && result.back() == '\r')
+                                                {
+                                                        result.pop_back();
+                                                }
+                                                return result;
+                                        }
+                                        result.push_back(c);
+                                }
+                                if (remaining > 0)
+                                {
+                                        throw truncated_body("Multipart body cut off");
+                                }
+                                throw std::runtime_error("Malformed multipart body");
+                        }
+
+                        // Account for n bytes read by someone else.
+                        void consumed(size_t n)
+                        {
+                                if (n > remaining)
+                                {
+                                        throw std::runtime_error("Malformed multipart body");
+                                }
+                                remaining -= n;
+                        }
+
+                        size_t left() const
+                        {
+                                return remaining;
+                        }
+
+                        void skip_rest()
+                        {
+                                is.ignore(std::min<size_t>(
+                                                  remaining,
+                                                  std::numeric_limits<std::streamsize>::max()));
+                                remaining = 0;
+                        }
+                };
+
+                // Strip the whitespace a line may be padded with.
+                std::string trim(const std::string& s)
+                {
+                        size_t first = s.find_first_not_of(" \t");
+                        if (first == std::string::npos)
+                        {
+                                return "";
+                        }
+                        return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+                }
+
+                // The size on the line that starts a chunk, without its CRLF.
+                // Chunk extensions after a ';' are ignored.
+                size_t parse_chunk_size(std::string_view line)
+                {
+                        std::string size = trim(std::string(line.substr(0, line.find(';'))));
+                        if (size.empty() || size.size() > 2 * sizeof(size_t)
+                            || size.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                        {
+                                throw std::runtime_error("Malformed chunked body");
+                        }
+                        return std::stoull(size, nullptr, 16);
+                }
+        }
+
+        void read_byteranges(std::istream& is, size_t length,
+                             const std::string& boundary,
+                             const byterange_handler& on_part)
+        {
+                body_reader body(is, length);
+                const std::string delimiter = "--" + boundary;
+                // Anything before the first delimiter is a preamble to ignore
+                while (trim(body.line()) != delimiter)
+                {
+                }
+                for (;;)
+                {
+                        content_range range;
+                        bool has_range = false;
+                        for (std::string line = body.line(); !line.empty(); line = body.line())
+                        {
+                                size_t colon = line.find(':');
+                                if (colon == std::string::npos)
+                                {
+                                        throw std::runtime_error("Malformed multipart body");
+                                }
+                                if (ci::from_string(line.substr(0, colon)) == "Content-Range")
+                                {
+                                        has_range = parse_content_range(
+                                                trim(line.substr(colon + 1)), range)
+                                                && range.has_range;
+                                }
+                        }
+                        if (!has_range)
+                        {
+                                throw std::runtime_error("Multipart part without a byte range");
+                        }
+                        size_t part_length = range.last_byte - range.first_byte + 1;
+                        if (part_length > body.left())
+                        {
+                                throw std::runtime_error("Malformed multipart body");
+                        }
+                        on_part(range, is);
+                        body.consumed(part_length);
                         if (!is)
                         {
-                                throw std::runtime_error("Malformed HTTP header field");
+                                throw truncated_body("Multipart body cut off");
                         }
-                        if (':' != *(field_name.end()-1))
+                        // The CRLF before a delimiter belongs to the delimiter
+                        std::string line = body.line();
+                        if (!line.empty())
                         {
-                                throw std::runtime_error("Invalid HTTP header. Missing :");
+                                throw std::runtime_error("Malformed multipart body");
                         }
-                        else
+                        line = trim(body.line());
+                        if (line == delimiter + "--")
                         {
-                                field_name.pop_back();
+                                break;
+                        }
+                        if (line != delimiter)
+                        {
+                                throw std::runtime_error("Malformed multipart body");
                         }
-                        header_fields.insert(std::make_pair(field_name, field_value));
                 }
-                // Read the message body
-                auto it = header_fields.find("Content-Length");
-                if (it == header_fields.end())
+                // And anything after the last one is an epilogue
+                body.skip_rest();
+        }
+
+        bool response_parser::parse(const char* data, size_t size)
+        {
+                buffer = data;
+                while (!finished && scanned < size)
                 {
-                        throw std::runtime_error("No known content-length");
+                        // A block at a time, finding every line end and colon
+                        // in it at once
+                        scan::masks found = scan::classify(data + scanned, data + size);
+                        size_t block_start = scanned;
+                        scanned = std::min(size, scanned + scan::block_size);
+                        for (uint64_t bits = found.newlines | found.colons; bits && !finished;
+                             bits &= bits - 1)
+                        {
+                                size_t at = block_start + __builtin_ctzll(bits);
+                                if (data[at] == ':')
+                                {
+                                        colon = colon ? colon : at;
+                                        continue;
+                                }
+                                if (at + 1 > max_header_size)
+                                {
+                                        throw std::runtime_error("HTTP header too long");
+                                }
+                                size_t end = at;
+                                if (end > line_start && data[end - 1] == '\r')
+                                {
+                                        --end;
+                                }
+                                if (!status_read)
+                                {
+                                        parse_status_line(line_start, end);
+                                }
+                                else if (end == line_start)
+                                {
+                                        finished = true;
+                                        scanned = at + 1;
+                                }
+                                else
+                                {
+                                        parse_field(line_start, colon, end);
+                                }
+                                line_start = at + 1;
+                                colon = 0;
+                        }
+                }
+                if (!finished && size > max_header_size)
+                {
+                        throw std::runtime_error("HTTP header too long");
+                }
+                return finished;
+        }
+
+        namespace
+        {
+                bool is_blank(char c)
+                {
+                        return c == ' ' || c == '\t';
+                }
+        }
+
+        // "HTTP/1.1 206 Partial Content"
+        void response_parser::parse_status_line(size_t start, size_t end)
+        {
+                const char* line = buffer + start;
+                size_t size = end - start;
+                const char* space = static_cast<const char*>(std::memchr(line, ' ', size));
+                std::string_view token(line, space ? space - line : size);
+                if (token == "HTTP/1.1")
+                {
+                        http = http_version::HTTP11;
+                }
+                else if (token == "HTTP/1.0")
+                {
+                        http = http_version::HTTP10;
+                }
+                else if (token == "HTTP/2.0")
+                {
+                        http = http_version::HTTP20;
                 }
                 else
                 {
-                        drop_newline(is);
-                        size_t length = std::stoul(it->second);
-                        message_body.resize(length);
-                        is.read(reinterpret_cast<char*>(message_body.data()), length);
-                        message_body.resize(is.gcount());
+                        throw std::runtime_error("Malformed HTTP version");
                 }
-                        
+                size_t digits = token.size();
+                while (digits < size && line[digits] == ' ')
+                {
+                        ++digits;
+                }
+                if (size - digits < 3 || (size - digits > 3 && line[digits + 3] != ' '))
+                {
+                        throw std::runtime_error("Malformed HTTP status");
+                }
+                code = 0;
+                for (size_t i = digits; i < digits + 3; ++i)
+                {
+                        if (line[i] < '0' || line[i] > '9')
+                        {
+                                throw std::runtime_error("Malformed HTTP status");
+                        }
+                        code = code * 10 + (line[i] - '0');
+                }
+                size_t first = std::min(size, digits + 4);
+                size_t last = size;
+                while (last > first && is_blank(line[last - 1]))
+                {
+                        --last;
+                }
+                reason_span = {start + first, last - first};
+                status_read = true;
+        }
+
+        // "Name: value", with optional whitespace around the value
+        void response_parser::parse_field(size_t start, size_t colon_at, size_t end)
+        {
+                const char* line = buffer + start;
+                size_t size = end - start;
+                const char* colon = buffer + colon_at;
+                if (!colon_at)
+                {
+                        throw std::runtime_error("Invalid HTTP header. Missing :");
+                }
+                size_t name_size = colon - line;
+                if (name_size == 0 || std::find_if(line, colon, is_blank) != colon)
+                {
+                        throw std::runtime_error("Malformed HTTP header field");
+                }
+                if (count == max_fields)
+                {
+                        throw std::runtime_error("Too many HTTP header fields");
+                }
+                size_t first = name_size + 1;
+                while (first < size && is_blank(line[first]))
+                {
+                        ++first;
+                }
+                size_t last = size;
+                while (last > first && is_blank(line[last - 1]))
+                {
+                        --last;
+                }
+                fields[count++] = {{start, name_size}, {start + first, last - first}};
+        }
+
+        void response_parser::reset()
+        {
+                // The fields are left as they are, since count says how many
+                // of them there are
+                buffer = nullptr;
+                scanned = 0;
+                line_start = 0;
+                colon = 0;
+                status_read = false;
+                finished = false;
+                http = http_version::HTTP11;
+                code = 0;
+                reason_span = {0, 0};
+                count = 0;
+        }
+
+        bool response_parser::done() const
+        {
+                return finished;
+        }
+
+        size_t response_parser::header_size() const
+        {
+                return scanned;
+        }
+
+        http_version response_parser::version() const
+        {
+                return http;
+        }
+
+        int response_parser::status_code() const
+        {
+                return code;
+        }
+
+        std::string_view response_parser::reason() const
+        {
+                return view(reason_span);
+        }
+
+        size_t response_parser::field_count() const
+        {
+                return count;
+        }
+
+        std::string_view response_parser::field_name(size_t i) const
+        {
+                return view(fields[i].name);
+        }
+
+        std::string_view response_parser::field_value(size_t i) const
+        {
+                return view(fields[i].value);
+        }
+
+        std::string_view response_parser::find_field(std::string_view name) const
+        {
+                for (size_t i = 0; i < count; ++i)
+                {
+                        if (ci::equal(view(fields[i].name), name))
+                        {
+                                return view(fields[i].value);
+                        }
+                }
+                return std::string_view();
+        }
+
+        std::string_view response_parser::view(span s) const
+        {
+                return std::string_view(buffer + s.offset, s.length);
+        }
+
+        chunked_body::chunked_body(std::istream& is)
+                : is(is)
+        {
+        }
+
+        // Move on to the next chunk, reading its size line, and the trailer
+        // if it's the last one. Returns false if the stream fails first.
+        bool chunked_body::next_chunk()
+        {
+                std::string line;
+                // The CRLF that ends the data of the chunk before
+                if (started)
+                {
+                        if (!std::getline(is, line))
+                        {
+                                return false;
+                        }
+                        if (!line.empty() && line.back() == '\r')
+                        {
+                                line.pop_back();
+                        }
+                        if (!line.empty())
+                        {
+                                throw std::runtime_error("Malformed chunked body");
+                        }
+                }
+                started = true;
+                if (!std::getline(is, line))
+                {
+                        return false;
+                }
+                if (!line.empty() && line.back() == '\r')
+                {
+                        line.pop_back();
+                }
+                remaining = parse_chunk_size(line);
+                if (remaining > 0)
+                {
+                        return true;
+                }
+                // The last chunk is followed by the trailer and an empty line
+                for (;;)
+                {
+                        if (!std::getline(is, line))
+                        {
+                                return false;
+                        }
+                        if (!line.empty() && line.back() == '\r')
+                        {
+                                line.pop_back();
+                        }
+                        if (line.empty())
+                        {
+                                break;
+                        }
+                        size_t colon = line.find(':');
+                        if (colon == std::string::npos)
+                        {
+                                throw std::runtime_error("Malformed chunked body");
+                        }
+                        // A trailer field that isn't known is of no use, and
+                        // doesn't make the body any less valid
+                        std::string name = line.substr(0, colon);
+                        if (known_response_field(name))
+                        {
+                                trailer_fields.insert(std::make_pair(name,
+                                                                     trim(line.substr(colon + 1))));
+                        }
+                }
+                finished = true;
+                return true;
+        }
+
+        size_t chunked_body::read(uint8_t* buffer, size_t n)
+        {
+                if (n == 0 || finished || (remaining == 0 && !next_chunk()) || finished)
+                {
+                        return 0;
+                }
+                is.read(reinterpret_cast<char*>(buffer), std::min(n, remaining));
+                remaining -= is.gcount();
+                return is.gcount();
+        }
+
+        bool chunked_body::end()
+        {
+                if (!finished && remaining == 0)
+                {
+                        next_chunk();
+                }
+                return finished;
+        }
+
+        bool chunked_body::done() const
+        {
+                return finished;
+        }
+
+        const std::map<response_field_name, std::string>& chunked_body::trailers() const
+        {
+                return trailer_fields;
+        }
+
+        chunked_stream::buffer::buffer(chunked_body& body)
+                : body(body)
+        {
+        }
+
+        chunked_stream::buffer::int_type chunked_stream::buffer::underflow()
+        {
+                size_t n = body.read(reinterpret_cast<uint8_t*>(data.data()), data.size());
+                if (n == 0)
+                {
+                        return traits_type::eof();
+                }
+                setg(data.data(), data.data(), data.data() + n);
+                return traits_type::to_int_type(data[0]);
+        }
+
+        chunked_stream::chunked_stream(chunked_body& body)
+                : std::istream(nullptr), buf(body)
+        {
+                rdbuf(&buf);
+                exceptions(std::ios::badbit);
+        }
+
+        size_t chunk_parser::parse(const char* data, size_t size)
+        {
+                size_t used = 0;
+                while (at != state::done && (at != state::data || remaining == 0))
+                {
+                        if (at == state::data)
+                        {
+                                at = state::data_end;
+                        }
+                        const char* end = static_cast<const char*>(
+                                std::memchr(data + used, '\n', size - used));
+                        if (!end)
+                        {
+                                return used;
+                        }
+                        std::string_view line(data + used, end - (data + used));
+                        used = end + 1 - data;
+                        if (!line.empty() && line.back() == '\r')
+                        {
+                                line.remove_suffix(1);
+                        }
+                        switch (at)
+                        {
+                        case state::data_end:
+                                if (!line.empty())
+                                {
+                                        throw std::runtime_error("Malformed chunked body");
+                                }
+                                at = state::size_line;
+                                break;
+                        case state::size_line:
+                                remaining = parse_chunk_size(line);
+                                at = remaining > 0 ? state::data : state::trailer;
+                                break;
+                        case state::trailer:
+                                if (line.empty())
+                                {
+                                        at = state::done;
+                                }
+                                break;
+                        default:
+                                break;
+                        }
+                }
+                return used;
+        }
+
+        size_t chunk_parser::data_left() const
+        {
+                return at == state::data ? remaining : 0;
+        }
+
+        void chunk_parser::consume(size_t n)
+        {
+                remaining -= std::min(n, remaining);
+        }
+
+        bool chunk_parser::done() const
+        {
+                return at == state::done;
+        }
+
+        body_result response_message::read_body(std::istream& is, body_sink& sink)
+        {
+                if (!chunked())
+                {
+                        return message::read_body(is, nullptr, sink, content_length());
+                }
+                chunked_body chunks(is);
+                body_result result = message::read_body(is, &chunks, sink, SIZE_MAX);
+                header_fields.insert(chunks.trailers().begin(), chunks.trailers().end());
+                return result;
+        }
+
+        span_sink::span_sink(uint8_t* data, size_t size)
+                : data(data), size(size)
+        {
+        }
+
+        uint8_t* span_sink::prepare(size_t& n)
+        {
+                n = std::min(n, size - used);
+                return data + used;
+        }
+
+        void span_sink::commit(size_t n)
+        {
+                used += n;
+        }
+
+        fd_sink::fd_sink(int fd)
+                : fd(fd), positioned(false), offset(0), block(body_block_size)
+        {
+        }
+
+        fd_sink::fd_sink(int fd, size_t offset)
+                : fd(fd), positioned(true), offset(offset), block(body_block_size)
+        {
+        }
+
+        uint8_t* fd_sink::prepare(size_t& n)
+        {
+                n = std::min(n, block.size());
+                return block.data();
+        }
+
+        void fd_sink::commit(size_t n)
+        {
+                const uint8_t* data = block.data();
+                while (n > 0)
+                {
+                        ssize_t written = positioned
+                                ? ::pwrite(fd, data, n, offset)
+                                : ::write(fd, data, n);
+                        if (written < 0)
+                        {
+                                if (errno == EINTR)
+                                {
+                                        continue;
+                                }
+                                throw std::runtime_error(std::string("Unable to write the body: ")
+                                                         + std::strerror(errno));
+                        }
+                        data += written;
+                        offset += written;
+                        n -= written;
+                }
+        }
+
+        function_sink::function_sink(std::function<void(const uint8_t*, size_t)> on_data)
+                : on_data(std::move(on_data)), block(body_block_size)
+        {
+        }
+
+        uint8_t* function_sink::prepare(size_t& n)
+        {
+                n = std::min(n, block.size());
+                return block.data();
+        }
+
+        void function_sink::commit(size_t n)
+        {
+                if (n > 0)
+                {
+                        on_data(block.data(), n);
+                }
+        }
+
+        body_result read_body(std::istream& is, chunked_body* chunks,
+                              body_sink& sink, size_t limit)
+        {
+                body_result result{0, false};
+                while (result.length < limit)
+                {
+                        size_t n = limit - result.length;
+                        uint8_t* destination = sink.prepare(n);
+                        if (n == 0)
+                        {
+                                // A full sink is fine if that's where a
+                                // chunked body ends, or the stream failed
+                                // anyway
+                                if ((!chunks || !chunks->end()) && is)
+                                {
+                                        throw std::runtime_error("The body is too big for its destination");
+                                }
+                                break;
+                        }
+                        size_t got;
+                        if (chunks)
+                        {
+                                got = chunks->read(destination, n);
+                        }
+                        else
+                        {
+                                is.read(reinterpret_cast<char*>(destination), n);
+                                got = is.gcount();
+                        }
+                        sink.commit(got);
+                        result.length += got;
+                        // A chunked body hands out a chunk at a time, so
+                        // only nothing at all means it stopped
+                        if (got == 0 || (!chunks && got < n))
+                        {
+                                break;
+                        }
+                }
+                result.complete = result.length == limit || (chunks && chunks->done());
+                return result;
         }
 
         bool response_message::operator==(const response_message& rhs) const
@@ -364,5 +1210,24 @@ namespace message {
         {
                 return message_body;
         }
-}
 
+        bool response_message::keep_alive() const
+        {
+                auto it = header_fields.find(fields::connection);
+                if (it != header_fields.end())
+                {
+                        ci::string connection = ci::from_string(it->second);
+                        if (connection.find("close") != ci::string::npos)
+                        {
+                                return false;
+                        }
+                        if (connection.find("keep-alive") != ci::string::npos)
+                        {
+                                return true;
+                        }
+                }
+                // HTTP/1.0 connections close after each response unless the
+                // server explicitly says otherwise.
+                return version != http_version::HTTP10;
+        }
+}
@@ -1,12 +1,20 @@
 #ifndef MESSAGE_HPP
 #define MESSAGE_HPP
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <functional>
 #include <map>
 #include <ostream>
 #include <istream>
+#include <stdexcept>
+#include <streambuf>
 
 #include "ci_string.hpp"
+#include "field_registry.hpp"
 
 // This module provides classes to represent HTTP requests and responses, and to
 // stream the classes using iostream interfaces.
@@ -18,29 +26,35 @@
 namespace message {
 
         // request/response_field_name represent the key of a single header
-        // key/value pair in an HTTP message.
+        // key/value pair in an HTTP message. A known field is kept as its ID
+        // in the registry, and only an X- extension field keeps its name.
         class request_field_name {
-                // Using an enumeration instead of a string here could save some memory, but it
-                // would be a bit of a pain to code the conversion to string. (Maybe could be
-                // done with some regexes.)
-                ci::string name;
+                // Set up before id, which is found along with it
+                std::string extension;
+                field_id id;
         public:
-                request_field_name(std::string name);
+                request_field_name(field_id id);
+                request_field_name(std::string_view name);
+                request_field_name(const std::string& name);
                 request_field_name(const char* name);
                 std::string to_string() const;
         };
 
         class response_field_name {
-                ci::string name;
+                // Set up before id, which is found along with it
+                std::string extension;
+                field_id id;
         public:
-                response_field_name(std::string name);
+                response_field_name(field_id id);
+                response_field_name(std::string_view name);
+                response_field_name(const std::string& name);
                 response_field_name(const char* name);
                 std::string to_string() const;
                 bool operator<(const response_field_name& rhs) const;
                 bool operator==(const response_field_name& rhs) const;
                 friend std::ostream& operator<<(std::ostream& os, const response_field_name& field);
-        };        
-        
+        };
+
         // method should represent any HTTP method. Since I haven't implemented
         // request bodies, the methods that use bodies are disabled.
         enum class method {
@@ -84,7 +98,38 @@ namespace message {
                 // No need for message bodies yet.
         public:
                 request_message(method request_method, std::string path, std::vector<request_field> header_fields);
-                friend std::ostream& operator<<(std::ostream& os, request_message message);
+                friend std::ostream& operator<<(std::ostream& os, const request_message& message);
+        };
+
+        // A request_template is a request for ranges of a file, with
+        // everything but the Range field serialized once up front. Each
+        // request only formats its ranges into the end of the template's
+        // buffer, so once the buffer is big enough, making one allocates
+        // nothing. The request returned is a view into the buffer, valid
+        // until the next one is made.
+        class request_template {
+                std::string buffer;
+                // Everything up to and including "Range: bytes="
+                size_t prefix_size;
+
+                void add_range(size_t first_byte, size_t last_byte);
+                std::string_view finish();
+        public:
+                request_template(method request_method, const std::string& path,
+                                 const std::vector<request_field>& header_fields);
+                // The request for bytes first_byte to last_byte
+                std::string_view with_range(size_t first_byte, size_t last_byte);
+                // The request for each range r from r.first_byte to r.last_byte
+                template <typename Ranges>
+                std::string_view with_ranges(const Ranges& ranges)
+                {
+                        buffer.resize(prefix_size);
+                        for (const auto& r : ranges)
+                        {
+                                add_range(r.first_byte, r.last_byte);
+                        }
+                        return finish();
+                }
         };
         
         enum class http_version {
@@ -107,11 +152,280 @@ namespace message {
                 response_code() = default;
                 bool operator==(const response_code& rhs) const;
                 operator bool() const;
+                int value() const;
                 friend std::istream& operator>>(std::istream& is, response_code& code);
                 friend std::ostream& operator<<(std::ostream& os,
                                                 const response_code& code);
         };
                 
+        // A content_range is the value of a Content-Range field: which bytes
+        // of the file a partial response carries and how long the whole file
+        // is. Either part may be unknown ("*"), e.g. a 416 response only says
+        // how long the file is.
+        struct content_range
+        {
+                bool has_range;
+                size_t first_byte;
+                size_t last_byte;
+                bool has_length;
+                size_t complete_length;
+        };
+
+        // Parse a Content-Range value such as "bytes 0-499/1234". Returns
+        // false if it isn't a valid byte range.
+        bool parse_content_range(const std::string& value, content_range& range);
+
+        // Get the boundary of a multipart/byteranges body from the value of a
+        // Content-Type field such as
+        // "multipart/byteranges; boundary=THIS_STRING_SEPARATES". Returns
+        // false for any other type of content.
+        bool parse_multipart_boundary(const std::string& content_type,
+                                      std::string& boundary);
+
+        // A byterange_handler is given each part of a multipart/byteranges
+        // body: the range of the file the part holds, and the stream
+        // positioned at the first byte of it. It must read exactly the bytes
+        // of the range from the stream.
+        using byterange_handler =
+                std::function<void(const content_range& range, std::istream& is)>;
+
+        // Thrown when the stream a body is read from ends or fails before the
+        // body does, which means the connection was lost rather than that the
+        // body is malformed.
+        class truncated_body : public std::runtime_error
+        {
+        public:
+                using std::runtime_error::runtime_error;
+        };
+
+        // Read a multipart/byteranges body of length bytes from is, handing
+        // each part to on_part as it is reached, so the data goes wherever
+        // the handler puts it without the whole body being buffered first.
+        // length may be SIZE_MAX for a body that ends with the stream, such
+        // as a chunked_stream. Throws truncated_body if is ends first, and
+        // std::runtime_error if the body is malformed.
+        void read_byteranges(std::istream& is, size_t length,
+                             const std::string& boundary,
+                             const byterange_handler& on_part);
+
+        // A response_parser reads the status line and header fields of a
+        // response straight out of the buffer the bytes were received into,
+        // however they were split up on the way, without copying anything.
+        // Each call to parse picks up where the last one left off, so the
+        // header is only scanned once however many reads it takes to arrive.
+        // The fields are views into the buffer, and are only valid as long as
+        // the bytes they were parsed from are.
+        class response_parser {
+        public:
+                // A response with more fields than this, or a longer header,
+                // is rejected.
+                static const size_t max_fields = 64;
+                static const size_t max_header_size = 64 * 1024;
+
+                // Parse the first size bytes of a response at data, which
+                // must include the bytes given to earlier calls, although the
+                // buffer may have moved since. Returns true once the header is
+                // complete, and false if more bytes are needed. Throws if the
+                // header is malformed.
+                bool parse(const char* data, size_t size);
+                // Start again with the next response.
+                void reset();
+                bool done() const;
+                // The number of bytes the status line and header take up,
+                // i.e. where the body starts, once done.
+                size_t header_size() const;
+
+                http_version version() const;
+                int status_code() const;
+                std::string_view reason() const;
+                size_t field_count() const;
+                std::string_view field_name(size_t i) const;
+                std::string_view field_value(size_t i) const;
+                // The value of the first field called name, compared without
+                // regard to case, or a null view if there isn't one.
+                std::string_view find_field(std::string_view name) const;
+        private:
+                // Where a string is, relative to the start of the buffer
+                struct span {
+                        size_t offset;
+                        size_t length;
+                };
+                // Left uninitialized until parsed, so that a parser is cheap to
+                // make
+                struct field_span {
+                        span name;
+                        span value;
+                };
+
+                void parse_status_line(size_t start, size_t end);
+                void parse_field(size_t start, size_t colon_at, size_t end);
+                std::string_view view(span s) const;
+
+                const char* buffer = nullptr;
+                // Everything before scanned has been looked at, and the line
+                // being read starts at line_start. colon is where its first
+                // ':' is, or 0 until there is one, since no field can start
+                // the response.
+                size_t scanned = 0;
+                size_t line_start = 0;
+                size_t colon = 0;
+                bool status_read = false;
+                bool finished = false;
+                http_version http = http_version::HTTP11;
+                int code = 0;
+                span reason_span{0, 0};
+                std::array<field_span, max_fields> fields;
+                size_t count = 0;
+        };
+
+        // A chunked_body reads a body sent with Transfer-Encoding: chunked
+        // from a stream, handing out the data as it arrives rather than
+        // collecting it first. Chunk sizes and extensions are dropped, and
+        // the trailer fields after the last chunk are kept, apart from any
+        // that aren't response fields.
+        class chunked_body {
+                std::istream& is;
+                // Bytes of the current chunk not read yet
+                size_t remaining = 0;
+                // Whether a chunk has been started, so its CRLF comes first
+                bool started = false;
+                bool finished = false;
+                std::map<response_field_name, std::string> trailer_fields;
+
+                bool next_chunk();
+        public:
+                explicit chunked_body(std::istream& is);
+                // Read up to n bytes of the body into buffer. Returns the
+                // number read, which is 0 at the end of the body or if the
+                // stream fails, as done tells apart. Throws if the body is
+                // malformed.
+                size_t read(uint8_t* buffer, size_t n);
+                // Read the rest of the body, which should be nothing but the
+                // last chunk and the trailer. Returns whether the end of the
+                // body was reached, which isn't the case if there is more data
+                // or the stream fails.
+                bool end();
+                // Whether the whole body, trailer and all, has been read.
+                bool done() const;
+                // The trailer fields, once done.
+                const std::map<response_field_name, std::string>& trailers() const;
+        };
+
+        // A chunked_stream reads the data of a chunked body as an istream,
+        // for readers like read_byteranges that take one. The stream ends
+        // where the body does, and a malformed body throws from the read
+        // rather than just failing the stream.
+        class chunked_stream : public std::istream {
+                class buffer : public std::streambuf {
+                        chunked_body& body;
+                        std::array<char, 16 * 1024> data;
+                protected:
+                        int_type underflow() override;
+                public:
+                        explicit buffer(chunked_body& body);
+                };
+                buffer buf;
+        public:
+                explicit chunked_stream(chunked_body& body);
+        };
+
+        // A chunk_parser follows the framing of a chunked body in a buffer,
+        // for readers like the async engine that read the socket themselves
+        // rather than through a stream. Like chunked_body, it drops chunk
+        // sizes and extensions, but it drops the trailer fields too.
+        class chunk_parser {
+                enum class state {
+                        size_line,
+                        data,
+                        data_end,
+                        trailer,
+                        done,
+                };
+                state at = state::size_line;
+                // Bytes of the current chunk not read yet
+                size_t remaining = 0;
+        public:
+                // Parse the framing at the start of the size bytes at data,
+                // as far as the next chunk data or the end of the body.
+                // Returns how many bytes of framing there were. If that's all
+                // of them and there is neither data_left nor done, the next
+                // bytes of the body are needed to carry on. Throws if the body
+                // is malformed.
+                size_t parse(const char* data, size_t size);
+                // How many bytes of chunk data come next.
+                size_t data_left() const;
+                // Record that n bytes of chunk data, no more than data_left,
+                // have been read past the parser.
+                void consume(size_t n);
+                // Whether the whole body, trailer and all, has been parsed.
+                bool done() const;
+        };
+
+        // How much of a body read_body read, and whether that was all of
+        // it. A body ends early if the stream fails or runs out first.
+        struct body_result {
+                size_t length;
+                bool complete;
+        };
+
+        // A body_sink is where read_body puts a body as it comes off the
+        // stream, so it only has to be read once: straight into memory the
+        // caller owns, to a file, or to a function.
+        class body_sink {
+        public:
+                virtual ~body_sink() = default;
+                // Where to read the next bytes of the body to. n is how many
+                // there are, and is cut down to how many fit there, which is
+                // 0 if the sink is full.
+                virtual uint8_t* prepare(size_t& n) = 0;
+                // The first n bytes of the space prepare gave out have been
+                // read.
+                virtual void commit(size_t n) = 0;
+        };
+
+        // Read the body into the size bytes at data. A longer body is an
+        // error.
+        class span_sink : public body_sink {
+                uint8_t* data;
+                size_t size;
+                size_t used = 0;
+        public:
+                span_sink(uint8_t* data, size_t size);
+                uint8_t* prepare(size_t& n) override;
+                void commit(size_t n) override;
+        };
+
+        // Write the body to a file descriptor as it arrives, a block at a
+        // time: at its current position, or from offset on with pwrite.
+        class fd_sink : public body_sink {
+                int fd;
+                bool positioned;
+                size_t offset;
+                std::vector<uint8_t> block;
+        public:
+                explicit fd_sink(int fd);
+                fd_sink(int fd, size_t offset);
+                uint8_t* prepare(size_t& n) override;
+                void commit(size_t n) override;
+        };
+
+        // Hand the body to a function a block at a time.
+        class function_sink : public body_sink {
+                std::function<void(const uint8_t*, size_t)> on_data;
+                std::vector<uint8_t> block;
+        public:
+                explicit function_sink(std::function<void(const uint8_t*, size_t)> on_data);
+                uint8_t* prepare(size_t& n) override;
+                void commit(size_t n) override;
+        };
+
+        // Read up to limit bytes of a body from is into sink, through chunks
+        // if it's chunked. The result is complete if limit bytes were read,
+        // or a chunked body ended before that. Throws if the body doesn't
+        // fit in sink.
+        body_result read_body(std::istream& is, chunked_body* chunks,
+                              body_sink& sink, size_t limit);
+
         // A response_message is the result of the request.
         class response_message {
                 http_version version;
@@ -120,15 +434,44 @@ namespace message {
                 std::map<response_field_name, std::string> header_fields;
                 
                 std::vector<uint8_t> message_body;
+
+                response_message() = default;
+                void read_header_fields(std::istream& is);
         public:
                 response_message(http_version version, response_code status,
                                  std::map<response_field_name, std::string> header_fields,
                                  std::vector<uint8_t> body);
                 response_message(std::istream& is);
+                // The header parsed by parser, which must be done, without a
+                // body. Fields that aren't response fields or extensions are
+                // left out.
+                explicit response_message(const response_parser& parser);
+                // Read the status line and header fields only, leaving the
+                // body in the stream for the caller. If the stream ends
+                // before the header does, it is left failed.
+                static response_message read_header(std::istream& is);
+                // Read the body that follows this header from is into sink,
+                // adding the trailer fields of a chunked body to the header.
+                // Throws if the header declares neither a Content-Length nor
+                // chunks.
+                body_result read_body(std::istream& is, body_sink& sink);
                 bool operator==(const response_message& rhs) const;
                 operator bool() const;
                 friend std::ostream& operator<<(std::ostream& os, const response_message& rhs);
                 const std::vector<uint8_t>& body() const;
+                // Whether the connection may be reused for another request
+                // once this response has been read.
+                bool keep_alive() const;
+                // The length of the body declared by the Content-Length field.
+                // Throws if the response doesn't declare one.
+                size_t content_length() const;
+                // Whether the body is sent in chunks (see chunked_body) rather
+                // than with a Content-Length.
+                bool chunked() const;
+                int status_code() const;
+                // The value of a header field, or nullptr if the response
+                // doesn't have it.
+                const std::string* find_field(const response_field_name& name) const;
         };
 }
 
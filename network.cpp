@@ -1,9 +1,20 @@
 #include "network.hpp"
 
 #include "message.hpp"
+#include "scheduler.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <thread>
+
+#include <sys/socket.h>
 
 namespace network
 {
@@ -29,63 +40,824 @@ namespace network
                 return std::make_pair(std::move(host), std::move(path));
         }
 
+        namespace
+        {
+                using clock = std::chrono::steady_clock;
+
+                clock::duration to_clock(std::chrono::duration<double> d)
+                {
+                        return std::chrono::duration_cast<clock::duration>(d);
+                }
+
+                bool timed_out(const tcp::iostream& socket)
+                {
+                        return socket.error() == boost::asio::error::timed_out;
+                }
+
+                // The error for a connection that broke or timed out.
+                connection_error lost_connection(const tcp::iostream& socket,
+                                                 const std::string& host)
+                {
+                        if (timed_out(socket))
+                        {
+                                return connection_error("Timed out waiting for " + host);
+                        }
+                        return connection_error("Lost the connection to " + host);
+                }
+
+                // Wait before the given retry of a connection that failed:
+                // limits.backoff before the first, and twice as long before
+                // each one after that.
+                void back_off(const transfer_limits& limits, int retry)
+                {
+                        std::this_thread::sleep_for(
+                                limits.backoff * std::pow(2.0, std::max(retry - 1, 0)));
+                }
+
+                // Write a request to socket without sending it yet.
+                void write_request(tcp::iostream& socket, std::string_view request)
+                {
+                        socket.write(request.data(), request.size());
+                }
+
+                // The header of a response and the connection it arrived on,
+                // positioned at the start of the body.
+                struct range_response
+                {
+                        connection_pool::connection socket;
+                        message::response_message header;
+                        // Decodes the body if it's chunked
+                        std::unique_ptr<message::chunked_body> chunks;
+                };
+
+                // How long the body of a response is. A chunked body only
+                // says where it ends when it gets there, so its length is
+                // taken from its Content-Range, or is SIZE_MAX for a whole
+                // file. A 416 response may leave out the length of its empty
+                // body.
+                size_t body_length(const message::response_message& header)
+                {
+                        if (!header.chunked())
+                        {
+                                if (header.status_code() == 416
+                                    && !header.find_field(message::fields::content_length))
+                                {
+                                        return 0;
+                                }
+                                return header.content_length();
+                        }
+                        message::content_range range;
+                        const std::string* field = header.find_field(message::fields::content_range);
+                        if (header.status_code() == 206 && field
+                            && message::parse_content_range(*field, range) && range.has_range)
+                        {
+                                return range.last_byte - range.first_byte + 1;
+                        }
+                        return SIZE_MAX;
+                }
+
+                // Throw unless the response is one the download can use.
+                void check_status(const message::response_message& header,
+                                  const std::string& host)
+                {
+                        // 416 means the range is past the end of the file,
+                        // which the caller may be able to deal with.
+                        if (!header && header.status_code() != 416)
+                        {
+                                throw std::runtime_error("Remote host " + host
+                                                         + " didn't succeed.");
+                        }
+                }
+
+                // Send a request for ranges, made from a range_requests
+                // template, over a connection from pool and read the response
+                // header.
+                range_response send_range_request(
+                        connection_pool& pool,
+                        const std::string& host, uint16_t port,
+                        std::string_view request,
+                        const transfer_limits& limits)
+                {
+                        bool reused;
+                        connection_pool::connection socket =
+                                pool.checkout(host, port, reused);
+                        socket->expires_after(to_clock(limits.first_byte));
+                        write_request(*socket, request);
+                        socket->flush();
+                        // An idle connection may have been closed by the
+                        // server without us noticing. That shows up as an error
+                        // or EOF before the first byte of the response, and is
+                        // worth one retry on a fresh connection.
+                        if (reused && (socket->error()
+                                       || socket->peek() == std::char_traits<char>::eof()))
+                        {
+                                socket = pool.open(host, port);
+                                socket->expires_after(to_clock(limits.first_byte));
+                                write_request(*socket, request);
+                                socket->flush();
+                        }
+                        if (socket->error())
+                        {
+                                throw lost_connection(*socket, host);
+                        }
+                        auto header = message::response_message::read_header(*socket);
+                        if (!*socket || socket->error())
+                        {
+                                throw lost_connection(*socket, host);
+                        }
+                        check_status(header, host);
+                        std::unique_ptr<message::chunked_body> chunks;
+                        if (header.chunked())
+                        {
+                                chunks.reset(new message::chunked_body(*socket));
+                        }
+                        return {std::move(socket), std::move(header), std::move(chunks)};
+                }
+
+                // Download the bytes from first_byte to last_byte into buffer,
+                // retrying a connection that fails, and asking only for what
+                // hasn't arrived yet. Returns how many bytes there were, which
+                // is fewer than asked for at the end of the file.
+                //
+                // A server that ignores ranges sends the whole file instead,
+                // and the part before first_byte is skipped. Given whole, the
+                // connection is left there at last_byte + 1, so the next call
+                // can carry on reading it instead of asking for the file
+                // again.
+                size_t fetch_chunk(
+                        connection_pool& pool,
+                        const std::string& host, uint16_t port,
+                        message::request_template& requests,
+                        size_t first_byte, size_t last_byte, uint8_t* buffer,
+                        const transfer_limits& limits,
+                        std::unique_ptr<range_response>* whole)
+                {
+                        // Read a block at a time, so that the idle timeout
+                        // applies to each of them rather than the whole body.
+                        const size_t block_size = 16 * 1024;
+                        std::unique_ptr<range_response> single;
+                        std::unique_ptr<range_response>& response = whole ? *whole : single;
+                        size_t downloaded = 0;
+                        for (int failures = 0; ; )
+                        {
+                                try
+                                {
+                                        size_t offset = first_byte + downloaded;
+                                        bool fresh = !response;
+                                        if (fresh)
+                                        {
+                                                response.reset(new range_response(
+                                                        send_range_request(
+                                                                pool, host, port,
+                                                                requests.with_range(offset, last_byte),
+                                                                limits)));
+                                        }
+                                        connection_pool::connection& socket = response->socket;
+                                        const message::response_message& header = response->header;
+                                        // A 416 response means there's nothing
+                                        // left in the file
+                                        if (header.status_code() == 416)
+                                        {
+                                                response.reset();
+                                                return downloaded;
+                                        }
+                                        message::chunked_body* chunks = response->chunks.get();
+                                        bool whole_file = header.status_code() == 200;
+                                        size_t length = body_length(header);
+                                        size_t body_end = whole_file ? length : offset + length;
+                                        // Read n bytes of the body from
+                                        // position in the file to destination,
+                                        // noting where the body turns out to
+                                        // end if it's chunked.
+                                        auto read_block = [&](uint8_t* destination, size_t n,
+                                                              size_t position) {
+                                                socket->expires_after(to_clock(limits.idle));
+                                                message::span_sink sink(destination, n);
+                                                message::body_result got =
+                                                        message::read_body(*socket, chunks, sink, n);
+                                                if (!got.complete)
+                                                {
+                                                        throw lost_connection(*socket, host);
+                                                }
+                                                if (got.length != n)
+                                                {
+                                                        body_end = position + got.length;
+                                                }
+                                                return got.length;
+                                        };
+                                        // The whole file starts at its
+                                        // beginning, not at offset
+                                        std::vector<uint8_t> skipped;
+                                        for (size_t position = 0;
+                                             fresh && whole_file && position < std::min(offset, body_end); )
+                                        {
+                                                size_t n = std::min(block_size, offset - position);
+                                                skipped.resize(n);
+                                                position += read_block(skipped.data(), n, position);
+                                        }
+                                        while (offset < std::min(body_end, last_byte + 1))
+                                        {
+                                                size_t got = read_block(
+                                                        buffer + downloaded,
+                                                        std::min(block_size,
+                                                                 std::min(body_end, last_byte + 1)
+                                                                 - offset),
+                                                        offset);
+                                                downloaded += got;
+                                                offset += got;
+                                        }
+                                        bool finished = offset == body_end;
+                                        if (chunks)
+                                        {
+                                                socket->expires_after(to_clock(limits.idle));
+                                                finished = chunks->end();
+                                        }
+                                        if (finished && header.keep_alive())
+                                        {
+                                                pool.checkin(host, port, std::move(socket));
+                                        }
+                                        if (finished || !whole_file)
+                                        {
+                                                response.reset();
+                                        }
+                                        return downloaded;
+                                }
+                                catch (const connection_error&)
+                                {
+                                        response.reset();
+                                        if (++failures > limits.retries)
+                                        {
+                                                throw;
+                                        }
+                                        back_off(limits, failures);
+                                }
+                        }
+                }
+
+                // A range that has been asked for on a connection, but whose
+                // response hasn't been read yet.
+                struct requested_range
+                {
+                        chunk c;
+                        chunk_scheduler::active_handle active;
+                        clock::time_point sent;
+                };
+
+                // Take ranges from scheduler and download them into out until
+                // there are none left. While the server copes with it, up to
+                // pipeline_depth requests are written to the connection ahead
+                // of reading their responses, so the link isn't idle for a
+                // round trip between chunks. Returns the amount of data
+                // downloaded.
+                size_t download_chunks(
+                        connection_pool& pool, chunk_scheduler& scheduler,
+                        const mirror& source, const std::atomic<bool>& dropped,
+                        output_file& out, int pipeline_depth,
+                        const transfer_limits& limits)
+                {
+                        const std::string& host = source.host;
+                        const uint16_t port = source.port;
+                        message::request_template requests = range_requests(host, source.path);
+                        // The body is claimed from the scheduler a block at a
+                        // time, so that the part not read yet can be handed to
+                        // another worker.
+                        const size_t block_size = 16 * 1024;
+                        std::vector<uint8_t> block(block_size);
+                        size_t downloaded = 0;
+                        connection_rate& rate = scheduler.add_connection();
+                        // The ranges this worker has taken, in the order their
+                        // responses arrive. The first sent of them have been
+                        // requested on socket.
+                        std::deque<requested_range> in_flight;
+                        size_t sent = 0;
+                        connection_pool::connection socket;
+                        // Whether socket came from the pool or has answered a
+                        // request already, either of which means the server
+                        // may have closed it before the next response.
+                        bool used = false;
+                        size_t answered_here = 0;
+                        // A pipelined response can't start arriving until the
+                        // one before it has been read.
+                        clock::time_point last_finished;
+                        // How much of the first range in flight has been
+                        // written to out.
+                        size_t front_received = 0;
+                        // Give the ranges this worker took but didn't finish
+                        // back to the scheduler, keeping what it did write.
+                        auto give_back = [&]() {
+                                for (size_t i = in_flight.size(); i-- > 0; )
+                                {
+                                        scheduler.requeue(in_flight[i].active,
+                                                          i == 0 ? front_received : 0);
+                                }
+                                in_flight.clear();
+                        };
+                        // Connection failures since the last range this worker
+                        // finished
+                        int failures = 0;
+                        try
+                        {
+                        for (;;)
+                        {
+                        try
+                        {
+                                // Another connection to the same mirror failed
+                                if (dropped)
+                                {
+                                        give_back();
+                                        break;
+                                }
+                                size_t depth = pool.pipelining(host, port)
+                                        ? size_t(std::max(pipeline_depth, 1)) : 1;
+                                while (in_flight.size() < depth)
+                                {
+                                        requested_range r;
+                                        bool wait;
+                                        // Only block for more work when there
+                                        // is nothing else to do.
+                                        bool taken = in_flight.empty()
+                                                ? scheduler.next(r.c, r.active, &rate)
+                                                : scheduler.try_next(r.c, r.active, wait, &rate);
+                                        if (!taken)
+                                        {
+                                                break;
+                                        }
+                                        in_flight.push_back(std::move(r));
+                                }
+                                if (in_flight.empty())
+                                {
+                                        break;
+                                }
+                                if (!socket)
+                                {
+                                        socket = pool.checkout(host, port, used);
+                                        sent = 0;
+                                        answered_here = 0;
+                                }
+                                socket->expires_after(to_clock(limits.idle));
+                                if (sent < std::min(in_flight.size(), depth))
+                                {
+                                        clock::time_point now = clock::now();
+                                        for (; sent < std::min(in_flight.size(), depth); ++sent)
+                                        {
+                                                const chunk& c = in_flight[sent].c;
+                                                write_request(*socket, requests.with_range(
+                                                                      c.first_byte, c.last_byte));
+                                                in_flight[sent].sent = now;
+                                        }
+                                        socket->flush();
+                                }
+                                // The server may have closed the connection
+                                // since it was last used, which shows up as an
+                                // error or EOF before the first byte of the
+                                // response. The requests are worth resending on
+                                // a fresh connection, and so are requests a
+                                // connection that has worked before is taking
+                                // too long to answer.
+                                if (!socket->error())
+                                {
+                                        socket->expires_after(to_clock(limits.first_byte));
+                                }
+                                if (socket->error()
+                                    || socket->peek() == std::char_traits<char>::eof())
+                                {
+                                        if (!used)
+                                        {
+                                                throw lost_connection(*socket, host);
+                                        }
+                                        // It dropped requests queued behind
+                                        // ones it answered.
+                                        if (answered_here > 0 && sent > 1 && !timed_out(*socket))
+                                        {
+                                                pool.disable_pipelining(host, port);
+                                        }
+                                        socket = pool.open(host, port);
+                                        used = false;
+                                        sent = 0;
+                                        answered_here = 0;
+                                        continue;
+                                }
+                                auto header = message::response_message::read_header(*socket);
+                                clock::time_point answered = clock::now();
+                                if (!*socket || socket->error())
+                                {
+                                        throw lost_connection(*socket, host);
+                                }
+                                requested_range& r = in_flight.front();
+                                if (out_of_order(header, r.c))
+                                {
+                                        if (sent == 1)
+                                        {
+                                                throw std::runtime_error(
+                                                        "Remote host " + host
+                                                        + " sent the wrong range.");
+                                        }
+                                        // Ask again one at a time
+                                        pool.disable_pipelining(host, port);
+                                        socket.reset();
+                                        continue;
+                                }
+                                check_status(header, host);
+                                if (!header.keep_alive() && sent > 1)
+                                {
+                                        // The server drops the requests queued
+                                        // behind this one.
+                                        pool.disable_pipelining(host, port);
+                                }
+                                size_t length = accept_range_response(
+                                        header, r.c, r.active, scheduler, out);
+                                // If the range loses a hedge race, the read
+                                // waiting on it is woken up by shutting the
+                                // socket down under it.
+                                int descriptor = socket->socket().native_handle();
+                                scheduler.on_stop(r.active, [descriptor]() {
+                                        ::shutdown(descriptor, SHUT_RDWR);
+                                });
+                                std::unique_ptr<message::chunked_body> chunks;
+                                if (header.chunked())
+                                {
+                                        chunks.reset(new message::chunked_body(*socket));
+                                }
+                                size_t& received = front_received;
+                                received = 0;
+                                bool lost = false;
+                                bool slow = false;
+                                // A body that is arriving too slowly is worth
+                                // asking for again on another connection.
+                                auto too_slow = [&]() {
+                                        std::chrono::duration<double> elapsed =
+                                                clock::now() - answered;
+                                        return limits.min_rate > 0
+                                                && elapsed >= limits.min_rate_window
+                                                && received < limits.min_rate * elapsed.count();
+                                };
+                                while (received < length)
+                                {
+                                        size_t n = scheduler.claim(
+                                                r.active,
+                                                std::min(block_size, length - received));
+                                        if (n == 0)
+                                        {
+                                                break;
+                                        }
+                                        size_t offset = r.c.first_byte + received;
+                                        uint8_t* destination = out.direct(offset, n);
+                                        socket->expires_after(to_clock(limits.idle));
+                                        message::span_sink sink(
+                                                destination ? destination : block.data(), n);
+                                        size_t got = message::read_body(
+                                                *socket, chunks.get(), sink, n).length;
+                                        if (!destination)
+                                        {
+                                                out.write_at(offset, block.data(), got);
+                                        }
+                                        out.commit(offset, got);
+                                        received += got;
+                                        if (got != n)
+                                        {
+                                                lost = true;
+                                                break;
+                                        }
+                                        if (too_slow())
+                                        {
+                                                slow = true;
+                                                break;
+                                        }
+                                }
+                                // The rest of a range that broke off is asked
+                                // for again, keeping what was written: after
+                                // a pause if the connection failed, or right
+                                // away on another connection if it was just
+                                // too slow.
+                                if (lost)
+                                {
+                                        throw lost_connection(*socket, host);
+                                }
+                                if (slow)
+                                {
+                                        scheduler.requeue(r.active, received);
+                                        downloaded += received;
+                                        in_flight.pop_front();
+                                        received = 0;
+                                        socket.reset();
+                                        continue;
+                                }
+                                clock::time_point finished = clock::now();
+                                scheduler.measure(rate, received,
+                                                  answered - std::max(r.sent, last_finished),
+                                                  finished - answered);
+                                last_finished = finished;
+                                scheduler.finish(r.active);
+                                downloaded += received;
+                                in_flight.pop_front();
+                                failures = 0;
+                                --sent;
+                                used = true;
+                                ++answered_here;
+                                // If the tail of the range was stolen, the rest
+                                // of the body is still on its way. Rather than
+                                // read data that another worker is fetching,
+                                // drop the connection, and ask for anything
+                                // queued behind it again on a new one.
+                                bool complete = received == body_length(header);
+                                if (chunks)
+                                {
+                                        socket->expires_after(to_clock(limits.idle));
+                                        complete = received == length && chunks->end();
+                                }
+                                if (!complete || !header.keep_alive())
+                                {
+                                        socket.reset();
+                                }
+                                else if (sent == 0)
+                                {
+                                        pool.checkin(host, port, std::move(socket));
+                                }
+                                received = 0;
+                        }
+                        catch (const connection_error&)
+                        {
+                                // Another connection may well do better, until
+                                // the retries run out. A connection closed
+                                // because its range lost a hedge race didn't
+                                // fail, so the worker carries on right away.
+                                bool stopped = !in_flight.empty()
+                                        && scheduler.stopped(in_flight.front().active);
+                                downloaded += front_received;
+                                give_back();
+                                front_received = 0;
+                                socket.reset();
+                                if (stopped)
+                                {
+                                        continue;
+                                }
+                                if (++failures > limits.retries)
+                                {
+                                        throw;
+                                }
+                                back_off(limits, failures);
+                        }
+                        }
+                        }
+                        catch (...)
+                        {
+                                give_back();
+                                throw;
+                        }
+                        return downloaded;
+                }
+        }
+
+        bool out_of_order(const message::response_message& header, const chunk& c)
+        {
+                message::content_range range;
+                const std::string* field = header.find_field(message::fields::content_range);
+                return field && message::parse_content_range(*field, range)
+                        && range.has_range && range.first_byte != c.first_byte;
+        }
+
+        size_t accept_range_response(
+                const message::response_message& header, chunk& c,
+                const chunk_scheduler::active_handle& active,
+                chunk_scheduler& scheduler, output_file& out)
+        {
+                // The output has to be big enough before the size is reported,
+                // because that lets the other workers start writing to it.
+                // Responses carry a validator that tells versions of the file
+                // apart, which outputs that outlive the download need. Every
+                // response's ETag is checked, since the mirrors of a file
+                // could be serving different versions of it.
+                const std::string* etag = header.find_field(message::fields::etag);
+                if (etag)
+                {
+                        scheduler.set_etag(*etag);
+                }
+                if (!scheduler.file_size_known())
+                {
+                        const std::string* validator = etag;
+                        if (!validator)
+                        {
+                                validator = header.find_field(message::fields::last_modified);
+                        }
+                        if (validator)
+                        {
+                                out.set_validator(*validator);
+                        }
+                }
+                auto report_file_size = [&scheduler, &out](size_t size) {
+                        if (!scheduler.file_size_known())
+                        {
+                                out.reserve(scheduler.planned_length(size));
+                        }
+                        scheduler.set_file_size(size);
+                };
+                message::content_range range;
+                const std::string* range_field = header.find_field(message::fields::content_range);
+                bool has_range = range_field
+                        && message::parse_content_range(*range_field, range);
+                if (has_range && range.has_length)
+                {
+                        report_file_size(range.complete_length);
+                }
+                if (header.status_code() == 416)
+                {
+                        scheduler.end_of_file(c.first_byte);
+                        scheduler.set_length(active, 0);
+                        return 0;
+                }
+                size_t length = body_length(header);
+                if (header.status_code() == 200)
+                {
+                        // Without a Content-Length the chunks can't be
+                        // planned.
+                        if (length == SIZE_MAX)
+                        {
+                                throw std::runtime_error(
+                                        "The server didn't say how big the file is.");
+                        }
+                        // The server ignored the range, as one that answers
+                        // with Accept-Ranges: none does, and is sending the
+                        // whole file. One such response is enough. Once it's
+                        // the only chunk being downloaded, nothing else is
+                        // writing to the output, which can grow to fit.
+                        if (!scheduler.whole_file(active, c, length))
+                        {
+                                return 0;
+                        }
+                        out.reserve(scheduler.planned_length(length));
+                        return std::min(length, c.size());
+                }
+                if (header.status_code() != 206 || !has_range || !range.has_range
+                    || range.first_byte != c.first_byte || range.last_byte > c.last_byte
+                    || range.last_byte - range.first_byte + 1 != length)
+                {
+                        throw std::runtime_error(
+                                "The server sent a different range than was asked for.");
+                }
+                if (!scheduler.file_size_known())
+                {
+                        // Only one chunk is downloaded at a time until the
+                        // size is known, so it's safe to grow the output.
+                        out.reserve(c.first_byte + std::min(length, c.size()));
+                }
+                scheduler.set_length(active, length);
+                return length;
+        }
+
         size_t download_file_parallel(
-                const std::string& host, uint16_t port, const std::string& path,
-                int number_requests, size_t request_size,
-                std::ostream_iterator<uint8_t>& os)
+                connection_pool& pool, std::vector<mirror>& mirrors,
+                chunk_scheduler& scheduler, int connections, int pipeline_depth,
+                output_file& out, const transfer_limits& limits)
         {
-                std::vector<uint8_t> result_buf(number_requests * request_size);
-                std::vector<std::future<size_t>> futures(number_requests);
-                size_t start_byte = 0;
+                // Set once a mirror has been given up on, so the rest of its
+                // workers stop taking chunks.
+                std::vector<std::atomic<bool>> dropped(mirrors.size());
+                size_t mirrors_left = mirrors.size();
+                std::mutex mirrors_lock;
+                // A worker whose mirror is dropped moves on to another one,
+                // since the chunks it gave back may have no one else to take
+                // them.
+                auto worker = [&, pipeline_depth](size_t m) {
+                        size_t downloaded = 0;
+                        for (;;)
+                        {
+                                try
+                                {
+                                        downloaded += download_chunks(
+                                                pool, scheduler, mirrors[m], dropped[m],
+                                                out, pipeline_depth, limits);
+                                }
+                                catch (const std::exception& e)
+                                {
+                                        std::lock_guard<std::mutex> guard(mirrors_lock);
+                                        if (!dropped[m])
+                                        {
+                                                dropped[m] = true;
+                                                mirrors[m].error = e.what();
+                                                --mirrors_left;
+                                        }
+                                        if (mirrors_left == 0)
+                                        {
+                                                // No point in the other
+                                                // workers carrying on.
+                                                scheduler.cancel();
+                                                throw;
+                                        }
+                                }
+                                if (!dropped[m])
+                                {
+                                        return downloaded;
+                                }
+                                for (size_t i = 1; i <= mirrors.size(); ++i)
+                                {
+                                        if (!dropped[(m + i) % mirrors.size()])
+                                        {
+                                                m = (m + i) % mirrors.size();
+                                                break;
+                                        }
+                                }
+                                if (dropped[m])
+                                {
+                                        return downloaded;
+                                }
+                        }
+                };
+                // Every mirror is looked up once, all at the same time, before
+                // any chunk goes out, and the connections share the result.
+                // The workers for a mirror that can't be found move on to the
+                // others.
+                std::vector<std::future<void>> lookups;
+                for (const mirror& m : mirrors)
+                {
+                        lookups.push_back(std::async(std::launch::async, [&pool, &m]() {
+                                pool.resolver().resolve(m.host, m.port);
+                        }));
+                }
+                for (size_t m = 0; m < mirrors.size(); ++m)
+                {
+                        try
+                        {
+                                lookups[m].get();
+                        }
+                        catch (const std::exception& e)
+                        {
+                                dropped[m] = true;
+                                mirrors[m].error = e.what();
+                                if (--mirrors_left == 0)
+                                {
+                                        throw;
+                                }
+                        }
+                }
+                std::vector<std::future<size_t>> futures;
+                for (size_t m = 0; m < mirrors.size(); ++m)
+                {
+                        for (int i = 0; i < std::max(1, connections); ++i)
+                        {
+                                futures.push_back(std::async(std::launch::async,
+                                                             worker, m));
+                        }
+                }
                 size_t total_downloaded = 0;
+                std::exception_ptr failure;
                 for (std::future<size_t>& f : futures)
                 {
-                        f = std::async(std::launch::async,
-                                       [&host, &path, start_byte,
-                                        request_size, &result_buf, port](){
-                                        return make_chunk_request(
-                                                host, path, start_byte,
-                                                start_byte + request_size - 1,
-                                                result_buf.data() + start_byte,
-                                                port);}
-                                );
-                        start_byte += request_size;
+                        try
+                        {
+                                total_downloaded += f.get();
+                        }
+                        catch (...)
+                        {
+                                failure = std::current_exception();
+                        }
                 }
-                for (std::future<size_t>& f : futures)
+                if (failure)
                 {
-                        total_downloaded += f.get();
+                        std::rethrow_exception(failure);
                 }
-                // Shrink buffer to fit
-                result_buf.resize(total_downloaded);
-                std::copy(result_buf.cbegin(), result_buf.cend(), os);
+                out.finish(scheduler.length());
                 return total_downloaded;
         }
 
         size_t download_file_sequential(
+                connection_pool& pool,
                 const std::string& host, uint16_t port, const std::string& path,
                 int number_requests, size_t request_size,
-                std::ostream_iterator<uint8_t>& os)
+                std::ostream_iterator<uint8_t>& os, const transfer_limits& limits)
         {
                 size_t start_byte = 0;
                 size_t total_downloaded = 0;
+                // Where a server that ignores ranges is sending the whole
+                // file, which is read in request_size pieces as it arrives
+                // rather than asked for again for each of them.
+                std::unique_ptr<range_response> whole;
+                message::request_template requests = range_requests(host, path);
 
                 std::future<std::ostream_iterator<uint8_t>> f;
 
-                for (int i = 0; i < number_requests; ++i)
+                for (int i = 0; number_requests == 0 || i < number_requests; ++i)
                 {
                         std::vector<uint8_t> buf(request_size);
                         size_t downloaded =
-                                make_chunk_request(host, path, start_byte,
-                                                   start_byte + request_size - 1,
-                                                   buf.data(), port);;
+                                fetch_chunk(pool, host, port, requests, start_byte,
+                                            start_byte + request_size - 1,
+                                            buf.data(), limits, &whole);
                         buf.resize(downloaded);
                         if (f.valid())
                                 f.wait();
-                        f = std::async(std::launch::async, [&buf, &os]() {
+                        // The writer owns its buffer, since this one goes
+                        // out of scope before the write finishes.
+                        f = std::async(std::launch::async,
+                                       [buf = std::move(buf), &os]() {
                                         return std::copy(buf.cbegin(), buf.cend(),
                                                          os); });
                         total_downloaded += downloaded;
                         start_byte += request_size;
+                        // A short chunk is the end of the file
+                        if (downloaded < request_size)
+                        {
+                                break;
+                        }
                 }
                 if (f.valid())
                         f.wait();
@@ -93,38 +865,298 @@ namespace network
                 return total_downloaded;
         }
 
-        size_t make_chunk_request(
-                const std::string& host, const std::string& path,
-                size_t first_byte, size_t last_byte, uint8_t* buffer,
-                uint16_t port)
+        namespace
         {
-                tcp::iostream socket(host, std::to_string(port));
-                std::string range_string = std::string("bytes=")
-                        + std::to_string(first_byte) + "-"
-                        + std::to_string(last_byte);
-                
-                socket << message::request_message(
-                        message::method::GET, path,
-                        {{"Host", host},
-                                {"Range", range_string},
-                                {"User-Agent", "chunking client"}});
-                socket.flush();
-                if (socket.error())
+                // Sort ranges and merge the ones that overlap or touch.
+                std::vector<chunk> merge_ranges(std::vector<chunk> ranges)
                 {
-                        throw std::runtime_error("Network error");
+                        std::sort(ranges.begin(), ranges.end(),
+                                  [](const chunk& a, const chunk& b) {
+                                          return a.first_byte < b.first_byte;
+                                  });
+                        std::vector<chunk> merged;
+                        for (const chunk& c : ranges)
+                        {
+                                if (!merged.empty()
+                                    && c.first_byte <= merged.back().last_byte + 1)
+                                {
+                                        merged.back().last_byte = std::max(
+                                                merged.back().last_byte, c.last_byte);
+                                }
+                                else
+                                {
+                                        merged.push_back(c);
+                                }
+                        }
+                        return merged;
                 }
-                message::response_message response(socket);
-                if (socket.error())
+
+                // The parts of wanted that aren't in received. Both are
+                // sorted and merged.
+                std::vector<chunk> missing_ranges(const std::vector<chunk>& wanted,
+                                                  const std::vector<chunk>& received)
                 {
-                        throw std::runtime_error("Network error");
+                        std::vector<chunk> missing;
+                        auto r = received.begin();
+                        for (chunk w : wanted)
+                        {
+                                while (r != received.end() && r->last_byte < w.first_byte)
+                                {
+                                        ++r;
+                                }
+                                for (auto it = r; it != received.end()
+                                             && it->first_byte <= w.last_byte; ++it)
+                                {
+                                        if (it->first_byte > w.first_byte)
+                                        {
+                                                missing.push_back({w.first_byte,
+                                                                   it->first_byte - 1});
+                                        }
+                                        if (it->last_byte >= w.last_byte)
+                                        {
+                                                w.first_byte = w.last_byte + 1;
+                                                break;
+                                        }
+                                        w.first_byte = it->last_byte + 1;
+                                }
+                                if (w.first_byte <= w.last_byte)
+                                {
+                                        missing.push_back(w);
+                                }
+                        }
+                        return missing;
                 }
-                if (!response)
+        }
+
+        size_t download_ranges(
+                connection_pool& pool,
+                const std::string& host, uint16_t port, const std::string& path,
+                const std::vector<chunk>& ranges, output_file& out,
+                const transfer_limits& limits)
+        {
+                // Servers limit how many ranges they'll serve from one
+                // request, and how long a header they'll read.
+                const size_t max_ranges_per_request = 64;
+                const size_t block_size = 16 * 1024;
+                std::vector<uint8_t> block(block_size);
+                std::vector<chunk> wanted = merge_ranges(ranges);
+                message::request_template requests = range_requests(host, path);
+                size_t file_size = wanted.empty() ? 0 : wanted.back().last_byte + 1;
+                bool size_known = false;
+                out.reserve(file_size);
+                size_t downloaded = 0;
+                int failures = 0;
+                while (!wanted.empty())
                 {
-                        throw std::runtime_error("Remote host " + host
-                                                 + " didn't succeed.");
+                        std::vector<chunk> batch(
+                                wanted.begin(),
+                                wanted.begin() + std::min(wanted.size(), max_ranges_per_request));
+                        std::vector<chunk> received;
+                        bool broken = false;
+                        try
+                        {
+                        range_response response = send_range_request(
+                                pool, host, port, requests.with_ranges(batch), limits);
+                        connection_pool::connection& socket = response.socket;
+                        const message::response_message& header = response.header;
+                        // Whether the whole response was read, leaving the
+                        // connection ready for the next one
+                        bool drained = true;
+                        // A chunked body is read through a stream that
+                        // decodes it and ends where the body does.
+                        std::unique_ptr<message::chunked_stream> chunked;
+                        if (response.chunks)
+                        {
+                                chunked.reset(new message::chunked_stream(*response.chunks));
+                        }
+                        std::istream& body = chunked ? *chunked
+                                : static_cast<std::istream&>(*socket);
+                        // Each part goes straight from the socket to its
+                        // place in out.
+                        auto write_part = [&](const message::content_range& range,
+                                              std::istream& is) {
+                                if (range.has_length)
+                                {
+                                        file_size = range.complete_length;
+                                        size_known = true;
+                                }
+                                out.reserve(range.last_byte + 1);
+                                for (size_t offset = range.first_byte;
+                                     offset <= range.last_byte; )
+                                {
+                                        size_t n = std::min(block_size,
+                                                            range.last_byte - offset + 1);
+                                        uint8_t* destination = out.direct(offset, n);
+                                        socket->expires_after(to_clock(limits.idle));
+                                        is.read(reinterpret_cast<char*>(
+                                                        destination ? destination
+                                                        : block.data()), n);
+                                        if (is.gcount() != std::streamsize(n))
+                                        {
+                                                // Keep what arrived of the part
+                                                if (offset > range.first_byte)
+                                                {
+                                                        received.push_back({range.first_byte,
+                                                                            offset - 1});
+                                                        downloaded += offset - range.first_byte;
+                                                }
+                                                throw lost_connection(*socket, host);
+                                        }
+                                        if (!destination)
+                                        {
+                                                out.write_at(offset, block.data(), n);
+                                        }
+                                        out.commit(offset, n);
+                                        offset += n;
+                                }
+                                received.push_back({range.first_byte, range.last_byte});
+                                downloaded += range.last_byte - range.first_byte + 1;
+                        };
+                        message::content_range range;
+                        const std::string* range_field = header.find_field(message::fields::content_range);
+                        const std::string* type_field = header.find_field(message::fields::content_type);
+                        std::string boundary;
+                        if (header.status_code() == 416)
+                        {
+                                // None of the ranges are in the file
+                                if (range_field && message::parse_content_range(*range_field, range)
+                                    && range.has_length)
+                                {
+                                        file_size = range.complete_length;
+                                        size_known = true;
+                                }
+                                if (!chunked)
+                                {
+                                        socket->ignore(body_length(header));
+                                }
+                                received = batch;
+                        }
+                        else if (header.status_code() == 206 && type_field
+                                 && message::parse_multipart_boundary(*type_field, boundary))
+                        {
+                                try
+                                {
+                                        message::read_byteranges(body, body_length(header),
+                                                                 boundary, write_part);
+                                }
+                                catch (const message::truncated_body&)
+                                {
+                                        throw lost_connection(*socket, host);
+                                }
+                        }
+                        else if (header.status_code() == 206 && range_field
+                                 && message::parse_content_range(*range_field, range)
+                                 && range.has_range
+                                 && range.last_byte - range.first_byte + 1
+                                 == body_length(header))
+                        {
+                                // A single part, which the server may have
+                                // made by merging ranges that are close together
+                                write_part(range, body);
+                        }
+                        else if (header.status_code() == 200)
+                        {
+                                // The server ignored the ranges and is sending
+                                // the whole file, which has everything wanted,
+                                // so there is nothing to ask for after it.
+                                size_t length = body_length(header);
+                                if (length == SIZE_MAX)
+                                {
+                                        throw std::runtime_error(
+                                                "The server didn't say how big the file is.");
+                                }
+                                range.has_range = true;
+                                range.first_byte = 0;
+                                range.last_byte = length - 1;
+                                range.has_length = true;
+                                range.complete_length = length;
+                                file_size = length;
+                                size_known = true;
+                                if (length > 0)
+                                {
+                                        write_part(range, body);
+                                }
+                                received = batch;
+                                wanted.resize(batch.size());
+                        }
+                        else
+                        {
+                                throw std::runtime_error("Remote host " + host
+                                                         + " didn't send the requested ranges.");
+                        }
+                        if (chunked)
+                        {
+                                drained = chunked->rdbuf()->in_avail() == 0
+                                        && response.chunks->end();
+                        }
+                        if (drained && !socket->error() && header.keep_alive())
+                        {
+                                pool.checkin(host, port, std::move(socket));
+                        }
+                        failures = 0;
+                        }
+                        catch (const connection_error&)
+                        {
+                                // Ask again for what didn't arrive, after a
+                                // pause, until the retries run out.
+                                if (++failures > limits.retries)
+                                {
+                                        throw;
+                                }
+                                back_off(limits, failures);
+                                broken = true;
+                        }
+                        std::vector<chunk> missing =
+                                missing_ranges(batch, merge_ranges(received));
+                        // A server may send fewer parts than were asked for,
+                        // e.g. if it limits the number of ranges, so the rest
+                        // are asked for again. But it has to send something.
+                        if (!broken && missing.size() == batch.size()
+                            && std::equal(missing.begin(), missing.end(), batch.begin(),
+                                          [](const chunk& a, const chunk& b) {
+                                                  return a.first_byte == b.first_byte
+                                                          && a.last_byte == b.last_byte;
+                                          }))
+                        {
+                                throw std::runtime_error("Remote host " + host
+                                                         + " didn't send the requested ranges.");
+                        }
+                        missing.insert(missing.end(), wanted.begin() + batch.size(),
+                                       wanted.end());
+                        // Nothing past the end of the file will come
+                        while (size_known && !missing.empty()
+                               && missing.back().first_byte >= file_size)
+                        {
+                                missing.pop_back();
+                        }
+                        if (size_known && !missing.empty())
+                        {
+                                missing.back().last_byte = std::min(
+                                        missing.back().last_byte, file_size - 1);
+                        }
+                        wanted = std::move(missing);
                 }
-                uint8_t* buffer_end = std::copy(response.body().cbegin(),
-                                                response.body().cend(), buffer);
-                return buffer_end - buffer;
+                out.finish(file_size);
+                return downloaded;
+        }
+
+        message::request_template range_requests(
+                const std::string& host, const std::string& path)
+        {
+                return message::request_template(
+                        message::method::GET, path,
+                        {{message::fields::host, host},
+                                {message::fields::user_agent, "chunking client"}});
+        }
+
+        size_t make_chunk_request(
+                connection_pool& pool,
+                const std::string& host, const std::string& path,
+                size_t first_byte, size_t last_byte, uint8_t* buffer,
+                uint16_t port, const transfer_limits& limits)
+        {
+                message::request_template requests = range_requests(host, path);
+                return fetch_chunk(pool, host, port, requests, first_byte, last_byte,
+                                   buffer, limits, nullptr);
         }
 }
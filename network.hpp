@@ -1,38 +1,131 @@
 #ifndef NETWORK_HPP
 #define NETWORK_HPP
 
+#include "connection_pool.hpp"
+#include "message.hpp"
+#include "output.hpp"
+#include "scheduler.hpp"
+
 #include <boost/asio.hpp>
 
+#include <chrono>
+#include <string>
+#include <vector>
+
 namespace network
 {
 
         std::pair<std::string, std::string> parse_url(const std::string& url);
 
-        // Download a file using the provided chunk size and count. If the size
-        // of the file is less than number_requests * request_size it will not
-        // be fully downloaded. The parallel download will use multiple threads
-        // to make requests and buffer all the results in memory until the
-        // entire file is downloaded. The sequential download will run
-        // everything on the main thread
+        // A server to download the file from, and why it was given up on if
+        // it was.
+        struct mirror
+        {
+                std::string host;
+                uint16_t port;
+                std::string path;
+                std::string error;
+        };
+
+        // How long a connection may keep a download waiting before it is torn
+        // down: for the first byte of a response once its request has been
+        // sent, and for each block of a body. A body that is still arriving
+        // slower than min_rate bytes per second once min_rate_window has
+        // passed is torn down too, unless min_rate is 0. (How long a
+        // connection may take to open is up to the connection_pool.)
+        struct transfer_limits
+        {
+                std::chrono::duration<double> first_byte = std::chrono::seconds(30);
+                std::chrono::duration<double> idle = std::chrono::seconds(30);
+                double min_rate = 0;
+                std::chrono::duration<double> min_rate_window = std::chrono::seconds(10);
+                // How many times in a row a connection that fails or times out
+                // is retried, and how long to wait before the first retry,
+                // doubling for each one after that
+                int retries = 5;
+                std::chrono::duration<double> backoff = std::chrono::milliseconds(100);
+        };
+
+        // Download a file in chunks. The parallel download will use up to
+        // connections threads for each mirror, each taking chunks from
+        // scheduler until there are none left and writing them to out as they
+        // arrive, and measuring its connection so an adaptive scheduler can
+        // size its chunks. Faster mirrors come back for more chunks sooner, so
+        // they end up with more of the file. A mirror that fails, stalls, or
+        // has a different size or ETag for the file is dropped, with its
+        // error recorded, and the others download its chunks instead; the
+        // download only fails if every mirror does. A connection that breaks
+        // limits partway through a response is replaced, and the rest of the
+        // range is asked for again, keeping what was already written. Each
+        // connection has up to pipeline_depth requests outstanding, falling
+        // back to one at a time for a host that can't handle that. The
+        // sequential download will run everything on the main thread using
+        // the provided chunk size, stopping at the first short chunk or after
+        // number_requests chunks if that isn't 0. Both take their connections
+        // from pool and return them when a chunk has been read, so later
+        // chunks reuse the connections opened for earlier ones.
         // Return the amount of data downloaded.
         size_t download_file_parallel(
-                const std::string& host, uint16_t port, const std::string& path,
-                int number_requests, size_t request_size,
-                std::ostream_iterator<uint8_t>& os);
+                connection_pool& pool, std::vector<mirror>& mirrors,
+                chunk_scheduler& scheduler, int connections, int pipeline_depth,
+                output_file& out, const transfer_limits& limits = transfer_limits());
 
         size_t download_file_sequential(
+                connection_pool& pool,
                 const std::string& host, uint16_t port, const std::string& path,
                 int number_requests, size_t request_size,
-                std::ostream_iterator<uint8_t>& os);
+                std::ostream_iterator<uint8_t>& os,
+                const transfer_limits& limits = transfer_limits());
 
-        using boost::asio::ip::tcp;
+        // Download just the given ranges of the file into out at their
+        // offsets, asking for many of them at once in each request. The
+        // server answers with a multipart/byteranges body, and each part is
+        // read straight into out. Ranges the server leaves out are asked for
+        // again. The output is the length of the whole file once finished,
+        // with nothing written outside the ranges. Returns the amount of data
+        // downloaded.
+        size_t download_ranges(
+                connection_pool& pool,
+                const std::string& host, uint16_t port, const std::string& path,
+                const std::vector<chunk>& ranges, output_file& out,
+                const transfer_limits& limits = transfer_limits());
 
-        // Download a chunk of the file between the given bounds.
-        // Returns the amount of data downloaded.
+        // Download a chunk of the file between the given bounds over a
+        // connection from pool. If a pooled connection turns out to have been
+        // closed by the server, the request is retried on a new connection.
+        // Returns the amount of data downloaded, which is 0 if the chunk is
+        // past the end of the file. Throws if the server breaks the time
+        // limits.
         size_t make_chunk_request(
+                connection_pool& pool,
                 const std::string& host, const std::string& path,
                 size_t first_byte, size_t last_byte, uint8_t* buffer,
-                uint16_t port = 80);
+                uint16_t port = 80,
+                const transfer_limits& limits = transfer_limits());
+
+        // The requests for ranges of path on host, which differ only in their
+        // Range fields. This is shared by the download engines.
+        message::request_template range_requests(
+                const std::string& host, const std::string& path);
+
+        // Whether a response header is for a different range than chunk c,
+        // which happens if the server mixed up pipelined requests.
+        bool out_of_order(const message::response_message& header, const chunk& c);
+
+        // Check the response header for chunk c and pass on what it says
+        // about the file: its size to scheduler and out, and the length of
+        // this part of it to scheduler. A 416 response marks the end of the
+        // file. A 200 response means the server ignored the range and is
+        // sending the whole file, which is downloaded in one piece, with c
+        // widened to all of it, if c is the only chunk being downloaded
+        // (see chunk_scheduler::whole_file). Returns the number of body
+        // bytes that belong in the file at c.first_byte. Throws if a 206
+        // response isn't for c, or a 200 response comes while other chunks
+        // are being downloaded. This is shared by the download engines.
+        size_t accept_range_response(
+                const message::response_message& header, chunk& c,
+                const chunk_scheduler::active_handle& active,
+                chunk_scheduler& scheduler, output_file& out);
 }
 
 #endif
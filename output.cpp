@@ -0,0 +1,233 @@
+#include "output.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace network
+{
+        namespace
+        {
+                std::runtime_error file_error(const std::string& what,
+                                              const std::string& path)
+                {
+                        return std::runtime_error(what + " " + path + ": "
+                                                  + std::strerror(errno));
+                }
+        }
+
+        void output_file::commit(size_t, size_t)
+        {
+        }
+
+        void output_file::set_validator(const std::string&)
+        {
+        }
+
+        void output_file::sync()
+        {
+        }
+
+        memory_output::memory_output(std::ostream_iterator<uint8_t>& os)
+                : os(os)
+        {
+        }
+
+        void memory_output::reserve(size_t length)
+        {
+                if (length > result_buf.size())
+                {
+                        result_buf.resize(length);
+                }
+        }
+
+        uint8_t* memory_output::direct(size_t offset, size_t length)
+        {
+                if (offset + length > result_buf.size())
+                {
+                        throw std::out_of_range("Chunk is past the end of the buffer");
+                }
+                return result_buf.data() + offset;
+        }
+
+        void memory_output::write_at(size_t offset, const uint8_t* data,
+                                     size_t length)
+        {
+                std::copy(data, data + length, direct(offset, length));
+        }
+
+        void memory_output::finish(size_t length)
+        {
+                // Shrink buffer to fit
+                result_buf.resize(length);
+                std::copy(result_buf.cbegin(), result_buf.cend(), os);
+        }
+
+        pwrite_output::pwrite_output(const std::string& path, bool truncate)
+                : path(path),
+                  fd(::open(path.c_str(),
+                            O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0666))
+        {
+                if (fd < 0)
+                {
+                        throw file_error("Unable to open", path);
+                }
+        }
+
+        pwrite_output::~pwrite_output()
+        {
+                ::close(fd);
+        }
+
+        void pwrite_output::reserve(size_t)
+        {
+        }
+
+        uint8_t* pwrite_output::direct(size_t, size_t)
+        {
+                return nullptr;
+        }
+
+        void pwrite_output::write_at(size_t offset, const uint8_t* data,
+                                     size_t length)
+        {
+                while (length > 0)
+                {
+                        ssize_t written = ::pwrite(fd, data, length, offset);
+                        if (written < 0)
+                        {
+                                if (errno == EINTR)
+                                {
+                                        continue;
+                                }
+                                throw file_error("Unable to write to", path);
+                        }
+                        data += written;
+                        offset += written;
+                        length -= written;
+                }
+        }
+
+        void pwrite_output::sync()
+        {
+                if (::fdatasync(fd) != 0)
+                {
+                        throw file_error("Unable to write to", path);
+                }
+        }
+
+        void pwrite_output::finish(size_t length)
+        {
+                if (::ftruncate(fd, length) != 0)
+                {
+                        throw file_error("Unable to set the length of", path);
+                }
+        }
+
+        mmap_output::mmap_output(const std::string& path, bool truncate)
+                : path(path),
+                  fd(::open(path.c_str(),
+                            O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0666)),
+                  mapping(nullptr), capacity(0)
+        {
+                if (fd < 0)
+                {
+                        throw file_error("Unable to open", path);
+                }
+        }
+
+        mmap_output::~mmap_output()
+        {
+                if (mapping)
+                {
+                        ::munmap(mapping, capacity);
+                }
+                ::close(fd);
+        }
+
+        void mmap_output::unmap()
+        {
+                if (mapping)
+                {
+                        if (::msync(mapping, capacity, MS_SYNC) != 0)
+                        {
+                                throw file_error("Unable to write to", path);
+                        }
+                        ::munmap(mapping, capacity);
+                        mapping = nullptr;
+                        capacity = 0;
+                }
+        }
+
+        void mmap_output::reserve(size_t length)
+        {
+                if (length <= capacity)
+                {
+                        return;
+                }
+                unmap();
+                // A resumed download's file may already be longer, with
+                // data that was written and journaled before.
+                struct stat st;
+                if (::fstat(fd, &st) != 0)
+                {
+                        throw file_error("Unable to read the length of", path);
+                }
+                if (static_cast<size_t>(st.st_size) < length
+                    && ::ftruncate(fd, length) != 0)
+                {
+                        throw file_error("Unable to set the length of", path);
+                }
+                void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED)
+                {
+                        throw file_error("Unable to map", path);
+                }
+                mapping = static_cast<uint8_t*>(p);
+                capacity = length;
+                // Each chunk fills its pages front to back, and they're never
+                // read again, so the kernel can fault pages in ahead of the
+                // writers and drop them soon after.
+                ::madvise(mapping, capacity, MADV_SEQUENTIAL);
+        }
+
+        uint8_t* mmap_output::direct(size_t offset, size_t length)
+        {
+                if (offset + length > capacity)
+                {
+                        throw std::out_of_range("Chunk is past the end of the file");
+                }
+                return mapping + offset;
+        }
+
+        void mmap_output::write_at(size_t offset, const uint8_t* data,
+                                   size_t length)
+        {
+                std::copy(data, data + length, direct(offset, length));
+        }
+
+        void mmap_output::sync()
+        {
+                if (mapping && ::msync(mapping, capacity, MS_SYNC) != 0)
+                {
+                        throw file_error("Unable to write to", path);
+                }
+        }
+
+        void mmap_output::finish(size_t length)
+        {
+                unmap();
+                if (::ftruncate(fd, length) != 0)
+                {
+                        throw file_error("Unable to set the length of", path);
+                }
+        }
+}
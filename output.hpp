@@ -0,0 +1,118 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace network
+{
+        // An output_file is where a parallel download puts the chunks it
+        // receives. Workers write disjoint ranges concurrently, in whatever
+        // order the chunks arrive.
+        class output_file
+        {
+        public:
+                virtual ~output_file() = default;
+
+                // Make room for the first length bytes of the file. This is
+                // only called while no other writes are in progress, since it
+                // may move the storage that direct points into. A file is
+                // never made shorter, since a resumed download's file may
+                // already hold data past length.
+                virtual void reserve(size_t length) = 0;
+
+                // If the range can be written in place, return a pointer to
+                // where its first byte goes so the body can be read straight
+                // into it. Otherwise return nullptr, and the range has to be
+                // passed to write_at instead.
+                virtual uint8_t* direct(size_t offset, size_t length) = 0;
+
+                // Write length bytes of data at offset.
+                virtual void write_at(size_t offset, const uint8_t* data,
+                                      size_t length) = 0;
+
+                // Called once the length bytes at offset are in place, whether
+                // they were passed to write_at or read into direct memory.
+                virtual void commit(size_t offset, size_t length);
+
+                // Called with the ETag or Last-Modified value of the file the
+                // responses come from, for outputs that keep track of which
+                // version of the file they hold.
+                virtual void set_validator(const std::string& validator);
+
+                // Make sure everything committed so far would survive a
+                // crash.
+                virtual void sync();
+
+                // Called once the download is complete, with the final size of
+                // the file.
+                virtual void finish(size_t length) = 0;
+        };
+
+        // Buffer the whole file in memory and write it out in one go once it
+        // has been downloaded completely.
+        class memory_output : public output_file
+        {
+                std::vector<uint8_t> result_buf;
+                std::ostream_iterator<uint8_t>& os;
+        public:
+                explicit memory_output(std::ostream_iterator<uint8_t>& os);
+                void reserve(size_t length) override;
+                uint8_t* direct(size_t offset, size_t length) override;
+                void write_at(size_t offset, const uint8_t* data,
+                              size_t length) override;
+                void finish(size_t length) override;
+        };
+
+        // Write each range to its offset in the file as soon as it arrives, so
+        // the download never holds more than the blocks being read in memory.
+        // The file grows as ranges are written, so reserve leaves it alone.
+        class pwrite_output : public output_file
+        {
+                std::string path;
+                int fd;
+        public:
+                // Unless truncate is false, anything already in the file is
+                // thrown away.
+                explicit pwrite_output(const std::string& path, bool truncate = true);
+                ~pwrite_output();
+                pwrite_output(const pwrite_output&) = delete;
+                pwrite_output& operator=(const pwrite_output&) = delete;
+                void reserve(size_t length) override;
+                uint8_t* direct(size_t offset, size_t length) override;
+                void write_at(size_t offset, const uint8_t* data,
+                              size_t length) override;
+                void sync() override;
+                void finish(size_t length) override;
+        };
+
+        // Map the file into memory and have the workers read each chunk's
+        // body from the socket straight into its place in the mapping. The
+        // file is sized as soon as the download knows how big it is, and cut
+        // down to the downloaded length at the end.
+        class mmap_output : public output_file
+        {
+                std::string path;
+                int fd;
+                uint8_t* mapping;
+                size_t capacity;
+
+                void unmap();
+        public:
+                explicit mmap_output(const std::string& path, bool truncate = true);
+                ~mmap_output();
+                mmap_output(const mmap_output&) = delete;
+                mmap_output& operator=(const mmap_output&) = delete;
+                void reserve(size_t length) override;
+                uint8_t* direct(size_t offset, size_t length) override;
+                void write_at(size_t offset, const uint8_t* data,
+                              size_t length) override;
+                void sync() override;
+                void finish(size_t length) override;
+        };
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include "resolver_cache.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+namespace network
+{
+        namespace
+        {
+                std::vector<tcp::endpoint> system_lookup(const std::string& host,
+                                                         uint16_t port)
+                {
+                        boost::asio::io_context io;
+                        tcp::resolver resolver(io);
+                        boost::system::error_code error;
+                        auto results = resolver.resolve(host, std::to_string(port), error);
+                        if (error)
+                        {
+                                throw std::runtime_error("Unable to resolve " + host);
+                        }
+                        std::vector<tcp::endpoint> endpoints;
+                        for (const auto& result : results)
+                        {
+                                endpoints.push_back(result.endpoint());
+                        }
+                        return endpoints;
+                }
+        }
+
+        resolver_cache::resolver_cache(clock::duration ttl)
+                : resolver_cache(ttl, system_lookup)
+        {
+        }
+
+        resolver_cache::resolver_cache(clock::duration ttl, lookup_function lookup)
+                : ttl(ttl), lookup(std::move(lookup))
+        {
+        }
+
+        std::shared_future<std::vector<tcp::endpoint>>
+        resolver_cache::find(const std::string& host, uint16_t port, size_t* turn)
+        {
+                std::shared_ptr<std::promise<std::vector<tcp::endpoint>>> pending;
+                std::shared_future<std::vector<tcp::endpoint>> endpoints;
+                size_t lookup_id = 0;
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        entry& e = entries[key(host, port)];
+                        clock::time_point now = clock::now();
+                        if (!e.endpoints.valid() || now >= e.expires)
+                        {
+                                pending = std::make_shared<
+                                        std::promise<std::vector<tcp::endpoint>>>();
+                                e.endpoints = pending->get_future().share();
+                                e.expires = now + ttl;
+                                e.lookup_id = lookup_id = ++lookup_count;
+                        }
+                        if (turn)
+                        {
+                                *turn = e.next++;
+                        }
+                        endpoints = e.endpoints;
+                }
+                // The lookup is made without holding the lock, so lookups of
+                // other hosts aren't held up behind it.
+                if (pending)
+                {
+                        try
+                        {
+                                std::vector<tcp::endpoint> found = lookup(host, port);
+                                if (found.empty())
+                                {
+                                        throw std::runtime_error("Unable to resolve " + host);
+                                }
+                                pending->set_value(std::move(found));
+                        }
+                        catch (...)
+                        {
+                                pending->set_exception(std::current_exception());
+                                // Let the next caller try again
+                                std::lock_guard<std::mutex> guard(lock);
+                                auto it = entries.find(key(host, port));
+                                if (it != entries.end() && it->second.lookup_id == lookup_id)
+                                {
+                                        entries.erase(it);
+                                }
+                        }
+                }
+                return endpoints;
+        }
+
+        std::vector<tcp::endpoint> resolver_cache::resolve(const std::string& host,
+                                                           uint16_t port)
+        {
+                return find(host, port, nullptr).get();
+        }
+
+        std::vector<tcp::endpoint> resolver_cache::rotate(const std::string& host,
+                                                          uint16_t port)
+        {
+                size_t turn = 0;
+                std::vector<tcp::endpoint> endpoints = find(host, port, &turn).get();
+                std::rotate(endpoints.begin(),
+                            endpoints.begin() + turn % endpoints.size(),
+                            endpoints.end());
+                return endpoints;
+        }
+
+        size_t resolver_cache::lookups() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return lookup_count;
+        }
+}
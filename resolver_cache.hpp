@@ -0,0 +1,74 @@
+#ifndef RESOLVER_CACHE_HPP
+#define RESOLVER_CACHE_HPP
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace network
+{
+        using boost::asio::ip::tcp;
+
+        // A resolver_cache looks up the addresses of each host once and
+        // shares them between every connection to it, instead of each
+        // connection making its own DNS query. Workers that ask for a host
+        // while its lookup is in progress wait for that lookup rather than
+        // starting another. The addresses are kept for ttl, and a failed
+        // lookup isn't kept at all.
+        class resolver_cache
+        {
+        public:
+                using clock = std::chrono::steady_clock;
+                using lookup_function = std::function<
+                        std::vector<tcp::endpoint>(const std::string&, uint16_t)>;
+
+                // Look hosts up with the system resolver.
+                explicit resolver_cache(clock::duration ttl = std::chrono::seconds(60));
+                // Look hosts up with lookup, which throws if it can't.
+                resolver_cache(clock::duration ttl, lookup_function lookup);
+
+                // Every address of host:port. Throws if the lookup fails or
+                // finds nothing.
+                std::vector<tcp::endpoint> resolve(const std::string& host,
+                                                   uint16_t port);
+
+                // The addresses of host:port, rotated one further on each
+                // call, so connections that try them in order are spread
+                // across all of them.
+                std::vector<tcp::endpoint> rotate(const std::string& host,
+                                                  uint16_t port);
+
+                // Number of lookups made.
+                size_t lookups() const;
+
+        private:
+                using key = std::pair<std::string, uint16_t>;
+
+                struct entry
+                {
+                        std::shared_future<std::vector<tcp::endpoint>> endpoints;
+                        clock::time_point expires;
+                        // Which lookup the endpoints came from
+                        size_t lookup_id = 0;
+                        size_t next = 0;
+                };
+
+                std::shared_future<std::vector<tcp::endpoint>> find(
+                        const std::string& host, uint16_t port, size_t* turn);
+
+                clock::duration ttl;
+                lookup_function lookup;
+                mutable std::mutex lock;
+                std::map<key, entry> entries;
+                size_t lookup_count = 0;
+        };
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include "scan.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+        struct kernel
+        {
+                scan::masks (*classify)(const char*, const char*);
+                const char* name;
+        };
+
+        scan::masks classify_scalar(const char* begin, const char* end)
+        {
+                scan::masks found{0, 0};
+                int size = std::min<std::ptrdiff_t>(end - begin, scan::block_size);
+                for (int i = 0; i < size; ++i)
+                {
+                        found.newlines |= uint64_t(begin[i] == '\n') << i;
+                        found.colons |= uint64_t(begin[i] == ':') << i;
+                }
+                return found;
+        }
+
+        const kernel scalar_kernel{classify_scalar, "scalar"};
+
+#ifdef SCAN_X86
+        // The vector kernels compare a register's worth of bytes at once and
+        // turn each result into a bit mask, one bit per byte. A block that's
+        // cut short is copied into one padded with zeros first, so that
+        // nothing is read past the end.
+
+        const char* whole_block(const char* begin, const char* end,
+                                char (&padded)[scan::block_size])
+        {
+                if (end - begin >= scan::block_size)
+                {
+                        return begin;
+                }
+                std::memset(padded, 0, sizeof(padded));
+                std::memcpy(padded, begin, end - begin);
+                return padded;
+        }
+
+        __attribute__((target("sse2")))
+        scan::masks classify_sse2(const char* begin, const char* end)
+        {
+                char padded[scan::block_size];
+                const char* block = whole_block(begin, end, padded);
+                const __m128i newline = _mm_set1_epi8('\n');
+                const __m128i colon = _mm_set1_epi8(':');
+                scan::masks found{0, 0};
+                for (int i = 0; i < scan::block_size; i += 16)
+                {
+                        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+                        found.newlines |= uint64_t(unsigned(
+                                _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)))) << i;
+                        found.colons |= uint64_t(unsigned(
+                                _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, colon)))) << i;
+                }
+                return found;
+        }
+
+        __attribute__((target("avx2")))
+        scan::masks classify_avx2(const char* begin, const char* end)
+        {
+                char padded[scan::block_size];
+                const char* block = whole_block(begin, end, padded);
+                const __m256i newline = _mm256_set1_epi8('\n');
+                const __m256i colon = _mm256_set1_epi8(':');
+                __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+                __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+                uint64_t newlines_low = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)));
+                uint64_t newlines_high = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)));
+                uint64_t colons_low = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, colon)));
+                uint64_t colons_high = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, colon)));
+                return {newlines_low | newlines_high << 32, colons_low | colons_high << 32};
+        }
+
+        const kernel sse2_kernel{classify_sse2, "sse2"};
+        const kernel avx2_kernel{classify_avx2, "avx2"};
+#endif
+
+        const kernel* kernel_for(scan::level l)
+        {
+                switch (l)
+                {
+                case scan::level::scalar:
+                        return &scalar_kernel;
+#ifdef SCAN_X86
+                case scan::level::sse2:
+                        return __builtin_cpu_supports("sse2") ? &sse2_kernel : nullptr;
+                case scan::level::avx2:
+                        return __builtin_cpu_supports("avx2") ? &avx2_kernel : nullptr;
+#endif
+                default:
+                        return nullptr;
+                }
+        }
+
+        std::atomic<const kernel*>& active()
+        {
+                static std::atomic<const kernel*> best = []() {
+                        if (auto k = kernel_for(scan::level::avx2))
+                        {
+                                return k;
+                        }
+                        if (auto k = kernel_for(scan::level::sse2))
+                        {
+                                return k;
+                        }
+                        return &scalar_kernel;
+                }();
+                return best;
+        }
+}
+
+namespace scan
+{
+        masks classify(const char* begin, const char* end)
+        {
+                return active().load(std::memory_order_relaxed)->classify(begin, end);
+        }
+
+        bool use(level l)
+        {
+                auto k = kernel_for(l);
+                if (k)
+                {
+                        active().store(k, std::memory_order_relaxed);
+                }
+                return k != nullptr;
+        }
+
+        const char* implementation()
+        {
+                return active().load(std::memory_order_relaxed)->name;
+        }
+}
@@ -0,0 +1,40 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <cstdint>
+
+// Finds the characters that split up an HTTP header a whole SSE2 or AVX2
+// register at a time, where the CPU has them, rather than a byte at a time.
+// The widest kernels the CPU can run are picked the first time they're
+// needed.
+namespace scan
+{
+        // One bit for each byte of a block, the lowest for the first byte
+        struct masks
+        {
+                uint64_t newlines;
+                uint64_t colons;
+        };
+
+        static const int block_size = 64;
+
+        // Which of the first block_size bytes of [begin, end), or all of them
+        // if there are fewer, are '\n' and ':'.
+        masks classify(const char* begin, const char* end);
+
+        enum class level
+        {
+                scalar,
+                sse2,
+                avx2,
+        };
+
+        // Switch classify to the kernel for l, e.g. to compare them. Returns
+        // false, changing nothing, if this CPU can't run it.
+        bool use(level l);
+
+        // The name of the kernel in use.
+        const char* implementation();
+}
+
+#endif
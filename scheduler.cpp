@@ -0,0 +1,601 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace network
+{
+        size_t chunk::size() const
+        {
+                return last_byte - first_byte + 1;
+        }
+
+        active_chunk::active_chunk(const chunk& c)
+                : first_byte(c.first_byte), last_byte(c.last_byte),
+                  started(std::chrono::steady_clock::now())
+        {
+        }
+
+        chunk_scheduler::chunk_scheduler(size_t request_size, size_t max_length,
+                                         size_t min_split)
+                : request_size(std::max<size_t>(request_size, 1)),
+                  max_length(max_length), end(max_length),
+                  min_split(std::max<size_t>(min_split, 1))
+        {
+                // The first chunk finds out how big the file is
+                queue_chunk(this->request_size, end);
+        }
+
+        bool chunk_scheduler::next(chunk& c, active_handle& handle,
+                                   const connection_rate* rate)
+        {
+                std::unique_lock<std::mutex> guard(lock);
+                outcome result;
+                while ((result = take(c, handle, rate)) == outcome::wait)
+                {
+                        changed.wait(guard);
+                }
+                return result == outcome::ready;
+        }
+
+        bool chunk_scheduler::try_next(chunk& c, active_handle& handle, bool& wait,
+                                       const connection_rate* rate)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                outcome result = take(c, handle, rate);
+                wait = result == outcome::wait;
+                return result == outcome::ready;
+        }
+
+        chunk_scheduler::outcome chunk_scheduler::take(chunk& c, active_handle& handle,
+                                                       const connection_rate* rate)
+        {
+                if (cancelled)
+                {
+                        return outcome::done;
+                }
+                if (pending.empty() && state != phase::planned && !active.empty())
+                {
+                        return outcome::wait;
+                }
+                if (pending.empty() && state != phase::probing && planned_end < end)
+                {
+                        queue_chunk(chunk_size_for(rate), end);
+                }
+                active_handle victim;
+                if (!pending.empty())
+                {
+                        c = pending.front();
+                        pending.pop_front();
+                }
+                else if (!steal(c) && !(victim = hedge_victim(rate, c)))
+                {
+                        return outcome::done;
+                }
+                handle = std::make_shared<active_chunk>(c);
+                if (victim)
+                {
+                        handle->hedge = true;
+                        handle->partner = victim;
+                        victim->partner = handle;
+                        hedged_bytes += c.size();
+                        ++hedge_count;
+                }
+                active.push_back(handle);
+                return outcome::ready;
+        }
+
+        size_t chunk_scheduler::chunk_size_for(const connection_rate* rate) const
+        {
+                if (!adaptive)
+                {
+                        return request_size;
+                }
+                size_t remaining = end - planned_end;
+                double size = request_size;
+                if (rate && rate->bytes_per_second > 0)
+                {
+                        // Nothing arrives for a round trip after a request is
+                        // sent, so keep that to a tenth of the time spent on
+                        // the body.
+                        size = rate->bytes_per_second * rate->round_trip * 10;
+                        if (size_known)
+                        {
+                                // Take no more than this connection's share of
+                                // the rest of the file, so it doesn't finish
+                                // long after the others. Connections that
+                                // haven't been measured yet are counted as
+                                // average.
+                                double measured_rate = 0;
+                                size_t measured = 0;
+                                for (const connection_rate& r : rates)
+                                {
+                                        if (r.bytes_per_second > 0)
+                                        {
+                                                measured_rate += r.bytes_per_second;
+                                                ++measured;
+                                        }
+                                }
+                                double total_rate = measured_rate / measured * rates.size();
+                                size = std::min(size, remaining * rate->bytes_per_second
+                                                / total_rate);
+                        }
+                }
+                size_t bounded = size >= max_size ? max_size
+                        : std::max(min_size, size_t(size));
+                // A piece too small for a chunk of its own goes with this one
+                if (remaining - std::min(remaining, bounded) < min_size)
+                {
+                        return remaining;
+                }
+                return bounded;
+        }
+
+        // Queue up to size bytes from planned_end, stopping at queue_end or
+        // the next range that is skipped.
+        void chunk_scheduler::queue_chunk(size_t size, size_t queue_end)
+        {
+                auto next_skipped = std::upper_bound(
+                        skipped.begin(), skipped.end(), planned_end,
+                        [](size_t offset, const chunk& c) { return offset < c.first_byte; });
+                // Step over a skipped range that planned_end is in
+                if (next_skipped != skipped.begin()
+                    && std::prev(next_skipped)->last_byte >= planned_end)
+                {
+                        planned_end = std::min(std::prev(next_skipped)->last_byte + 1,
+                                               queue_end);
+                }
+                if (planned_end >= queue_end)
+                {
+                        return;
+                }
+                size_t stop = size >= queue_end - planned_end ? queue_end
+                        : planned_end + size;
+                if (next_skipped != skipped.end())
+                {
+                        stop = std::min(stop, next_skipped->first_byte);
+                }
+                pending.push_back({planned_end, stop - 1});
+                planned_end = stop;
+        }
+
+        void chunk_scheduler::queue_chunks(size_t queue_end)
+        {
+                while (planned_end < queue_end)
+                {
+                        queue_chunk(request_size, queue_end);
+                }
+        }
+
+        // Drop everything at or after new_end from the plan.
+        void chunk_scheduler::limit_to(size_t new_end)
+        {
+                end = std::min(end, new_end);
+                planned_end = std::min(planned_end, end);
+                while (!pending.empty() && pending.back().first_byte >= end)
+                {
+                        pending.pop_back();
+                }
+                if (!pending.empty())
+                {
+                        pending.back().last_byte = std::min(pending.back().last_byte, end - 1);
+                }
+                for (const active_handle& a : active)
+                {
+                        if (a->first_byte >= end)
+                        {
+                                a->claimed = a->last_byte - a->first_byte + 1;
+                        }
+                        else
+                        {
+                                a->last_byte = std::min(a->last_byte, end - 1);
+                        }
+                }
+        }
+
+        // Split the active chunk with the most unclaimed bytes, leaving the
+        // first half to its current worker and putting the second half in c.
+        bool chunk_scheduler::steal(chunk& c)
+        {
+                active_handle victim;
+                size_t victim_remaining = 0;
+                for (const active_handle& a : active)
+                {
+                        size_t next_byte = a->first_byte + a->claimed;
+                        if (single_stream || !a->length_known || next_byte > a->last_byte
+                            || !a->partner.expired() || a->lost_race)
+                        {
+                                continue;
+                        }
+                        size_t remaining = a->last_byte - next_byte + 1;
+                        if (remaining > victim_remaining)
+                        {
+                                victim = a;
+                                victim_remaining = remaining;
+                        }
+                }
+                if (!victim || victim_remaining < 2 * min_split)
+                {
+                        return false;
+                }
+                size_t split = victim->first_byte + victim->claimed
+                        + victim_remaining / 2;
+                c = {split, victim->last_byte};
+                victim->last_byte = split - 1;
+                ++steal_count;
+                return true;
+        }
+
+        // Find the range that will take the longest to finish, going by how
+        // fast it has been arriving, and put its unclaimed tail in c if
+        // hedging it is allowed and this worker would probably finish it
+        // first.
+        chunk_scheduler::active_handle chunk_scheduler::hedge_victim(
+                const connection_rate* rate, chunk& c) const
+        {
+                if (hedge_percent <= 0 || single_stream)
+                {
+                        return nullptr;
+                }
+                auto now = std::chrono::steady_clock::now();
+                active_handle victim;
+                double victim_left = 0;
+                for (const active_handle& a : active)
+                {
+                        size_t next_byte = a->first_byte + a->claimed;
+                        if (!a->length_known || next_byte > a->last_byte || a->hedge
+                            || !a->partner.expired() || a->lost_race)
+                        {
+                                continue;
+                        }
+                        double elapsed = std::chrono::duration<double>(
+                                now - a->started).count();
+                        // A range whose body hasn't started arriving is only
+                        // behind once it has been waiting a while.
+                        if (a->claimed == 0 && elapsed < 1)
+                        {
+                                continue;
+                        }
+                        double left = a->claimed == 0 ? HUGE_VAL
+                                : (a->last_byte - next_byte + 1) * elapsed / a->claimed;
+                        if (!victim || left > victim_left)
+                        {
+                                victim = a;
+                                victim_left = left;
+                        }
+                }
+                if (!victim)
+                {
+                        return nullptr;
+                }
+                chunk tail{victim->first_byte + victim->claimed, victim->last_byte};
+                if (hedged_bytes + tail.size() > end * hedge_percent / 100)
+                {
+                        return nullptr;
+                }
+                if (rate && rate->bytes_per_second > 0
+                    && rate->round_trip + tail.size() / rate->bytes_per_second
+                       >= victim_left)
+                {
+                        return nullptr;
+                }
+                c = tail;
+                return victim;
+        }
+
+        // The winner of a hedge got to the end of its range, so the loser can
+        // stop, and anything it claimed past the start of the hedge was read
+        // for nothing. A victim that lost may not have got as far as the
+        // start of the hedge, so it still owns the part before it, which is
+        // requeued if its connection is closed before it gets there. The
+        // connection is closed rather than left to notice at its next claim,
+        // since it may be stalled waiting for data.
+        void chunk_scheduler::end_race(const active_handle& winner,
+                                       const active_handle& loser)
+        {
+                size_t hedge_start = (winner->hedge ? winner : loser)->first_byte;
+                size_t loser_end = loser->first_byte + loser->claimed;
+                if (loser_end > hedge_start)
+                {
+                        wasted_bytes += loser_end - hedge_start;
+                }
+                if (winner->hedge)
+                {
+                        loser->last_byte = hedge_start - 1;
+                }
+                else
+                {
+                        loser->lost_race = true;
+                }
+                loser->partner.reset();
+                winner->partner.reset();
+                if (loser->stop)
+                {
+                        std::function<void()> stop = std::move(loser->stop);
+                        loser->stop = nullptr;
+                        loser->stopped = true;
+                        stop();
+                }
+        }
+
+        void chunk_scheduler::on_stop(const active_handle& handle,
+                                      std::function<void()> stop)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                handle->stop = std::move(stop);
+        }
+
+        bool chunk_scheduler::stopped(const active_handle& handle) const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return handle->stopped;
+        }
+
+        size_t chunk_scheduler::claim(const active_handle& handle, size_t n)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                size_t next_byte = handle->first_byte + handle->claimed;
+                if (cancelled || handle->lost_race || next_byte > handle->last_byte)
+                {
+                        return 0;
+                }
+                n = std::min(n, handle->last_byte - next_byte + 1);
+                handle->claimed += n;
+                return n;
+        }
+
+        void chunk_scheduler::set_length(const active_handle& handle, size_t length)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                handle->length_known = true;
+                // A short response means the file ends there
+                if (length < handle->last_byte - handle->first_byte + 1)
+                {
+                        limit_to(handle->first_byte + length);
+                        changed.notify_all();
+                }
+        }
+
+        void chunk_scheduler::set_file_size(size_t size)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (size_known)
+                {
+                        if (size != file_size)
+                        {
+                                throw std::runtime_error(
+                                        "The file changed size during the download");
+                        }
+                        return;
+                }
+                size_known = true;
+                file_size = size;
+                limit_to(size);
+                if (!adaptive)
+                {
+                        queue_chunks(end);
+                }
+                state = phase::planned;
+                changed.notify_all();
+        }
+
+        void chunk_scheduler::set_etag(const std::string& value)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (etag.empty())
+                {
+                        etag = value;
+                }
+                else if (value != etag)
+                {
+                        throw std::runtime_error(
+                                "The file has a different ETag than before");
+                }
+        }
+
+        void chunk_scheduler::end_of_file(size_t offset)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                limit_to(offset);
+                changed.notify_all();
+        }
+
+        bool chunk_scheduler::whole_file(const active_handle& handle, chunk& c,
+                                         size_t size)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (cancelled || handle->lost_race)
+                {
+                        return false;
+                }
+                if (!single_stream)
+                {
+                        if (size_known && size != file_size)
+                        {
+                                throw std::runtime_error(
+                                        "The file changed size during the download");
+                        }
+                        // Other workers may be writing their ranges into
+                        // the output, which has to be free to grow for
+                        // the whole file
+                        if (active.size() != 1 || active.front() != handle)
+                        {
+                                throw std::runtime_error(
+                                        "The server ignored the range while others were being downloaded");
+                        }
+                        single_stream = true;
+                        size_known = true;
+                        file_size = size;
+                        end = std::min(end, size);
+                        planned_end = end;
+                        state = phase::planned;
+                        pending.clear();
+                        skipped.clear();
+                        handle->partner.reset();
+                        handle->first_byte = 0;
+                        handle->last_byte = end - 1;
+                        handle->claimed = 0;
+                        handle->hedge = false;
+                        changed.notify_all();
+                }
+                else if (handle->first_byte != 0)
+                {
+                        return false;
+                }
+                handle->length_known = true;
+                c = {handle->first_byte, handle->last_byte};
+                return true;
+        }
+
+        void chunk_scheduler::adapt(size_t min_size, size_t max_size)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                adaptive = true;
+                this->min_size = std::max<size_t>(min_size, 1);
+                this->max_size = std::max(this->min_size, max_size);
+        }
+
+        void chunk_scheduler::hedge(double percent)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                hedge_percent = percent;
+        }
+
+        void chunk_scheduler::skip(const std::vector<chunk>& ranges)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                skipped = ranges;
+                std::sort(skipped.begin(), skipped.end(),
+                          [](const chunk& a, const chunk& b) {
+                                  return a.first_byte < b.first_byte;
+                          });
+                std::vector<chunk> merged;
+                for (const chunk& c : skipped)
+                {
+                        if (!merged.empty() && c.first_byte <= merged.back().last_byte + 1)
+                        {
+                                merged.back().last_byte = std::max(merged.back().last_byte,
+                                                                   c.last_byte);
+                        }
+                        else
+                        {
+                                merged.push_back(c);
+                        }
+                }
+                skipped = std::move(merged);
+                // Probe with the first range that is still needed instead
+                pending.clear();
+                planned_end = 0;
+                queue_chunk(request_size, end);
+        }
+
+        connection_rate& chunk_scheduler::add_connection()
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                rates.emplace_back();
+                return rates.back();
+        }
+
+        void chunk_scheduler::measure(connection_rate& rate, size_t bytes,
+                                      std::chrono::duration<double> round_trip,
+                                      std::chrono::duration<double> transfer)
+        {
+                // Each response counts for half, so the rate follows a
+                // connection that speeds up or slows down within a few chunks.
+                auto average = [](double& value, double sample) {
+                        value = value == 0 ? sample : (value + sample) / 2;
+                };
+                std::lock_guard<std::mutex> guard(lock);
+                average(rate.round_trip, round_trip.count());
+                if (bytes > 0 && transfer.count() > 0)
+                {
+                        average(rate.bytes_per_second, bytes / transfer.count());
+                }
+        }
+
+        bool chunk_scheduler::file_size_known() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return size_known;
+        }
+
+        size_t chunk_scheduler::planned_length(size_t size) const
+        {
+                return std::min(size, max_length);
+        }
+
+        void chunk_scheduler::finish(const active_handle& handle)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                active.remove(handle);
+                handle->stop = nullptr;
+                if (active_handle partner = handle->partner.lock())
+                {
+                        end_race(handle, partner);
+                }
+                // The first response didn't say how big the file is
+                if (state == phase::probing)
+                {
+                        state = phase::serial;
+                }
+                changed.notify_all();
+        }
+
+        void chunk_scheduler::requeue(const active_handle& handle, size_t received)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                active.remove(handle);
+                handle->stop = nullptr;
+                size_t next_byte = handle->first_byte
+                        + (single_stream ? 0 : received);
+                // Everything from the start of a hedge on is left to the
+                // side that is still going.
+                size_t end_byte = handle->lost_race ? next_byte
+                        : handle->last_byte + 1;
+                if (active_handle partner = handle->partner.lock())
+                {
+                        end_byte = handle->hedge ? next_byte
+                                : std::min(end_byte, partner->first_byte);
+                        partner->partner.reset();
+                }
+                if (!cancelled && next_byte < end_byte)
+                {
+                        pending.push_front({next_byte, end_byte - 1});
+                }
+                changed.notify_all();
+        }
+
+        void chunk_scheduler::cancel()
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                cancelled = true;
+                pending.clear();
+                active.clear();
+                changed.notify_all();
+        }
+
+        size_t chunk_scheduler::length() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return end;
+        }
+
+        size_t chunk_scheduler::steals() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return steal_count;
+        }
+
+        size_t chunk_scheduler::hedges() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return hedge_count;
+        }
+
+        size_t chunk_scheduler::wasted() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return wasted_bytes;
+        }
+}
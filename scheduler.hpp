@@ -0,0 +1,306 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace network
+{
+        // A chunk is an inclusive range of bytes of the file.
+        struct chunk
+        {
+                size_t first_byte;
+                size_t last_byte;
+                size_t size() const;
+        };
+
+        // How fast a connection has been downloading: the rate at which the
+        // bodies of its responses arrived, and the time from sending a request
+        // to having the response header. Both are moving averages that are
+        // 0 until the first response has been measured, and are only touched
+        // through the scheduler that owns them.
+        struct connection_rate
+        {
+                double bytes_per_second = 0;
+                double round_trip = 0;
+        };
+
+        // An active_chunk is a chunk that a worker is downloading. claimed is
+        // the number of bytes from first_byte that the worker has committed
+        // to reading. Once the length of the response is known, another
+        // worker may steal the unclaimed tail, which lowers last_byte, or
+        // race it for the tail with a hedge, so the fields must only be
+        // touched through the scheduler.
+        struct active_chunk
+        {
+                // Start downloading c now, with nothing claimed yet.
+                explicit active_chunk(const chunk& c);
+
+                size_t first_byte;
+                size_t claimed = 0;
+                size_t last_byte;
+                bool length_known = false;
+                std::chrono::steady_clock::time_point started;
+                // The other side of a hedge: the duplicate request for the
+                // tail of this chunk, or the chunk this one duplicates.
+                std::weak_ptr<active_chunk> partner;
+                bool hedge = false;
+                // This is a hedge whose victim got to the end first, so it
+                // is no longer needed. A victim that loses just ends where
+                // the hedge started.
+                bool lost_race = false;
+                // Closes the connection the chunk is being read from (see
+                // chunk_scheduler::on_stop), and whether that was done
+                // because it lost a race.
+                std::function<void()> stop;
+                bool stopped = false;
+        };
+
+        // The chunk_scheduler decides which ranges of the file the workers
+        // download. Any number of workers can take ranges from it
+        // concurrently, so the number of chunks a file is split into is
+        // independent of the number of connections fetching them.
+        //
+        // The size of the file isn't known up front. Only the first chunk is
+        // handed out at first, and the other workers wait until its response
+        // reports the size of the file (see set_file_size), at which point
+        // exactly the chunks needed to cover it are queued. If the response
+        // doesn't say, chunks are handed out one at a time until one of them
+        // runs into the end of the file.
+        //
+        // In adaptive mode (see adapt), chunks aren't planned up front. Each
+        // one is cut from the rest of the file when a worker asks for it, and
+        // sized from how fast that worker's connection has been.
+        //
+        // Once every chunk has been handed out, an idle worker takes over the
+        // second half of the largest range that is still being downloaded, so
+        // a chunk that landed on a slow connection doesn't hold up the end of
+        // the download. With hedging on (see hedge), a worker that finds no
+        // range big enough to split asks for the unclaimed tail of the
+        // slowest one again instead, and whichever copy gets to the end first
+        // wins.
+        //
+        // A server that doesn't do ranges sends the whole file in answer to
+        // any of them (see whole_file). If that's the answer to the first
+        // chunk, one worker downloads all of it while the rest stop.
+        class chunk_scheduler
+        {
+        public:
+                using active_handle = std::shared_ptr<active_chunk>;
+
+                // Download the file in chunks of request_size, stopping after
+                // max_length bytes even if the file is longer. Ranges with
+                // fewer than 2 * min_split bytes left unclaimed are not split.
+                chunk_scheduler(size_t request_size, size_t max_length = SIZE_MAX,
+                                size_t min_split = 64 * 1024);
+
+                // Take the next range to download, either a queued chunk or
+                // the tail of one that another worker is downloading. c is the
+                // range to request and active tracks the download of it.
+                // Blocks while the size of the file is being found out.
+                // Returns false once there is nothing left or the download
+                // has been cancelled.
+                // If rate is given, it is the worker's connection (see
+                // add_connection), which adaptive mode sizes the chunk for.
+                bool next(chunk& c, active_handle& active,
+                          const connection_rate* rate = nullptr);
+
+                // Like next, but never blocks. If the caller would have had
+                // to wait, returns false with wait set, and the caller should
+                // try again once another worker has reported on its response.
+                bool try_next(chunk& c, active_handle& active, bool& wait,
+                              const connection_rate* rate = nullptr);
+
+                // Size chunks for the connection that will download them
+                // rather than using request_size for all of them. A chunk is
+                // made big enough that the round trip before its body starts
+                // arriving is a small part of the time it takes, and small
+                // enough that the connection is done with it at about the
+                // same time as the others finish the rest of the file. Chunks
+                // are kept between min_size and max_size bytes. Call this
+                // before the first response comes back.
+                void adapt(size_t min_size, size_t max_size);
+
+                // Let idle workers duplicate the tail of the range that is
+                // expected to finish last, if they would likely get it done
+                // sooner. The worker that loses the race is stopped (see
+                // on_stop), or stops at its next claim. No more than percent
+                // of the file is asked for twice.
+                void hedge(double percent);
+
+                // Leave out ranges that don't need downloading, e.g. because
+                // an interrupted download already has them. Call this before
+                // handing out any chunks.
+                void skip(const std::vector<chunk>& ranges);
+
+                // Start measuring a connection. The rate lives as long as
+                // the scheduler.
+                connection_rate& add_connection();
+
+                // Fold a response into a connection's rate: round_trip from
+                // sending the request to reading the header, then transfer to
+                // read bytes of the body.
+                void measure(connection_rate& rate, size_t bytes,
+                             std::chrono::duration<double> round_trip,
+                             std::chrono::duration<double> transfer);
+
+                // Record the length of the body the server is sending for an
+                // active chunk, which may be less than was asked for at the
+                // end of the file. A chunk isn't split until its length is
+                // known, so nothing past the end of the file is handed out.
+                void set_length(const active_handle& active, size_t length);
+
+                // Record the size of the file, as reported by a response.
+                // Queues the chunks that cover it, up to max_length. Throws if
+                // a different size has already been reported, since that
+                // means the file changed during the download.
+                void set_file_size(size_t size);
+
+                // Record the ETag of the file, as reported by a response.
+                // Throws if a different one has already been reported, e.g.
+                // because two mirrors have different versions of the file.
+                void set_etag(const std::string& etag);
+
+                // Record that the file ends at offset, e.g. because the server
+                // answered a request for data there with 416.
+                void end_of_file(size_t offset);
+
+                // Record that the server ignored the range asked for with
+                // active and is sending the whole file, size bytes long. If
+                // active is the only chunk being downloaded, the file is
+                // downloaded in one piece: active and c become the whole
+                // download, and every other chunk is dropped. Throws if other
+                // chunks are being downloaded, since they may be writing to
+                // the output, or if the size is different from before.
+                // Returns false if another worker is already downloading the
+                // whole file, in which case this response isn't needed. If
+                // the one stream is requeued, all of it is queued again,
+                // since the next response starts at the beginning too.
+                bool whole_file(const active_handle& active, chunk& c, size_t size);
+
+                // Whether a response has reported the size of the file yet.
+                bool file_size_known() const;
+
+                // The number of bytes of the file that will be downloaded if
+                // the file is size bytes long.
+                size_t planned_length(size_t size) const;
+
+                // Claim up to n more bytes of an active chunk before reading
+                // them. Returns the number of bytes the worker may read, which
+                // is 0 once the end of the chunk has been reached, possibly
+                // because its tail was stolen.
+                size_t claim(const active_handle& active, size_t n);
+
+                // While the body of an active chunk is being read, stop is
+                // how to close its connection, which the scheduler does if
+                // the chunk loses a hedge race, rather than leave the worker
+                // waiting on data nobody needs. stop is called with the
+                // scheduler locked, so it mustn't call back into it, and is
+                // dropped once the chunk is finished or requeued.
+                void on_stop(const active_handle& active, std::function<void()> stop);
+                // Whether the connection of an active chunk was closed because
+                // it lost a hedge race, rather than because it failed.
+                bool stopped(const active_handle& active) const;
+
+                // Stop tracking an active chunk once the worker is done with
+                // it. Any unclaimed bytes are abandoned.
+                void finish(const active_handle& active);
+
+                // Stop tracking an active chunk whose connection was lost
+                // after received bytes of it had been read, and queue the
+                // rest of it to be downloaded again.
+                void requeue(const active_handle& active, size_t received);
+
+                // Stop handing out chunks, e.g. because a worker failed and
+                // the download can't complete.
+                void cancel();
+
+                // How long the download is: where the file ends, or
+                // max_length if that comes first. This is only final once
+                // every chunk has been finished.
+                size_t length() const;
+
+                // The number of times a range was split between workers.
+                size_t steals() const;
+
+                // The number of hedged requests, and the number of bytes
+                // that were claimed by both sides of a hedge and so read
+                // twice.
+                size_t hedges() const;
+                size_t wasted() const;
+
+        private:
+                enum class phase
+                {
+                        // The first chunk is out, and its response will say
+                        // how big the file is.
+                        probing,
+                        // The size is known, and every chunk has been queued,
+                        // or is cut as it's asked for in adaptive mode.
+                        planned,
+                        // The size isn't known, so chunks go out one at a time
+                        // until one of them reaches the end of the file.
+                        serial,
+                };
+
+                enum class outcome
+                {
+                        ready,
+                        wait,
+                        done,
+                };
+
+                outcome take(chunk& c, active_handle& active,
+                             const connection_rate* rate);
+                size_t chunk_size_for(const connection_rate* rate) const;
+                bool steal(chunk& c);
+                active_handle hedge_victim(const connection_rate* rate, chunk& c) const;
+                void end_race(const active_handle& winner, const active_handle& loser);
+                void queue_chunk(size_t size, size_t end);
+                void queue_chunks(size_t end);
+                void limit_to(size_t end);
+
+                mutable std::mutex lock;
+                std::condition_variable changed;
+                std::deque<chunk> pending;
+                std::list<active_handle> active;
+                std::list<connection_rate> rates;
+                // Ranges not to download, sorted and not overlapping
+                std::vector<chunk> skipped;
+                phase state = phase::probing;
+                size_t request_size;
+                bool adaptive = false;
+                size_t min_size = 0;
+                size_t max_size = SIZE_MAX;
+                // Everything before planned_end has been queued.
+                size_t planned_end = 0;
+                size_t max_length;
+                // Nothing at or after end is downloaded.
+                size_t end;
+                bool size_known = false;
+                size_t file_size = 0;
+                std::string etag;
+                size_t min_split;
+                size_t steal_count = 0;
+                // Percentage of the file that may be hedged, or 0 for none
+                double hedge_percent = 0;
+                size_t hedged_bytes = 0;
+                size_t hedge_count = 0;
+                size_t wasted_bytes = 0;
+                // The server doesn't do ranges, so one worker is downloading
+                // the whole file
+                bool single_stream = false;
+                bool cancelled = false;
+        };
+}
+
+#endif
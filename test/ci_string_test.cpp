@@ -0,0 +1,124 @@
+#include "catch/single_include/catch.hpp"
+#include "ci_string.hpp"
+
+#include <cctype>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+namespace
+{
+        // What the traits did before, one character at a time, for ASCII
+        int reference_compare(const std::string& s1, const std::string& s2)
+        {
+                for (size_t i = 0; i < s1.size(); ++i)
+                {
+                        int c1 = std::toupper(static_cast<unsigned char>(s1[i]));
+                        int c2 = std::toupper(static_cast<unsigned char>(s2[i]));
+                        if (c1 != c2)
+                        {
+                                return c1 < c2 ? -1 : 1;
+                        }
+                }
+                return 0;
+        }
+
+        // Letters in either case, and the punctuation either side of them
+        std::string random_name(std::mt19937& random, size_t size)
+        {
+                const std::string alphabet = "abcxyzABCXYZ@[`{-:09";
+                std::string s(size, ' ');
+                for (char& c : s)
+                {
+                        c = alphabet[random() % alphabet.size()];
+                }
+                return s;
+        }
+
+        std::string flip_case(std::string s)
+        {
+                for (char& c : s)
+                {
+                        c = std::isupper(static_cast<unsigned char>(c)) ? std::tolower(c) : std::toupper(c);
+                }
+                return s;
+        }
+}
+
+TEST_CASE("Comparisons ignore the case of ASCII letters only", "[ci]") {
+        REQUIRE(ci::compare("Content-Length", "content-LENGTH", 14) == 0);
+        REQUIRE(ci::compare("a", "B", 1) < 0);
+        REQUIRE(ci::compare("[", "a", 1) > 0);
+        // Latin-1 letters aren't folded, whatever the locale
+        REQUIRE(ci::compare("\xe4", "\xc4", 1) != 0);
+        REQUIRE(ci::compare("\xe4", "a", 1) > 0);
+        REQUIRE(ci::equal("Transfer-Encoding", "TRANSFER-encoding"));
+        REQUIRE(!ci::equal("Transfer-Encoding", "Transfer-Encodings"));
+        REQUIRE(ci::equal("", ""));
+}
+
+TEST_CASE("Comparisons agree with comparing a character at a time", "[ci]") {
+        std::mt19937 random(42);
+        for (size_t size = 0; size < 70; ++size)
+        {
+                for (int round = 0; round < 20; ++round)
+                {
+                        std::string s1 = random_name(random, size);
+                        std::string s2 = flip_case(s1);
+                        REQUIRE(ci::compare(s1.data(), s2.data(), size) == 0);
+                        if (size > 0)
+                        {
+                                s2[random() % size] = random_name(random, 1)[0];
+                        }
+                        REQUIRE(ci::compare(s1.data(), s2.data(), size) == reference_compare(s1, s2));
+                        REQUIRE(ci::compare(s2.data(), s1.data(), size) == reference_compare(s2, s1));
+                }
+        }
+}
+
+TEST_CASE("Characters are found in either case", "[ci]") {
+        for (size_t size = 1; size < 70; ++size)
+        {
+                std::string s(size, '-');
+                REQUIRE(ci::find(s.data(), size, 'k') == nullptr);
+                for (size_t at = 0; at < size; ++at)
+                {
+                        s.assign(size, '-');
+                        s[at] = 'K';
+                        REQUIRE(ci::find(s.data(), size, 'k') == s.data() + at);
+                        REQUIRE(ci::find(s.data(), size, 'K') == s.data() + at);
+                        // The byte that differs from 'k' only in the case bit
+                        s[at] = 'K' ^ 0x20 ^ 0x80;
+                        REQUIRE(ci::find(s.data(), size, 'k') == nullptr);
+                }
+        }
+        ci::string keep_alive = ci::from_string("Keep-Alive, Upgrade");
+        REQUIRE(keep_alive.find("upgrade") == 12);
+        REQUIRE(keep_alive.find("close") == ci::string::npos);
+}
+
+TEST_CASE("Strings that are equal hash the same", "[ci]") {
+        std::mt19937 random(7);
+        for (size_t size = 0; size < 70; ++size)
+        {
+                std::string s = random_name(random, size);
+                REQUIRE(ci::hash(s) == ci::hash(flip_case(s)));
+        }
+        REQUIRE(ci::hash("Content-Length") != ci::hash("Content-Range"));
+        REQUIRE(ci::hash("a") != ci::hash(std::string("a\0", 2)));
+
+        std::unordered_map<std::string, int, ci::hasher, ci::equal_to> fields;
+        fields["Content-Type"] = 1;
+        fields["ETag"] = 2;
+        REQUIRE(fields.count("content-type") == 1);
+        REQUIRE(fields.at("ETAG") == 2);
+        REQUIRE(fields.count("Content") == 0);
+}
+
+TEST_CASE("ci strings convert to and from std::string", "[ci]") {
+        std::string s = "X-Request-Id";
+        ci::string c = ci::from_string(s);
+        REQUIRE(c == "x-request-id");
+        REQUIRE(ci::to_string(c) == s);
+        REQUIRE(ci::from_string("b") > ci::from_string("A"));
+}
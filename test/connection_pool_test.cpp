@@ -0,0 +1,57 @@
+#include "catch/single_include/catch.hpp"
+#include "connection_pool.hpp"
+
+using namespace network;
+
+TEST_CASE("Connections checked back in are reused", "[pool]") {
+        boost::asio::io_context io;
+        tcp::acceptor listener(io, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+        uint16_t port = listener.local_endpoint().port();
+        connection_pool pool;
+        bool reused = true;
+        connection_pool::connection first = pool.checkout("127.0.0.1", port, reused);
+        REQUIRE(first);
+        REQUIRE(!reused);
+        tcp::iostream* opened = first.get();
+        pool.checkin("127.0.0.1", port, std::move(first));
+        connection_pool::connection again = pool.checkout("127.0.0.1", port, reused);
+        REQUIRE(reused);
+        REQUIRE(again.get() == opened);
+        REQUIRE(pool.hits() == 1);
+        REQUIRE(pool.misses() == 1);
+}
+
+TEST_CASE("Broken connections aren't pooled", "[pool]") {
+        boost::asio::io_context io;
+        tcp::acceptor listener(io, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+        uint16_t port = listener.local_endpoint().port();
+        connection_pool pool;
+        bool reused;
+        connection_pool::connection c = pool.checkout("127.0.0.1", port, reused);
+        c->setstate(std::ios::failbit);
+        pool.checkin("127.0.0.1", port, std::move(c));
+        pool.checkin("127.0.0.1", port, nullptr);
+        c = pool.checkout("127.0.0.1", port, reused);
+        REQUIRE(!reused);
+        REQUIRE(pool.hits() == 0);
+        REQUIRE(pool.misses() == 2);
+}
+
+TEST_CASE("A connection that can't be opened is a connection_error", "[pool]") {
+        boost::asio::io_context io;
+        tcp::acceptor listener(io, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+        uint16_t port = listener.local_endpoint().port();
+        listener.close();
+        connection_pool pool(std::chrono::seconds(5));
+        bool reused;
+        REQUIRE_THROWS_AS(pool.checkout("127.0.0.1", port, reused), connection_error);
+}
+
+TEST_CASE("Pipelining is turned off per host and port", "[pool]") {
+        connection_pool pool;
+        REQUIRE(pool.pipelining("example.com", 80));
+        pool.disable_pipelining("example.com", 80);
+        REQUIRE(!pool.pipelining("example.com", 80));
+        REQUIRE(pool.pipelining("example.com", 8080));
+        REQUIRE(pool.pipelining("example.org", 80));
+}
@@ -0,0 +1,76 @@
+#include "catch/single_include/catch.hpp"
+#include "connector.hpp"
+
+using namespace network;
+
+namespace
+{
+        tcp::endpoint loopback(const char* address, uint16_t port)
+        {
+                return tcp::endpoint(boost::asio::ip::make_address(address), port);
+        }
+}
+
+TEST_CASE("A refused address loses to one that accepts", "[connector]") {
+        boost::asio::io_context io;
+        tcp::acceptor listener(io, loopback("127.0.0.1", 0));
+        uint16_t port = listener.local_endpoint().port();
+        // Nothing listens on 127.0.0.2
+        std::vector<tcp::endpoint> endpoints{loopback("127.0.0.2", port),
+                                             loopback("127.0.0.1", port)};
+        connector c(std::chrono::seconds(5));
+        tcp::socket socket = c.connect(io, endpoints);
+        REQUIRE(socket.remote_endpoint() == endpoints[1]);
+        auto latencies = c.latencies();
+        REQUIRE(latencies.count(endpoints[1]) == 1);
+        REQUIRE(latencies.count(endpoints[0]) == 0);
+        // The address that failed goes last from now on
+        std::vector<tcp::endpoint> order = c.order(endpoints);
+        REQUIRE(order.size() == 2);
+        REQUIRE(order[0] == endpoints[1]);
+        REQUIRE(order[1] == endpoints[0]);
+}
+
+TEST_CASE("A blackholed address only costs the stagger delay", "[connector]") {
+        boost::asio::io_context io;
+        // Once the backlog of an acceptor that never accepts is full, the
+        // kernel drops further connection attempts to it without a reply.
+        tcp::acceptor blackhole(io, tcp::v4());
+        blackhole.bind(loopback("127.0.0.2", 0));
+        blackhole.listen(0);
+        tcp::socket filler(io);
+        filler.connect(blackhole.local_endpoint());
+        tcp::acceptor listener(io, loopback("127.0.0.1", 0));
+        std::vector<tcp::endpoint> endpoints{blackhole.local_endpoint(),
+                                             listener.local_endpoint()};
+        connector c(std::chrono::milliseconds(100));
+        auto start = std::chrono::steady_clock::now();
+        tcp::socket socket = c.connect(io, endpoints);
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+        REQUIRE(socket.remote_endpoint() == endpoints[1]);
+        // It lost the race despite its head start, so it's slow
+        std::vector<tcp::endpoint> order = c.order(endpoints);
+        REQUIRE(order.size() == 2);
+        REQUIRE(order[0] == endpoints[1]);
+        REQUIRE(order[1] == endpoints[0]);
+}
+
+TEST_CASE("Nothing to connect to is an error", "[connector]") {
+        boost::asio::io_context io;
+        tcp::acceptor listener(io, loopback("127.0.0.1", 0));
+        uint16_t port = listener.local_endpoint().port();
+        listener.close();
+        connector c;
+        REQUIRE_THROWS(c.connect(io, {loopback("127.0.0.1", port)}));
+}
+
+TEST_CASE("Address families are interleaved", "[connector]") {
+        connector c;
+        std::vector<tcp::endpoint> endpoints{loopback("::1", 80), loopback("::2", 80),
+                                             loopback("127.0.0.1", 80)};
+        std::vector<tcp::endpoint> order = c.order(endpoints);
+        REQUIRE(order.size() == 3);
+        REQUIRE(order[0] == endpoints[0]);
+        REQUIRE(order[1] == endpoints[2]);
+        REQUIRE(order[2] == endpoints[1]);
+}
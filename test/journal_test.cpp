@@ -0,0 +1,116 @@
+#include "catch/single_include/catch.hpp"
+#include "journal.hpp"
+#include "test/test_files.hpp"
+
+#include <fstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace network;
+
+namespace
+{
+        void write_range(output_file& out, size_t offset, const std::string& data)
+        {
+                out.write_at(offset, reinterpret_cast<const uint8_t*>(data.data()),
+                             data.size());
+                out.commit(offset, data.size());
+        }
+}
+
+TEST_CASE("The journal records the ranges that were written", "[journal]") {
+        std::string path = "build/journal_test";
+        std::string journal_path = path + ".journal";
+        {
+                pwrite_output file(path);
+                journaled_output out(file, journal_path);
+                out.set_validator("\"abc\"");
+                write_range(out, 0, "0123");
+                write_range(out, 4, "45");
+                write_range(out, 8, "89");
+                // The journal is brought up to date when the download fails
+        }
+        journal_contents contents;
+        REQUIRE(read_journal(journal_path, contents));
+        REQUIRE(contents.validator == "\"abc\"");
+        REQUIRE(contents.completed.size() == 2);
+        REQUIRE(contents.completed[0].first_byte == 0);
+        REQUIRE(contents.completed[0].last_byte == 5);
+        REQUIRE(contents.completed[1].first_byte == 8);
+        REQUIRE(contents.completed[1].last_byte == 9);
+
+        // Resuming keeps what was written, and finishing removes the journal
+        {
+                pwrite_output file(path, false);
+                journaled_output out(file, journal_path, &contents);
+                REQUIRE_NOTHROW(out.set_validator("\"abc\""));
+                write_range(out, 6, "67");
+                out.finish(10);
+        }
+        REQUIRE(read_file(path) == "0123456789");
+        REQUIRE(!read_journal(journal_path, contents));
+        ::unlink(path.c_str());
+}
+
+TEST_CASE("A journal for another version of the file can't be resumed", "[journal]") {
+        std::string path = "build/journal_test";
+        std::string journal_path = path + ".journal";
+        journal_contents contents;
+        contents.validator = "\"abc\"";
+        contents.completed.push_back({0, 9});
+        {
+                pwrite_output file(path);
+                journaled_output out(file, journal_path, &contents);
+                REQUIRE_THROWS(out.set_validator("\"def\""));
+        }
+        ::unlink(path.c_str());
+        ::unlink(journal_path.c_str());
+}
+
+TEST_CASE("A resumed journal is kept until its rewrite is in place", "[journal]") {
+        std::string path = "build/journal_test";
+        std::string journal_path = path + ".journal";
+        std::string temporary = journal_path + ".tmp";
+        {
+                std::ofstream fs(journal_path);
+                fs << "multi-get journal\nvalidator \"abc\"\nrange 0 4\nrange 5 9\n";
+        }
+        journal_contents contents;
+        REQUIRE(read_journal(journal_path, contents));
+        // The rewrite can't be started, which mustn't cost the old journal
+        REQUIRE(::mkdir(temporary.c_str(), 0777) == 0);
+        {
+                pwrite_output file(path, false);
+                REQUIRE_THROWS(journaled_output(file, journal_path, &contents));
+        }
+        REQUIRE(::rmdir(temporary.c_str()) == 0);
+        journal_contents kept;
+        REQUIRE(read_journal(journal_path, kept));
+        REQUIRE(kept.completed.size() == 1);
+        REQUIRE(kept.completed[0].last_byte == 9);
+
+        // A rewrite that gets written replaces it, with nothing left behind
+        {
+                pwrite_output file(path, false);
+                journaled_output out(file, journal_path, &contents);
+                REQUIRE(read_file(journal_path)
+                        == "multi-get journal\nvalidator \"abc\"\nrange 0 9\n");
+                REQUIRE(::access(temporary.c_str(), F_OK) != 0);
+        }
+        ::unlink(path.c_str());
+        ::unlink(journal_path.c_str());
+}
+
+TEST_CASE("A line cut short by a crash is ignored", "[journal]") {
+        std::string journal_path = "build/journal_test.journal";
+        {
+                std::ofstream fs(journal_path);
+                fs << "multi-get journal\nrange 0 99\nrange 200 2";
+        }
+        journal_contents contents;
+        REQUIRE(read_journal(journal_path, contents));
+        REQUIRE(contents.completed.size() == 1);
+        REQUIRE(contents.completed[0].last_byte == 99);
+        ::unlink(journal_path.c_str());
+}
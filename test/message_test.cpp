@@ -1,6 +1,13 @@
 #include "catch/single_include/catch.hpp"
 #include "message.hpp"
 
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
 using namespace message;
 
 TEST_CASE("Only valid field names are allowed", "[request]") {
@@ -12,6 +19,47 @@ TEST_CASE("Field names are case insensitive", "[request]") {
         REQUIRE_NOTHROW(request_field_name("hOst"));
 }
 
+// Checked as the test compiles
+static_assert(known_field("content-LENGTH") == fields::content_length, "");
+static_assert(find_field_id("X-Not-Known") == unknown_field, "");
+
+TEST_CASE("Every known field has an ID of its own", "[registry]") {
+        for (size_t i = 0; i < known_field_count; ++i)
+        {
+                std::string name(known_field_names[i].name);
+                INFO(name);
+                REQUIRE(find_field_id(name) == field_id(i));
+                for (char& c : name)
+                {
+                        c = std::tolower(c);
+                }
+                REQUIRE(find_field_id(name) == field_id(i));
+                REQUIRE(field_spelling(field_id(i)) == known_field_names[i].name);
+        }
+        REQUIRE(find_field_id("") == unknown_field);
+        REQUIRE(find_field_id("Content-Lengths") == unknown_field);
+        REQUIRE_THROWS(known_field("Not-A-Header"));
+}
+
+TEST_CASE("Fields are only allowed in the messages they belong in", "[registry]") {
+        REQUIRE_THROWS(request_field_name("Server"));
+        REQUIRE_THROWS(response_field_name("Host"));
+        REQUIRE_THROWS(response_field_name(fields::host));
+        REQUIRE_NOTHROW(request_field_name(fields::host));
+        REQUIRE_NOTHROW(response_field_name("Connection"));
+        REQUIRE_NOTHROW(request_field_name("Connection"));
+}
+
+TEST_CASE("Known fields are spelled the usual way, and extensions as given", "[registry]") {
+        REQUIRE(request_field_name("user-agent").to_string() == "User-Agent");
+        REQUIRE(response_field_name("etag").to_string() == "ETag");
+        REQUIRE(response_field_name("x-Request-Id").to_string() == "x-Request-Id");
+        REQUIRE(response_field_name("X-REQUEST-ID") == response_field_name("x-request-id"));
+        REQUIRE(!(response_field_name("X-Request-Id") == response_field_name("X-Request")));
+        REQUIRE(response_field_name("X-A") < response_field_name("x-b"));
+        REQUIRE(!(response_field_name("x-b") < response_field_name("X-A")));
+}
+
 TEST_CASE("Requests render properly", "[request]") {
         request_message request(method::GET, "/index.html", {{"Host", "www.example.org"}});
         std::ostringstream render_stream;
@@ -22,6 +70,26 @@ TEST_CASE("Requests render properly", "[request]") {
                 "\r\n");
 }
 
+TEST_CASE("Request templates only fill in the range", "[request]") {
+        request_template requests(method::GET, "/file.bin",
+                                  {{"Host", "www.example.org"}, {"User-Agent", "test"}});
+        REQUIRE(requests.with_range(0, 99) ==
+                "GET /file.bin HTTP/1.1\r\n"
+                "Host: www.example.org\r\n"
+                "User-Agent: test\r\n"
+                "Range: bytes=0-99\r\n"
+                "\r\n");
+        std::string_view request = requests.with_range(SIZE_MAX - 1, SIZE_MAX);
+        REQUIRE(request.substr(request.find("Range")) ==
+                "Range: bytes=18446744073709551614-18446744073709551615\r\n\r\n");
+        // Made in the same buffer every time
+        REQUIRE(requests.with_range(5, 10).data() == request.data());
+
+        std::vector<content_range> ranges = {{true, 0, 9, false, 0}, {true, 20, 29, false, 0}};
+        request = requests.with_ranges(ranges);
+        REQUIRE(request.substr(request.find("Range")) == "Range: bytes=0-9,20-29\r\n\r\n");
+}
+
 TEST_CASE("HTTP versions are read correctly", "[response]") {
         std::istringstream valid_ss("HTTP/1.0 HTTP/1.1 HTTP/2.0");
         http_version version10, version11, version20;
@@ -99,4 +167,481 @@ TEST_CASE("Response with a non-standard field", "[response]") {
                        "Content-Length: 0\r\n\r\n");
         REQUIRE_NOTHROW(response_message{ss});
 }
+
+TEST_CASE("Fields a response isn't known to have are left out", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 200 OK\r\n" \
+                "Connection: Keep-Alive\r\n" \
+                "Keep-Alive: timeout=5, max=100\r\n" \
+                "Report-To: default\r\n" \
+                "Host: example.com\r\n" \
+                "X-Powered-By: PHP\r\n" \
+                "Content-Length: 2\r\n\r\n" \
+                "ok");
+        response_message read_message(ss);
+        response_message actual_message(
+                http_version::HTTP11, {200, "OK"},
+                {{"Connection", "Keep-Alive"}, {"Keep-Alive", "timeout=5, max=100"},
+                 {"X-Powered-By", "PHP"}, {"Content-Length", "2"}},
+                {'o', 'k'});
+        REQUIRE(read_message == actual_message);
+        REQUIRE(read_message.keep_alive());
+}
                 
+
+TEST_CASE("Reading only the header leaves the body in the stream", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 206 Partial\r\n" \
+                "Content-Length: 4\r\n" \
+                "\r\n" \
+                "abcd");
+        response_message header = response_message::read_header(ss);
+        REQUIRE(header.content_length() == 4);
+        REQUIRE(header.body().empty());
+        std::string body;
+        ss >> body;
+        REQUIRE(body == "abcd");
+}
+
+TEST_CASE("Content-Range values are parsed", "[response]") {
+        content_range range;
+        REQUIRE(parse_content_range("bytes 0-499/1234", range));
+        REQUIRE(range.has_range);
+        REQUIRE(range.first_byte == 0);
+        REQUIRE(range.last_byte == 499);
+        REQUIRE(range.has_length);
+        REQUIRE(range.complete_length == 1234);
+
+        REQUIRE(parse_content_range("bytes */1234", range));
+        REQUIRE(!range.has_range);
+        REQUIRE(range.complete_length == 1234);
+
+        REQUIRE(parse_content_range("bytes 10-19/*", range));
+        REQUIRE(range.has_range);
+        REQUIRE(!range.has_length);
+
+        REQUIRE(!parse_content_range("bytes 10-5/100", range));
+        REQUIRE(!parse_content_range("bytes 0-100/100", range));
+        REQUIRE(!parse_content_range("items 0-1/2", range));
+        REQUIRE(!parse_content_range("bytes */*", range));
+}
+
+TEST_CASE("Header fields can be looked up", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 416 Range Not Satisfiable\r\n" \
+                "Content-Range: bytes */1234\r\n" \
+                "Content-Length: 0\r\n\r\n");
+        response_message response(ss);
+        REQUIRE(response.status_code() == 416);
+        REQUIRE(!response);
+        REQUIRE(response.find_field("content-range"));
+        REQUIRE(*response.find_field("content-range") == "bytes */1234");
+        REQUIRE(!response.find_field("ETag"));
+}
+
+TEST_CASE("Multipart boundaries are found in Content-Type", "[response]") {
+        std::string boundary;
+        REQUIRE(parse_multipart_boundary(
+                        "multipart/byteranges; boundary=THIS_STRING_SEPARATES", boundary));
+        REQUIRE(boundary == "THIS_STRING_SEPARATES");
+        REQUIRE(parse_multipart_boundary(
+                        "Multipart/ByteRanges; Boundary=\"a b\"; x=y", boundary));
+        REQUIRE(boundary == "a b");
+        REQUIRE(!parse_multipart_boundary("application/octet-stream", boundary));
+        REQUIRE(!parse_multipart_boundary("multipart/byteranges", boundary));
+}
+
+TEST_CASE("Multipart bodies are handed out a part at a time", "[response]") {
+        std::string body =
+                "preamble\r\n"
+                "--SEP\r\n"
+                "Content-Type: text/plain\r\n"
+                "Content-Range: bytes 0-3/100\r\n"
+                "\r\n"
+                "abcd\r\n"
+                "--SEP\r\n"
+                "content-range: bytes 50-51/100\r\n"
+                "\r\n"
+                "\r\n\r\n"
+                "--SEP--\r\n"
+                "epilogue";
+        std::istringstream ss(body + "next");
+        std::vector<std::pair<size_t, std::string>> parts;
+        read_byteranges(ss, body.size(), "SEP",
+                        [&parts](const content_range& range, std::istream& is) {
+                                std::string data(range.last_byte - range.first_byte + 1, ' ');
+                                is.read(&data[0], data.size());
+                                parts.emplace_back(range.first_byte, data);
+                        });
+        REQUIRE(parts.size() == 2);
+        REQUIRE(parts[0].first == 0);
+        REQUIRE(parts[0].second == "abcd");
+        REQUIRE(parts[1].first == 50);
+        REQUIRE(parts[1].second == "\r\n");
+        // Nothing past the body is read
+        std::string rest;
+        ss >> rest;
+        REQUIRE(rest == "next");
+}
+
+TEST_CASE("Malformed multipart bodies are rejected", "[response]") {
+        auto ignore = [](const content_range& range, std::istream& is) {
+                is.ignore(range.last_byte - range.first_byte + 1);
+        };
+        std::string no_range = "--SEP\r\n\r\nabcd\r\n--SEP--\r\n";
+        std::istringstream ss(no_range);
+        REQUIRE_THROWS(read_byteranges(ss, no_range.size(), "SEP", ignore));
+
+        std::string truncated = "--SEP\r\nContent-Range: bytes 0-9/10\r\n\r\nabc";
+        std::istringstream ts(truncated);
+        REQUIRE_THROWS(read_byteranges(ts, truncated.size(), "SEP", ignore));
+}
+
+TEST_CASE("A multipart body cut off is told apart from a malformed one", "[response]") {
+        auto ignore = [](const content_range& range, std::istream& is) {
+                is.ignore(range.last_byte - range.first_byte + 1);
+        };
+        // The stream ends inside a delimiter, inside a part, and between
+        // parts, each before the length said it would
+        std::string in_delimiter = "--SEP\r\nContent-Range: bytes 0-3/10\r\n\r\nabcd\r\n--SE";
+        std::istringstream ds(in_delimiter);
+        REQUIRE_THROWS_AS(read_byteranges(ds, in_delimiter.size() + 100, "SEP", ignore),
+                          truncated_body);
+        std::string in_part = "--SEP\r\nContent-Range: bytes 0-9/10\r\n\r\nabc";
+        std::istringstream ps(in_part);
+        REQUIRE_THROWS_AS(read_byteranges(ps, in_part.size() + 100, "SEP", ignore),
+                          truncated_body);
+        std::string between = "--SEP\r\nContent-Range: bytes 0-3/10\r\n\r\nabcd";
+        std::istringstream bs(between);
+        REQUIRE_THROWS_AS(read_byteranges(bs, SIZE_MAX, "SEP", ignore), truncated_body);
+
+        std::string no_range = "--SEP\r\n\r\nabcd\r\n--SEP--\r\n";
+        std::istringstream ns(no_range);
+        bool cut_off = false;
+        try
+        {
+                read_byteranges(ns, no_range.size() + 100, "SEP", ignore);
+        }
+        catch (const truncated_body&)
+        {
+                cut_off = true;
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+        REQUIRE(!cut_off);
+}
+
+TEST_CASE("Multipart bodies can be chunked", "[response]") {
+        std::istringstream ss(
+                "7\r\n--SEP\r\n\r\n"
+                "1f\r\nContent-Range: bytes 0-3/100\r\n\r\r\n"
+                "16\r\n\nabcd\r\n--SEP\r\n"
+                "Content-\r\n"
+                "21\r\nRange: bytes 50-51/100\r\n\r\nxy\r\n--S\r\n"
+                "6\r\nEP--\r\n\r\n"
+                "0\r\n\r\n"
+                "next");
+        chunked_body chunks(ss);
+        chunked_stream body(chunks);
+        std::vector<std::pair<size_t, std::string>> parts;
+        read_byteranges(body, SIZE_MAX, "SEP",
+                        [&parts](const content_range& range, std::istream& is) {
+                                std::string data(range.last_byte - range.first_byte + 1, ' ');
+                                is.read(&data[0], data.size());
+                                parts.emplace_back(range.first_byte, data);
+                        });
+        REQUIRE(parts.size() == 2);
+        REQUIRE(parts[0].first == 0);
+        REQUIRE(parts[0].second == "abcd");
+        REQUIRE(parts[1].first == 50);
+        REQUIRE(parts[1].second == "xy");
+        REQUIRE(chunks.end());
+        std::string rest;
+        ss >> rest;
+        REQUIRE(rest == "next");
+}
+
+TEST_CASE("Chunked bodies are decoded with their trailers", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 200 OK\r\n" \
+                "Transfer-Encoding: chunked\r\n" \
+                "\r\n" \
+                "4\r\nabcd\r\n" \
+                "A;name=value\r\n0123456789\r\n" \
+                "0\r\n" \
+                "X-Checksum: 42\r\n" \
+                "Digest: sha-256=abc\r\n" \
+                "\r\n" \
+                "next");
+        response_message response{ss};
+        std::string body(response.body().begin(), response.body().end());
+        REQUIRE(body == "abcd0123456789");
+        REQUIRE(response.find_field("X-Checksum"));
+        REQUIRE(*response.find_field("X-Checksum") == "42");
+        // Nothing after the body is read
+        std::string rest;
+        ss >> rest;
+        REQUIRE(rest == "next");
+}
+
+TEST_CASE("Chunked bodies are handed out as they arrive", "[response]") {
+        std::istringstream ss("3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n");
+        chunked_body body(ss);
+        uint8_t buffer[4];
+        REQUIRE(body.read(buffer, 4) == 3);
+        REQUIRE(body.read(buffer, 1) == 1);
+        REQUIRE(buffer[0] == 'd');
+        REQUIRE(!body.done());
+        REQUIRE(body.read(buffer, 4) == 1);
+        REQUIRE(body.end());
+        REQUIRE(body.done());
+        REQUIRE(body.read(buffer, 4) == 0);
+        REQUIRE(body.trailers().empty());
+}
+
+TEST_CASE("A chunked body cut short isn't done", "[response]") {
+        std::istringstream ss("5\r\nabc");
+        chunked_body body(ss);
+        uint8_t buffer[8];
+        REQUIRE(body.read(buffer, 8) == 3);
+        REQUIRE(body.read(buffer, 8) == 0);
+        REQUIRE(!body.done());
+        REQUIRE(!body.end());
+}
+
+TEST_CASE("Malformed chunked bodies are rejected", "[response]") {
+        uint8_t buffer[8];
+        std::istringstream bad_size("xyz\r\nabc\r\n0\r\n\r\n");
+        chunked_body bad_size_body(bad_size);
+        REQUIRE_THROWS(bad_size_body.read(buffer, 8));
+
+        std::istringstream no_crlf("3\r\nabcdef\r\n0\r\n\r\n");
+        chunked_body no_crlf_body(no_crlf);
+        REQUIRE(no_crlf_body.read(buffer, 8) == 3);
+        REQUIRE_THROWS(no_crlf_body.read(buffer, 8));
+}
+
+namespace
+{
+        // Decode a chunked body with a chunk_parser, as if it arrived in
+        // pieces of step bytes. Returns the data, and what was left after the
+        // end of the body.
+        std::pair<std::string, std::string> parse_chunks(const std::string& body, size_t step)
+        {
+                chunk_parser parser;
+                std::string data;
+                std::string buffered;
+                size_t arrived = 0;
+                while (!parser.done())
+                {
+                        size_t used = parser.parse(buffered.data(), buffered.size());
+                        buffered.erase(0, used);
+                        size_t n = std::min(parser.data_left(), buffered.size());
+                        data.append(buffered, 0, n);
+                        buffered.erase(0, n);
+                        parser.consume(n);
+                        if (!parser.done() && (used == 0 && n == 0))
+                        {
+                                REQUIRE(arrived < body.size());
+                                buffered.append(body, arrived, step);
+                                arrived += step;
+                        }
+                }
+                if (arrived < body.size())
+                {
+                        buffered.append(body, arrived, std::string::npos);
+                }
+                return {data, buffered};
+        }
+}
+
+TEST_CASE("Chunked bodies are decoded from a buffer however they arrive", "[response]") {
+        std::string body = "4\r\nabcd\r\n"
+                "A;name=value\r\n0123456789\r\n"
+                "0\r\n"
+                "X-Checksum: 42\r\n"
+                "\r\n"
+                "next";
+        for (size_t step = 1; step <= body.size(); ++step)
+        {
+                auto decoded = parse_chunks(body, step);
+                REQUIRE(decoded.first == "abcd0123456789");
+                REQUIRE(decoded.second == "next");
+        }
+
+        chunk_parser parser;
+        std::string bad = "3\r\nabcdef\r\n";
+        REQUIRE(parser.parse(bad.data(), bad.size()) == 3);
+        REQUIRE(parser.data_left() == 3);
+        parser.consume(3);
+        REQUIRE_THROWS(parser.parse(bad.data() + 6, bad.size() - 6));
+        chunk_parser bad_size;
+        REQUIRE_THROWS(bad_size.parse("xyz\r\n", 5));
+}
+
+TEST_CASE("Bodies are read straight into a buffer", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 200 OK\r\n" \
+                "Content-Length: 5\r\n" \
+                "\r\n" \
+                "hellonext");
+        response_message header = response_message::read_header(ss);
+        uint8_t buffer[8] = {};
+        span_sink sink(buffer, sizeof(buffer));
+        body_result result = header.read_body(ss, sink);
+        REQUIRE(result.length == 5);
+        REQUIRE(result.complete);
+        REQUIRE(std::string(buffer, buffer + 5) == "hello");
+        std::string rest;
+        ss >> rest;
+        REQUIRE(rest == "next");
+
+        // A chunked body that just fits, and one that doesn't
+        std::istringstream fits("3\r\nabc\r\n1\r\nd\r\n0\r\nX-Sum: 1\r\n\r\n");
+        chunked_body fits_chunks(fits);
+        span_sink four(buffer, 4);
+        result = read_body(fits, &fits_chunks, four, SIZE_MAX);
+        REQUIRE(result.length == 4);
+        REQUIRE(result.complete);
+        REQUIRE(fits_chunks.trailers().size() == 1);
+        std::istringstream too_big("3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n");
+        chunked_body too_big_chunks(too_big);
+        span_sink short_sink(buffer, 4);
+        REQUIRE_THROWS(read_body(too_big, &too_big_chunks, short_sink, SIZE_MAX));
+}
+
+TEST_CASE("Bodies can be handed to a function", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 200 OK\r\n" \
+                "Transfer-Encoding: chunked\r\n" \
+                "\r\n" \
+                "4\r\nabcd\r\n" \
+                "2\r\nef\r\n" \
+                "0\r\n" \
+                "X-Checksum: 42\r\n" \
+                "\r\n");
+        response_message header = response_message::read_header(ss);
+        std::string body;
+        function_sink sink([&body](const uint8_t* data, size_t n) {
+                        body.append(data, data + n);
+                });
+        body_result result = header.read_body(ss, sink);
+        REQUIRE(result.length == 6);
+        REQUIRE(result.complete);
+        REQUIRE(body == "abcdef");
+        REQUIRE(header.find_field("X-Checksum"));
+}
+
+TEST_CASE("Bodies can be written to a file descriptor", "[response]") {
+        std::string data(40000, 'x');
+        for (size_t i = 0; i < data.size(); ++i)
+        {
+                data[i] = 'a' + i % 26;
+        }
+        std::istringstream ss(data);
+        FILE* file = std::tmpfile();
+        REQUIRE(file);
+        int fd = fileno(file);
+        fd_sink sink(fd, 3);
+        body_result result = read_body(ss, nullptr, sink, data.size());
+        REQUIRE(result.length == data.size());
+        REQUIRE(result.complete);
+        std::string written(data.size() + 3, ' ');
+        REQUIRE(::pread(fd, &written[0], written.size(), 0) == ssize_t(written.size()));
+        REQUIRE(written.substr(3) == data);
+        std::fclose(file);
+}
+
+TEST_CASE("Bodies that end early are reported", "[response]") {
+        std::istringstream ss(
+                "HTTP/1.1 200 OK\r\n" \
+                "Content-Length: 10\r\n" \
+                "\r\n" \
+                "abc");
+        response_message header = response_message::read_header(ss);
+        uint8_t buffer[10];
+        span_sink sink(buffer, sizeof(buffer));
+        body_result result = header.read_body(ss, sink);
+        REQUIRE(result.length == 3);
+        REQUIRE(!result.complete);
+
+        std::istringstream cut("5\r\nabc");
+        chunked_body chunks(cut);
+        std::string body;
+        function_sink to_string([&body](const uint8_t* data, size_t n) {
+                        body.append(data, data + n);
+                });
+        result = read_body(cut, &chunks, to_string, SIZE_MAX);
+        REQUIRE(result.length == 3);
+        REQUIRE(!result.complete);
+        REQUIRE(body == "abc");
+}
+
+TEST_CASE("The parser reads a header however it arrives", "[parser]") {
+        const std::string response =
+                "HTTP/1.1 206 Partial Content\r\n" \
+                "Content-Range: bytes 0-3/10\r\n" \
+                "Content-Length:4\r\n" \
+                "X-Empty: \r\n" \
+                "\r\n" \
+                "abcd";
+        // One byte at a time, copied to a new buffer each time as if it
+        // had been reallocated
+        response_parser parser;
+        std::string received;
+        size_t i = 0;
+        for (bool done = false; !done; )
+        {
+                REQUIRE(i < response.size());
+                received = received + response[i++];
+                done = parser.parse(received.data(), received.size());
+        }
+        REQUIRE(parser.header_size() == response.size() - 4);
+        REQUIRE(parser.version() == http_version::HTTP11);
+        REQUIRE(parser.status_code() == 206);
+        REQUIRE(parser.reason() == "Partial Content");
+        REQUIRE(parser.field_count() == 3);
+        REQUIRE(parser.field_name(0) == "Content-Range");
+        REQUIRE(parser.field_value(0) == "bytes 0-3/10");
+        REQUIRE(parser.find_field("content-length") == "4");
+        REQUIRE(parser.find_field("X-Empty").empty());
+        REQUIRE(parser.find_field("X-Empty").data() != nullptr);
+        REQUIRE(parser.find_field("ETag").data() == nullptr);
+
+        response_message header(parser);
+        REQUIRE(header.content_length() == 4);
+}
+
+TEST_CASE("The parser rejects malformed headers", "[parser]") {
+        const char* malformed[] = {
+                "HTTP/1.5 200 OK\r\n\r\n",
+                "HTTP/1.1 2x0 OK\r\n\r\n",
+                "HTTP/1.1 2000 OK\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nNo-Colon\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nBad Name: x\r\n\r\n",
+        };
+        for (const char* m : malformed)
+        {
+                response_parser parser;
+                REQUIRE_THROWS(parser.parse(m, std::strlen(m)));
+        }
+        std::string huge = "HTTP/1.1 200 OK\r\nX-Long: "
+                + std::string(response_parser::max_header_size, 'x');
+        response_parser parser;
+        REQUIRE_THROWS(parser.parse(huge.data(), huge.size()));
+}
+
+TEST_CASE("The parser can start again on the next response", "[parser]") {
+        const std::string two =
+                "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n" \
+                "HTTP/1.0 404 Not Found\r\n\r\n";
+        response_parser parser;
+        REQUIRE(parser.parse(two.data(), two.size()));
+        size_t first = parser.header_size();
+        parser.reset();
+        REQUIRE(parser.parse(two.data() + first, two.size() - first));
+        REQUIRE(parser.status_code() == 404);
+        REQUIRE(parser.version() == http_version::HTTP10);
+        REQUIRE(parser.field_count() == 0);
+}
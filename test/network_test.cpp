@@ -0,0 +1,731 @@
+#include "catch/single_include/catch.hpp"
+#include "network.hpp"
+#include "async_engine.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+using namespace network;
+
+namespace
+{
+        message::response_message response(const std::string& text)
+        {
+                std::istringstream is(text);
+                return message::response_message::read_header(is);
+        }
+
+        chunk range(size_t first_byte, size_t last_byte)
+        {
+                chunk c;
+                c.first_byte = first_byte;
+                c.last_byte = last_byte;
+                return c;
+        }
+
+        std::string test_file(size_t size)
+        {
+                std::string file(size, '\0');
+                for (size_t i = 0; i < size; ++i)
+                {
+                        file[i] = static_cast<char>(i * 7 % 251);
+                }
+                return file;
+        }
+
+        // What a range_server does wrong
+        struct misbehaviour
+        {
+                // Close this many connections, first to last, before
+                // answering anything on them
+                int drop_connections = 0;
+                // Close the connection halfway through the first body
+                bool cut_first_body = false;
+                // Never answer the first request, and wait for the client to
+                // close the connection
+                bool ignore_first_request = false;
+                // Stop sending a tenth of the way through the first body, and
+                // wait for the client to close the connection
+                bool stall_first_body = false;
+                // Send the first body a thousand bytes at a time, 10ms apart
+                bool trickle_first_body = false;
+                // Wait this long before answering each request
+                std::chrono::milliseconds answer_delay{0};
+                // Send every body in chunks, rather than say how long it is
+                bool chunked = false;
+                // Answer every request after the first with a range a byte
+                // later than the one asked for
+                bool shift_later_ranges = false;
+                // Close each connection after answering one request, without
+                // saying so, dropping any requests queued behind it
+                bool one_request = false;
+        };
+
+        // An HTTP server on a loopback port that answers range requests for
+        // file, with a thread for each connection.
+        class range_server
+        {
+        public:
+                range_server(const std::string& file, misbehaviour faults = misbehaviour())
+                        : file(file), faults(faults),
+                          acceptor(io, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0)),
+                          listener([this]() { listen(); })
+                {
+                }
+
+                ~range_server()
+                {
+                        stopping = true;
+                        // Wake the listener up
+                        tcp::iostream wake("127.0.0.1", std::to_string(port()));
+                        listener.join();
+                        for (std::thread& t : workers)
+                        {
+                                t.join();
+                        }
+                }
+
+                uint16_t port() const
+                {
+                        return acceptor.local_endpoint().port();
+                }
+
+                // The ranges asked for, as "first-last", in the order they
+                // arrived
+                std::vector<std::string> requests() const
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        return seen;
+                }
+
+                // How many connections have been accepted
+                int connections() const
+                {
+                        return accepted;
+                }
+
+        private:
+                void listen()
+                {
+                        for (int n = 1; ; ++n)
+                        {
+                                tcp::socket socket(io);
+                                boost::system::error_code ec;
+                                acceptor.accept(socket, ec);
+                                if (stopping || ec)
+                                {
+                                        return;
+                                }
+                                accepted = n;
+                                workers.emplace_back(&range_server::serve, this,
+                                                     std::move(socket), n);
+                        }
+                }
+
+                void serve(tcp::socket socket, int n)
+                {
+                        tcp::iostream stream(std::move(socket));
+                        const std::string prefix = "Range: bytes=";
+                        std::string line;
+                        while (std::getline(stream, line))
+                        {
+                                std::string requested;
+                                while (std::getline(stream, line) && line != "\r")
+                                {
+                                        if (line.compare(0, prefix.size(), prefix) == 0)
+                                        {
+                                                requested = line.substr(
+                                                        prefix.size(),
+                                                        line.size() - prefix.size() - 1);
+                                        }
+                                }
+                                {
+                                        std::lock_guard<std::mutex> guard(lock);
+                                        seen.push_back(requested);
+                                }
+                                if (n <= faults.drop_connections)
+                                {
+                                        break;
+                                }
+                                if (faults.ignore_first_request && !ignored.exchange(true))
+                                {
+                                        stream.ignore(std::numeric_limits<std::streamsize>::max());
+                                        break;
+                                }
+                                std::this_thread::sleep_for(faults.answer_delay);
+                                size_t dash = requested.find('-');
+                                size_t first = std::stoul(requested.substr(0, dash));
+                                size_t last = std::min(
+                                        std::stoul(requested.substr(dash + 1)),
+                                        file.size() - 1);
+                                if (faults.shift_later_ranges && answered++ > 0)
+                                {
+                                        ++first;
+                                }
+                                if (first >= file.size())
+                                {
+                                        stream << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                               << "Content-Range: bytes */" << file.size() << "\r\n"
+                                               << "Content-Length: 0\r\n\r\n" << std::flush;
+                                        continue;
+                                }
+                                size_t length = last - first + 1;
+                                stream << "HTTP/1.1 206 Partial Content\r\n"
+                                       << "Content-Range: bytes " << first << "-" << last
+                                       << "/" << file.size() << "\r\n";
+                                if (faults.chunked)
+                                {
+                                        stream << "Transfer-Encoding: chunked\r\n\r\n";
+                                }
+                                else
+                                {
+                                        stream << "Content-Length: " << length << "\r\n\r\n";
+                                }
+                                if (faults.cut_first_body && !cut.exchange(true))
+                                {
+                                        send(stream, first, length / 2);
+                                        break;
+                                }
+                                if (faults.stall_first_body && !stalled.exchange(true))
+                                {
+                                        send(stream, first, length / 10);
+                                        stream.flush();
+                                        stream.ignore(std::numeric_limits<std::streamsize>::max());
+                                        break;
+                                }
+                                if (faults.trickle_first_body && !trickled.exchange(true))
+                                {
+                                        for (size_t sent = 0; sent < length && stream; sent += 1000)
+                                        {
+                                                send(stream, first + sent,
+                                                     std::min<size_t>(1000, length - sent));
+                                                stream.flush();
+                                                std::this_thread::sleep_for(
+                                                        std::chrono::milliseconds(10));
+                                        }
+                                        break;
+                                }
+                                send(stream, first, length);
+                                if (faults.chunked)
+                                {
+                                        stream << "0\r\n\r\n";
+                                }
+                                stream.flush();
+                                if (faults.one_request)
+                                {
+                                        break;
+                                }
+                        }
+                        // Let the client see the end of the stream before
+                        // anything it sent is thrown away, which would reset
+                        // the connection.
+                        stream.flush();
+                        boost::system::error_code ec;
+                        stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+                        stream.ignore(std::numeric_limits<std::streamsize>::max());
+                }
+
+                // Write n bytes of the file from first, in chunks if the
+                // body is chunked
+                void send(tcp::iostream& stream, size_t first, size_t n)
+                {
+                        if (!faults.chunked)
+                        {
+                                stream.write(file.data() + first, n);
+                                return;
+                        }
+                        const size_t chunk_size = 4096;
+                        for (size_t done = 0; done < n; done += chunk_size)
+                        {
+                                size_t size = std::min(chunk_size, n - done);
+                                stream << std::hex << size << std::dec << "\r\n";
+                                stream.write(file.data() + first + done, size);
+                                stream << "\r\n";
+                        }
+                }
+
+                const std::string file;
+                const misbehaviour faults;
+                boost::asio::io_context io;
+                tcp::acceptor acceptor;
+                std::atomic<bool> stopping{false};
+                std::atomic<bool> cut{false};
+                std::atomic<bool> ignored{false};
+                std::atomic<bool> stalled{false};
+                std::atomic<bool> trickled{false};
+                std::atomic<int> answered{0};
+                std::atomic<int> accepted{0};
+                mutable std::mutex lock;
+                std::vector<std::string> seen;
+                std::vector<std::thread> workers;
+                std::thread listener;
+        };
+
+        // Download file from mirrors into a string in chunks of chunk_size.
+        std::string download(connection_pool& pool, std::vector<mirror>& mirrors,
+                             size_t chunk_size, int connections, int pipeline_depth,
+                             const transfer_limits& limits)
+        {
+                std::ostringstream result;
+                std::ostream_iterator<uint8_t> os(result);
+                memory_output out(os);
+                chunk_scheduler scheduler(chunk_size, SIZE_MAX, chunk_size);
+                download_file_parallel(pool, mirrors, scheduler, connections,
+                                       pipeline_depth, out, limits);
+                return result.str();
+        }
+
+        // The same with download_file_async, from the server on port.
+        std::string download_async(uint16_t port, size_t chunk_size, int connections,
+                                   int pipeline_depth, const transfer_limits& limits)
+        {
+                std::ostringstream result;
+                std::ostream_iterator<uint8_t> os(result);
+                memory_output out(os);
+                chunk_scheduler scheduler(chunk_size, SIZE_MAX, chunk_size);
+                download_file_async("127.0.0.1", port, "/file", scheduler, connections,
+                                    pipeline_depth, out, limits);
+                return result.str();
+        }
+
+        transfer_limits quick_retries(int retries)
+        {
+                transfer_limits limits;
+                limits.first_byte = std::chrono::seconds(5);
+                limits.idle = std::chrono::seconds(5);
+                limits.retries = retries;
+                limits.backoff = std::chrono::milliseconds(1);
+                return limits;
+        }
+}
+
+TEST_CASE("A response is out of order if it starts somewhere else", "[network]") {
+        chunk c = range(100, 199);
+        REQUIRE(!out_of_order(response("HTTP/1.1 206 Partial Content\r\n"
+                                       "Content-Range: bytes 100-149/1000\r\n"
+                                       "Content-Length: 50\r\n\r\n"), c));
+        REQUIRE(out_of_order(response("HTTP/1.1 206 Partial Content\r\n"
+                                      "Content-Range: bytes 0-99/1000\r\n"
+                                      "Content-Length: 100\r\n\r\n"), c));
+        REQUIRE(!out_of_order(response("HTTP/1.1 200 OK\r\n"
+                                       "Content-Length: 1000\r\n\r\n"), c));
+        REQUIRE(!out_of_order(response("HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                       "Content-Range: bytes */1000\r\n\r\n"), c));
+}
+
+TEST_CASE("A range response reports the size of the file", "[network]") {
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        auto header = response("HTTP/1.1 206 Partial Content\r\n"
+                               "Content-Range: bytes 0-99/1000\r\n"
+                               "Content-Length: 100\r\n"
+                               "ETag: \"abc\"\r\n\r\n");
+        REQUIRE(accept_range_response(header, c, active, scheduler, out) == 100);
+        REQUIRE(scheduler.file_size_known());
+        REQUIRE(c.first_byte == 0);
+        REQUIRE(c.last_byte == 99);
+        // The output is big enough for the whole file
+        REQUIRE(out.direct(999, 1) != nullptr);
+        REQUIRE_THROWS(scheduler.set_etag("\"def\""));
+}
+
+TEST_CASE("A response for another range is an error", "[network]") {
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE_THROWS_AS(accept_range_response(
+                                  response("HTTP/1.1 206 Partial Content\r\n"
+                                           "Content-Range: bytes 100-199/1000\r\n"
+                                           "Content-Length: 100\r\n\r\n"),
+                                  c, active, scheduler, out),
+                          std::runtime_error);
+        // Nor may the body be longer than the range it claims to be
+        REQUIRE_THROWS_AS(accept_range_response(
+                                  response("HTTP/1.1 206 Partial Content\r\n"
+                                           "Content-Range: bytes 0-99/1000\r\n"
+                                           "Content-Length: 150\r\n\r\n"),
+                                  c, active, scheduler, out),
+                          std::runtime_error);
+}
+
+TEST_CASE("A 416 response marks the end of the file", "[network]") {
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        auto header = response("HTTP/1.1 416 Range Not Satisfiable\r\n"
+                               "Content-Range: bytes */0\r\n"
+                               "Content-Length: 0\r\n\r\n");
+        REQUIRE(accept_range_response(header, c, active, scheduler, out) == 0);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+        REQUIRE(scheduler.length() == 0);
+}
+
+TEST_CASE("A 200 response is the whole file when nothing else is downloading", "[network]") {
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        auto header = response("HTTP/1.1 200 OK\r\n"
+                               "Content-Length: 250\r\n\r\n");
+        REQUIRE(accept_range_response(header, c, active, scheduler, out) == 250);
+        REQUIRE(c.first_byte == 0);
+        REQUIRE(c.last_byte == 249);
+        REQUIRE(out.direct(0, 250) != nullptr);
+        REQUIRE(scheduler.claim(active, 1000) == 250);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+        REQUIRE(scheduler.length() == 250);
+}
+
+TEST_CASE("A 200 response is an error while other ranges are downloading", "[network]") {
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(100);
+        chunk first;
+        chunk_scheduler::active_handle first_active;
+        REQUIRE(scheduler.next(first, first_active));
+        REQUIRE(accept_range_response(response("HTTP/1.1 206 Partial Content\r\n"
+                                               "Content-Range: bytes 0-99/1000\r\n"
+                                               "Content-Length: 100\r\n\r\n"),
+                                      first, first_active, scheduler, out) == 100);
+        chunk second;
+        chunk_scheduler::active_handle second_active;
+        REQUIRE(scheduler.next(second, second_active));
+        REQUIRE(second.first_byte == 100);
+        REQUIRE_THROWS_AS(accept_range_response(response("HTTP/1.1 200 OK\r\n"
+                                                         "Content-Length: 1000\r\n\r\n"),
+                                                second, second_active, scheduler, out),
+                          std::runtime_error);
+}
+
+TEST_CASE("The rest of a range that broke off is asked for again", "[network]") {
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(accept_range_response(response("HTTP/1.1 206 Partial Content\r\n"
+                                               "Content-Range: bytes 0-99/200\r\n"
+                                               "Content-Length: 100\r\n\r\n"),
+                                      c, active, scheduler, out) == 100);
+        REQUIRE(scheduler.claim(active, 40) == 40);
+        scheduler.requeue(active, 40);
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 40);
+        REQUIRE(c.last_byte == 99);
+}
+
+TEST_CASE("A parallel download retries connections that break", "[network]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.drop_connections = 2;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE(download(pool, mirrors, 10000, 1, 1, quick_retries(3)) == file);
+        REQUIRE(mirrors[0].error.empty());
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 3);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "0-9999");
+        REQUIRE(requests[2] == "0-9999");
+}
+
+TEST_CASE("A parallel download gives up after its retries", "[network]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.drop_connections = 100;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE_THROWS(download(pool, mirrors, 10000, 1, 1, quick_retries(2)));
+        REQUIRE(!mirrors[0].error.empty());
+        // The first try and two retries
+        REQUIRE(server.requests().size() == 3);
+}
+
+TEST_CASE("A body cut off partway is finished from where it stopped", "[network]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.cut_first_body = true;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE(download(pool, mirrors, 10000, 1, 1, quick_retries(3)) == file);
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "5000-9999");
+}
+
+TEST_CASE("A mirror that can't be reached is dropped", "[network]") {
+        std::string file = test_file(100000);
+        range_server server(file);
+        uint16_t closed_port;
+        {
+                boost::asio::io_context io;
+                tcp::acceptor unused(io, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+                closed_port = unused.local_endpoint().port();
+        }
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", closed_port, "/file", ""},
+                                    {"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE(download(pool, mirrors, 10000, 2, 1, quick_retries(1)) == file);
+        REQUIRE(!mirrors[0].error.empty());
+        REQUIRE(mirrors[1].error.empty());
+}
+
+TEST_CASE("Connections are reused from one chunk to the next", "[network]") {
+        std::string file = test_file(100000);
+        range_server server(file);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE(download(pool, mirrors, 10000, 1, 1, quick_retries(0)) == file);
+        REQUIRE(pool.misses() == 1);
+        REQUIRE(pool.hits() > 0);
+        REQUIRE(pool.pipelining("127.0.0.1", server.port()));
+}
+
+TEST_CASE("The number of connections doesn't grow with the number of chunks", "[network]") {
+        std::string file = test_file(200000);
+        range_server server(file);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE(download(pool, mirrors, 10000, 3, 1, quick_retries(0)) == file);
+        REQUIRE(server.requests().size() == 20);
+        REQUIRE(server.connections() <= 3);
+}
+
+TEST_CASE("Pipelining stops for a server that drops queued requests", "[network]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.one_request = true;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        REQUIRE(download(pool, mirrors, 10000, 2, 4, quick_retries(3)) == file);
+        REQUIRE(!pool.pipelining("127.0.0.1", server.port()));
+}
+
+TEST_CASE("A hedge victim that stalls doesn't hold up the download", "[network]") {
+        std::string file = test_file(1000000);
+        misbehaviour faults;
+        faults.stall_first_body = true;
+        // Leaves time for the first range to get going before the second
+        // one finishes and looks for something to hedge
+        faults.answer_delay = std::chrono::milliseconds(100);
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        transfer_limits limits = quick_retries(0);
+        limits.first_byte = std::chrono::seconds(20);
+        limits.idle = std::chrono::seconds(20);
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(500000, SIZE_MAX, 500000);
+        scheduler.hedge(100);
+        auto started = std::chrono::steady_clock::now();
+        download_file_parallel(pool, mirrors, scheduler, 2, 1, out, limits);
+        // The stalled connection was closed when the hedge won, rather than
+        // left to time out
+        REQUIRE(std::chrono::steady_clock::now() - started < std::chrono::seconds(10));
+        REQUIRE(result.str() == file);
+        REQUIRE(scheduler.hedges() == 1);
+}
+
+TEST_CASE("A request that gets no answer is sent again", "[network]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.ignore_first_request = true;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        transfer_limits limits = quick_retries(1);
+        limits.first_byte = std::chrono::milliseconds(200);
+        REQUIRE(download(pool, mirrors, 10000, 1, 1, limits) == file);
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "0-9999");
+}
+
+TEST_CASE("A body that stops arriving is finished from where it stopped", "[network]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.stall_first_body = true;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        transfer_limits limits = quick_retries(1);
+        limits.idle = std::chrono::milliseconds(200);
+        REQUIRE(download(pool, mirrors, 10000, 1, 1, limits) == file);
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "1000-9999");
+}
+
+TEST_CASE("A body that arrives too slowly is finished on another connection", "[network]") {
+        std::string file = test_file(200000);
+        misbehaviour faults;
+        faults.trickle_first_body = true;
+        range_server server(file, faults);
+        connection_pool pool;
+        std::vector<mirror> mirrors{{"127.0.0.1", server.port(), "/file", ""}};
+        transfer_limits limits = quick_retries(0);
+        limits.min_rate = 1000000;
+        limits.min_rate_window = std::chrono::milliseconds(200);
+        auto started = std::chrono::steady_clock::now();
+        REQUIRE(download(pool, mirrors, 100000, 1, 1, limits) == file);
+        // Trickling out the whole range would take a second
+        REQUIRE(std::chrono::steady_clock::now() - started < std::chrono::milliseconds(900));
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-99999");
+        // The rest is asked for from the end of the last block read
+        REQUIRE(requests[1] != requests[0]);
+        REQUIRE(requests[1].substr(requests[1].find('-')) == "-99999");
+        REQUIRE(std::stoul(requests[1]) % (16 * 1024) == 0);
+}
+
+TEST_CASE("The async engine downloads a file over several connections", "[network][async]") {
+        std::string file = test_file(100000);
+        range_server server(file);
+        REQUIRE(download_async(server.port(), 10000, 3, 4, quick_retries(0)) == file);
+}
+
+TEST_CASE("The async engine finishes a cut off body from where it stopped", "[network][async]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.cut_first_body = true;
+        range_server server(file, faults);
+        REQUIRE(download_async(server.port(), 10000, 1, 1, quick_retries(3)) == file);
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "5000-9999");
+}
+
+TEST_CASE("The async engine gives up after its retries", "[network][async]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.drop_connections = 100;
+        range_server server(file, faults);
+        REQUIRE_THROWS_AS(download_async(server.port(), 10000, 1, 1, quick_retries(2)),
+                          connection_error);
+        // The first try and two retries
+        REQUIRE(server.requests().size() == 3);
+}
+
+TEST_CASE("The async engine downloads chunked range responses", "[network][async]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.chunked = true;
+        range_server server(file, faults);
+        REQUIRE(download_async(server.port(), 10000, 2, 4, quick_retries(0)) == file);
+}
+
+TEST_CASE("A response the async engine can't use stops every connection", "[network][async]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.shift_later_ranges = true;
+        range_server server(file, faults);
+        std::ostringstream result;
+        std::ostream_iterator<uint8_t> os(result);
+        memory_output out(os);
+        chunk_scheduler scheduler(10000, SIZE_MAX, 10000);
+        REQUIRE_THROWS_AS(download_file_async("127.0.0.1", server.port(), "/file",
+                                              scheduler, 3, 1, out, quick_retries(0)),
+                          std::runtime_error);
+        // Nothing more is handed out, and the other connections were closed,
+        // or the server couldn't shut down
+        chunk c;
+        chunk_scheduler::active_handle active;
+        bool wait;
+        REQUIRE(!scheduler.try_next(c, active, wait));
+        REQUIRE(!wait);
+}
+
+TEST_CASE("The async engine sends a request that gets no answer again", "[network][async]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.ignore_first_request = true;
+        range_server server(file, faults);
+        transfer_limits limits = quick_retries(1);
+        limits.first_byte = std::chrono::milliseconds(200);
+        REQUIRE(download_async(server.port(), 10000, 1, 1, limits) == file);
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "0-9999");
+}
+
+TEST_CASE("The async engine finishes a body that stops arriving from where it stopped",
+          "[network][async]") {
+        std::string file = test_file(100000);
+        misbehaviour faults;
+        faults.stall_first_body = true;
+        range_server server(file, faults);
+        transfer_limits limits = quick_retries(1);
+        limits.idle = std::chrono::milliseconds(200);
+        REQUIRE(download_async(server.port(), 10000, 1, 1, limits) == file);
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-9999");
+        REQUIRE(requests[1] == "1000-9999");
+}
+
+TEST_CASE("The async engine finishes a body that arrives too slowly on another connection",
+          "[network][async]") {
+        std::string file = test_file(200000);
+        misbehaviour faults;
+        faults.trickle_first_body = true;
+        range_server server(file, faults);
+        transfer_limits limits = quick_retries(0);
+        limits.min_rate = 1000000;
+        limits.min_rate_window = std::chrono::milliseconds(200);
+        auto started = std::chrono::steady_clock::now();
+        REQUIRE(download_async(server.port(), 100000, 1, 1, limits) == file);
+        REQUIRE(std::chrono::steady_clock::now() - started < std::chrono::milliseconds(900));
+        std::vector<std::string> requests = server.requests();
+        REQUIRE(requests.size() >= 2);
+        REQUIRE(requests[0] == "0-99999");
+        REQUIRE(requests[1] != requests[0]);
+        REQUIRE(requests[1].substr(requests[1].find('-')) == "-99999");
+        REQUIRE(std::stoul(requests[1]) % (16 * 1024) == 0);
+}
+
+TEST_CASE("The async engine opens no more connections than it's given", "[network][async]") {
+        std::string file = test_file(200000);
+        range_server server(file);
+        REQUIRE(download_async(server.port(), 10000, 3, 1, quick_retries(0)) == file);
+        REQUIRE(server.requests().size() == 20);
+        REQUIRE(server.connections() <= 3);
+}
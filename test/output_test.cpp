@@ -0,0 +1,130 @@
+#include "catch/single_include/catch.hpp"
+#include "output.hpp"
+#include "test/test_files.hpp"
+
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <sstream>
+
+#include <unistd.h>
+
+using namespace network;
+
+namespace
+{
+        // Write "0123456789" as two chunks, back to front, and finish with
+        // the given length.
+        void write_out_of_order(output_file& out, size_t length)
+        {
+                const uint8_t digits[] = {'0','1','2','3','4','5','6','7','8','9'};
+                uint8_t* tail = out.direct(5, 5);
+                if (tail)
+                {
+                        std::copy(digits + 5, digits + 10, tail);
+                }
+                else
+                {
+                        out.write_at(5, digits + 5, 5);
+                }
+                out.write_at(0, digits, 5);
+                out.finish(length);
+        }
+}
+
+TEST_CASE("Memory output writes the buffer on finish", "[output]") {
+        std::ostringstream ss;
+        std::ostream_iterator<uint8_t> os(ss);
+        memory_output out(os);
+        out.reserve(16);
+        write_out_of_order(out, 10);
+        REQUIRE(ss.str() == "0123456789");
+}
+
+TEST_CASE("pwrite output writes chunks at their offsets", "[output]") {
+        std::string path = "build/pwrite_output_test";
+        {
+                pwrite_output out(path);
+                write_out_of_order(out, 8);
+        }
+        REQUIRE(read_file(path) == "01234567");
+        ::unlink(path.c_str());
+}
+
+TEST_CASE("mmap output writes chunks at their offsets", "[output]") {
+        std::string path = "build/mmap_output_test";
+        {
+                mmap_output out(path);
+                out.reserve(16);
+                write_out_of_order(out, 10);
+        }
+        REQUIRE(read_file(path) == "0123456789");
+        ::unlink(path.c_str());
+}
+
+TEST_CASE("Reserving less than a resumed file holds keeps its data", "[output]") {
+        std::string path = "build/resumed_output_test";
+        {
+                pwrite_output out(path);
+                write_out_of_order(out, 10);
+        }
+        {
+                mmap_output out(path, false);
+                out.reserve(5);
+                REQUIRE(read_file(path) == "0123456789");
+                out.write_at(0, reinterpret_cast<const uint8_t*>("abcde"), 5);
+        }
+        REQUIRE(read_file(path) == "abcde56789");
+        {
+                pwrite_output out(path, false);
+                out.reserve(5);
+                out.write_at(0, reinterpret_cast<const uint8_t*>("01234"), 5);
+        }
+        REQUIRE(read_file(path) == "0123456789");
+        ::unlink(path.c_str());
+}
+
+TEST_CASE("Output throughput", "[.][benchmark]") {
+        const size_t file_size = 256 * 1024 * 1024;
+        const size_t block_size = 16 * 1024;
+        std::vector<uint8_t> block(block_size, 'x');
+        std::ostringstream ss;
+        std::ostream_iterator<uint8_t> os(ss);
+        std::string path = "build/output_benchmark";
+
+        auto run = [&](const char* name, output_file& out) {
+                auto start = std::chrono::steady_clock::now();
+                for (size_t offset = 0; offset < file_size; offset += block_size)
+                {
+                        uint8_t* destination = out.direct(offset, block_size);
+                        if (destination)
+                        {
+                                std::copy(block.cbegin(), block.cend(), destination);
+                        }
+                        else
+                        {
+                                out.write_at(offset, block.data(), block_size);
+                        }
+                }
+                out.finish(file_size);
+                std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                WARN(name << ": " << file_size / elapsed.count() / (1024 * 1024)
+                     << " MiB/s");
+        };
+        {
+                memory_output out(os);
+                out.reserve(file_size);
+                run("memory", out);
+        }
+        {
+                pwrite_output out(path);
+                run("pwrite", out);
+        }
+        {
+                mmap_output out(path);
+                out.reserve(file_size);
+                run("mmap", out);
+        }
+        ::unlink(path.c_str());
+}
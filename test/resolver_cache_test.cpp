@@ -0,0 +1,72 @@
+#include "catch/single_include/catch.hpp"
+#include "resolver_cache.hpp"
+
+#include <stdexcept>
+
+using namespace network;
+
+namespace
+{
+        // Two addresses for any host, counting the lookups.
+        resolver_cache::lookup_function two_addresses(int& calls)
+        {
+                return [&calls](const std::string&, uint16_t port) {
+                        ++calls;
+                        return std::vector<tcp::endpoint>{
+                                tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port),
+                                tcp::endpoint(boost::asio::ip::make_address("127.0.0.2"), port),
+                        };
+                };
+        }
+}
+
+TEST_CASE("A host is looked up once while its addresses are fresh", "[resolver]") {
+        int calls = 0;
+        resolver_cache cache(std::chrono::seconds(60), two_addresses(calls));
+        REQUIRE(cache.resolve("example.com", 80).size() == 2);
+        REQUIRE(cache.resolve("example.com", 80).size() == 2);
+        REQUIRE(calls == 1);
+        cache.resolve("example.org", 80);
+        REQUIRE(calls == 2);
+        REQUIRE(cache.lookups() == 2);
+}
+
+TEST_CASE("Expired addresses are looked up again", "[resolver]") {
+        int calls = 0;
+        resolver_cache cache(std::chrono::seconds(0), two_addresses(calls));
+        cache.resolve("example.com", 80);
+        cache.resolve("example.com", 80);
+        REQUIRE(calls == 2);
+}
+
+TEST_CASE("Connections take turns at the first address", "[resolver]") {
+        int calls = 0;
+        resolver_cache cache(std::chrono::seconds(60), two_addresses(calls));
+        auto first = cache.rotate("example.com", 80);
+        auto second = cache.rotate("example.com", 80);
+        auto third = cache.rotate("example.com", 80);
+        REQUIRE(first[0].address().to_string() == "127.0.0.1");
+        REQUIRE(first[1].address().to_string() == "127.0.0.2");
+        REQUIRE(second[0].address().to_string() == "127.0.0.2");
+        REQUIRE(second[1].address().to_string() == "127.0.0.1");
+        REQUIRE(third[0].address().to_string() == "127.0.0.1");
+}
+
+TEST_CASE("Failed lookups are not kept", "[resolver]") {
+        int calls = 0;
+        resolver_cache cache(std::chrono::seconds(60),
+                             [&calls](const std::string&, uint16_t) {
+                                     ++calls;
+                                     return std::vector<tcp::endpoint>();
+                             });
+        REQUIRE_THROWS(cache.resolve("example.com", 80));
+        REQUIRE_THROWS(cache.resolve("example.com", 80));
+        REQUIRE(calls == 2);
+}
+
+TEST_CASE("The system resolver finds numeric addresses", "[resolver]") {
+        resolver_cache cache;
+        auto endpoints = cache.resolve("127.0.0.1", 8080);
+        REQUIRE(endpoints.size() == 1);
+        REQUIRE(endpoints[0].port() == 8080);
+}
@@ -0,0 +1,69 @@
+#include "catch/single_include/catch.hpp"
+#include "scan.hpp"
+
+#include <string>
+
+namespace
+{
+        // Put the widest kernel back for the tests that follow
+        void use_best()
+        {
+                scan::use(scan::level::avx2) || scan::use(scan::level::sse2)
+                        || scan::use(scan::level::scalar);
+        }
+
+        const scan::level levels[] = {scan::level::scalar, scan::level::sse2, scan::level::avx2};
+}
+
+TEST_CASE("The scalar kernel can always be used", "[scan]") {
+        REQUIRE(scan::use(scan::level::scalar));
+        REQUIRE(std::string(scan::implementation()) == "scalar");
+        use_best();
+}
+
+TEST_CASE("Every kernel finds each newline and colon in a block", "[scan]") {
+        std::string data = "HTTP/1.1 206 Partial Content\r\n"
+                           "Content-Range: bytes 0-99/1000\r\n"
+                           "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n"
+                           "\r\n";
+        for (auto l : levels)
+        {
+                if (!scan::use(l))
+                {
+                        continue;
+                }
+                INFO(scan::implementation());
+                // From every starting point, so that the block is cut short
+                // at the end and the bits land in every position
+                for (size_t start = 0; start < data.size(); ++start)
+                {
+                        scan::masks found = scan::classify(data.data() + start,
+                                                           data.data() + data.size());
+                        for (size_t i = 0; i < scan::block_size; ++i)
+                        {
+                                char c = start + i < data.size() ? data[start + i] : 0;
+                                REQUIRE(bool(found.newlines >> i & 1) == (c == '\n'));
+                                REQUIRE(bool(found.colons >> i & 1) == (c == ':'));
+                        }
+                }
+        }
+        use_best();
+}
+
+TEST_CASE("Bytes after the end aren't looked at", "[scan]") {
+        std::string data(scan::block_size, ':');
+        for (auto l : levels)
+        {
+                if (!scan::use(l))
+                {
+                        continue;
+                }
+                INFO(scan::implementation());
+                scan::masks found = scan::classify(data.data(), data.data() + 5);
+                REQUIRE(found.colons == 0x1f);
+                REQUIRE(found.newlines == 0);
+                found = scan::classify(data.data(), data.data());
+                REQUIRE(found.colons == 0);
+        }
+        use_best();
+}
@@ -0,0 +1,443 @@
+#include "catch/single_include/catch.hpp"
+#include "scheduler.hpp"
+
+using namespace network;
+
+TEST_CASE("Only the first chunk goes out until the size is known", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        bool wait;
+        REQUIRE(scheduler.try_next(c, active, wait));
+        REQUIRE(c.first_byte == 0);
+        REQUIRE(c.last_byte == 99);
+
+        chunk other;
+        chunk_scheduler::active_handle other_active;
+        REQUIRE(!scheduler.try_next(other, other_active, wait));
+        REQUIRE(wait);
+}
+
+TEST_CASE("Chunks are planned from the file size", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_file_size(250);
+        REQUIRE(scheduler.file_size_known());
+        scheduler.set_length(active, 100);
+        REQUIRE(scheduler.claim(active, 1000) == 100);
+        scheduler.finish(active);
+
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 100);
+        REQUIRE(c.last_byte == 199);
+        scheduler.finish(active);
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 200);
+        REQUIRE(c.last_byte == 249);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("The plan stops at the maximum length", "[scheduler]") {
+        chunk_scheduler scheduler(100, 150);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_file_size(1000);
+        REQUIRE(scheduler.planned_length(1000) == 150);
+        scheduler.finish(active);
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 100);
+        REQUIRE(c.last_byte == 149);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("A change in file size is an error", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.set_file_size(1000);
+        REQUIRE_NOTHROW(scheduler.set_file_size(1000));
+        REQUIRE_THROWS(scheduler.set_file_size(999));
+}
+
+TEST_CASE("A change in ETag is an error", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.set_etag("\"a\"");
+        REQUIRE_NOTHROW(scheduler.set_etag("\"a\""));
+        REQUIRE_THROWS(scheduler.set_etag("\"b\""));
+}
+
+TEST_CASE("Without a size, chunks go out one at a time until a short one", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        bool wait;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_length(active, 100);
+        scheduler.finish(active);
+
+        REQUIRE(scheduler.try_next(c, active, wait));
+        REQUIRE(c.first_byte == 100);
+        chunk other;
+        chunk_scheduler::active_handle other_active;
+        REQUIRE(!scheduler.try_next(other, other_active, wait));
+        REQUIRE(wait);
+        scheduler.set_length(active, 30);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.try_next(other, other_active, wait));
+        REQUIRE(!wait);
+}
+
+TEST_CASE("A 416 ends the file", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_length(active, 100);
+        scheduler.finish(active);
+        REQUIRE(scheduler.next(c, active));
+        scheduler.end_of_file(c.first_byte);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("Idle workers steal the unclaimed half of the largest range", "[scheduler]") {
+        chunk_scheduler scheduler(1000, SIZE_MAX, 10);
+        chunk first, second, stolen;
+        chunk_scheduler::active_handle first_active, second_active, stolen_active;
+        REQUIRE(scheduler.next(first, first_active));
+        scheduler.set_file_size(2000);
+        REQUIRE(scheduler.next(second, second_active));
+        scheduler.set_length(first_active, 1000);
+        scheduler.set_length(second_active, 1000);
+        REQUIRE(scheduler.claim(first_active, 200) == 200);
+        REQUIRE(scheduler.claim(second_active, 600) == 600);
+
+        REQUIRE(scheduler.next(stolen, stolen_active));
+        REQUIRE(stolen.first_byte == 600);
+        REQUIRE(stolen.last_byte == 999);
+        REQUIRE(scheduler.steals() == 1);
+
+        // The original worker now stops at the new boundary
+        REQUIRE(scheduler.claim(first_active, 1000) == 400);
+        REQUIRE(scheduler.claim(first_active, 1000) == 0);
+}
+
+TEST_CASE("Small ranges are not split", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_file_size(100);
+        scheduler.set_length(active, 100);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("Ranges are not split before their length is known", "[scheduler]") {
+        chunk_scheduler scheduler(1000, SIZE_MAX, 10);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_file_size(1000);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("Cancelled schedulers hand out nothing", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.cancel();
+        REQUIRE(scheduler.claim(active, 10) == 0);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("Adaptive chunks grow with the connection's rate, up to the maximum", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.adapt(50, 20000);
+        connection_rate& slow = scheduler.add_connection();
+        connection_rate& fast = scheduler.add_connection();
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active, &slow));
+        scheduler.set_file_size(10000000);
+        scheduler.finish(active);
+
+        // Until it has been measured, a connection gets the initial size
+        REQUIRE(scheduler.next(c, active, &slow));
+        REQUIRE(c.size() == 100);
+        scheduler.finish(active);
+
+        // 100 KB/s with a 5 ms round trip
+        scheduler.measure(slow, 1000, std::chrono::milliseconds(5),
+                          std::chrono::milliseconds(10));
+        REQUIRE(scheduler.next(c, active, &slow));
+        REQUIRE(c.size() == 5000);
+        scheduler.finish(active);
+
+        scheduler.measure(fast, 1000000, std::chrono::milliseconds(100),
+                          std::chrono::seconds(1));
+        REQUIRE(scheduler.next(c, active, &fast));
+        REQUIRE(c.size() == 20000);
+        scheduler.finish(active);
+}
+
+TEST_CASE("Adaptive chunks shrink to a share of the rest of the file", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.adapt(10, 1000000);
+        connection_rate& first = scheduler.add_connection();
+        connection_rate& second = scheduler.add_connection();
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active, &first));
+        scheduler.set_file_size(10100);
+        scheduler.finish(active);
+
+        scheduler.measure(first, 1000000, std::chrono::milliseconds(100),
+                          std::chrono::seconds(1));
+        scheduler.measure(second, 3000000, std::chrono::milliseconds(100),
+                          std::chrono::seconds(1));
+        REQUIRE(scheduler.next(c, active, &first));
+        REQUIRE(c.first_byte == 100);
+        REQUIRE(c.size() == 2500);
+        scheduler.finish(active);
+
+        // Averaged down to 2 MB/s, so two thirds of the rest
+        scheduler.measure(second, 1000000, std::chrono::milliseconds(100),
+                          std::chrono::seconds(1));
+        REQUIRE(scheduler.next(c, active, &second));
+        REQUIRE(c.first_byte == 2600);
+        REQUIRE(c.size() == 5000);
+}
+
+TEST_CASE("Adaptive chunks are no smaller than the minimum", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.adapt(500, 1000000);
+        connection_rate& rate = scheduler.add_connection();
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active, &rate));
+        scheduler.set_file_size(100000);
+        scheduler.finish(active);
+        scheduler.measure(rate, 100, std::chrono::milliseconds(1),
+                          std::chrono::seconds(1));
+        REQUIRE(scheduler.next(c, active, &rate));
+        REQUIRE(c.size() == 500);
+}
+
+TEST_CASE("Adaptive chunks don't leave a piece smaller than the minimum", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.adapt(600, 1000000);
+        connection_rate& rate = scheduler.add_connection();
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active, &rate));
+        scheduler.set_file_size(1100);
+        scheduler.finish(active);
+        scheduler.measure(rate, 100, std::chrono::milliseconds(1),
+                          std::chrono::seconds(1));
+        REQUIRE(scheduler.next(c, active, &rate));
+        REQUIRE(c.first_byte == 100);
+        REQUIRE(c.last_byte == 1099);
+}
+
+TEST_CASE("The unread rest of a lost range is handed out again", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        chunk c;
+        chunk_scheduler::active_handle active;
+        REQUIRE(scheduler.next(c, active));
+        scheduler.set_file_size(100);
+        scheduler.set_length(active, 100);
+        REQUIRE(scheduler.claim(active, 40) == 40);
+        scheduler.requeue(active, 30);
+
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 30);
+        REQUIRE(c.last_byte == 99);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+}
+
+TEST_CASE("Skipped ranges are not downloaded", "[scheduler]") {
+        chunk_scheduler scheduler(100);
+        scheduler.skip({{0, 49}, {150, 249}, {240, 259}});
+        chunk c;
+        chunk_scheduler::active_handle active;
+        // The first range still needed finds out how big the file is
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 50);
+        REQUIRE(c.last_byte == 149);
+        scheduler.set_file_size(300);
+        scheduler.finish(active);
+
+        REQUIRE(scheduler.next(c, active));
+        REQUIRE(c.first_byte == 260);
+        REQUIRE(c.last_byte == 299);
+        scheduler.finish(active);
+        REQUIRE(!scheduler.next(c, active));
+        REQUIRE(scheduler.length() == 300);
+}
+
+TEST_CASE("Idle workers hedge the slowest range, and the first to finish wins", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        scheduler.hedge(100);
+        chunk c;
+        chunk_scheduler::active_handle slow, hedge;
+        REQUIRE(scheduler.next(c, slow));
+        scheduler.set_file_size(100);
+        scheduler.set_length(slow, 100);
+        REQUIRE(scheduler.claim(slow, 10) == 10);
+
+        // Too small to split, so the tail is asked for again
+        REQUIRE(scheduler.next(c, hedge));
+        REQUIRE(c.first_byte == 10);
+        REQUIRE(c.last_byte == 99);
+        REQUIRE(scheduler.hedges() == 1);
+        scheduler.set_length(hedge, 90);
+
+        REQUIRE(scheduler.claim(slow, 20) == 20);
+        REQUIRE(scheduler.claim(hedge, 100) == 90);
+        scheduler.finish(hedge);
+        // The slow worker stops, and what it read after the hedge started
+        // was wasted
+        REQUIRE(scheduler.claim(slow, 20) == 0);
+        REQUIRE(scheduler.wasted() == 20);
+        REQUIRE(!scheduler.next(c, hedge));
+        scheduler.finish(slow);
+}
+
+TEST_CASE("Hedges stay within their share of the file", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        scheduler.hedge(50);
+        chunk c;
+        chunk_scheduler::active_handle slow, hedge;
+        REQUIRE(scheduler.next(c, slow));
+        scheduler.set_file_size(100);
+        scheduler.set_length(slow, 100);
+        REQUIRE(scheduler.claim(slow, 10) == 10);
+        REQUIRE(!scheduler.next(c, hedge));
+        REQUIRE(scheduler.hedges() == 0);
+}
+
+TEST_CASE("A lost side of a hedge leaves the tail to the other", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        scheduler.hedge(100);
+        chunk c;
+        chunk_scheduler::active_handle slow, hedge;
+        REQUIRE(scheduler.next(c, slow));
+        scheduler.set_file_size(100);
+        scheduler.set_length(slow, 100);
+        REQUIRE(scheduler.claim(slow, 10) == 10);
+        REQUIRE(scheduler.next(c, hedge));
+        scheduler.set_length(hedge, 90);
+        // Only what the slow worker had left before the hedge is queued
+        REQUIRE(scheduler.claim(slow, 20) == 20);
+        scheduler.requeue(slow, 5);
+        REQUIRE(scheduler.claim(hedge, 100) == 90);
+        chunk_scheduler::active_handle rest;
+        REQUIRE(scheduler.next(c, rest));
+        REQUIRE(c.first_byte == 5);
+        REQUIRE(c.last_byte == 9);
+}
+
+TEST_CASE("A victim that loses the race still owns what came before the hedge", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        scheduler.hedge(100);
+        chunk c;
+        chunk_scheduler::active_handle slow, hedge;
+        REQUIRE(scheduler.next(c, slow));
+        scheduler.set_file_size(100);
+        scheduler.set_length(slow, 100);
+        REQUIRE(scheduler.claim(slow, 10) == 10);
+        REQUIRE(scheduler.next(c, hedge));
+        scheduler.set_length(hedge, 90);
+        REQUIRE(scheduler.claim(hedge, 100) == 90);
+        scheduler.finish(hedge);
+        // The slow worker broke off before it got to the hedge
+        scheduler.requeue(slow, 4);
+        chunk_scheduler::active_handle rest;
+        REQUIRE(scheduler.next(c, rest));
+        REQUIRE(c.first_byte == 4);
+        REQUIRE(c.last_byte == 9);
+}
+
+TEST_CASE("The loser of a hedge race has its connection closed", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        scheduler.hedge(100);
+        chunk c;
+        chunk_scheduler::active_handle slow, hedge;
+        REQUIRE(scheduler.next(c, slow));
+        scheduler.set_file_size(100);
+        scheduler.set_length(slow, 100);
+        int slow_stops = 0, hedge_stops = 0;
+        scheduler.on_stop(slow, [&]() { ++slow_stops; });
+        REQUIRE(scheduler.claim(slow, 30) == 30);
+        REQUIRE(scheduler.next(c, hedge));
+        scheduler.set_length(hedge, 70);
+        scheduler.on_stop(hedge, [&]() { ++hedge_stops; });
+        REQUIRE(scheduler.claim(hedge, 100) == 70);
+        scheduler.finish(hedge);
+        REQUIRE(slow_stops == 1);
+        REQUIRE(hedge_stops == 0);
+        REQUIRE(scheduler.stopped(slow));
+        REQUIRE(!scheduler.stopped(hedge));
+        // Only what came before the hedge is asked for again
+        scheduler.requeue(slow, 20);
+        chunk_scheduler::active_handle rest;
+        REQUIRE(scheduler.next(c, rest));
+        REQUIRE(c.first_byte == 20);
+        REQUIRE(c.last_byte == 29);
+        REQUIRE(slow_stops == 1);
+}
+
+TEST_CASE("A server that ignores ranges is downloaded in one piece", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        chunk c;
+        chunk_scheduler::active_handle first, idle;
+        REQUIRE(scheduler.next(c, first));
+        // The first response comes back with all of the file
+        REQUIRE(scheduler.whole_file(first, c, 1000));
+        REQUIRE(c.first_byte == 0);
+        REQUIRE(c.last_byte == 999);
+        REQUIRE(scheduler.file_size_known());
+        REQUIRE(scheduler.claim(first, 1000) == 1000);
+        // No other chunks are needed
+        REQUIRE(!scheduler.next(c, idle));
+        scheduler.finish(first);
+        REQUIRE(scheduler.length() == 1000);
+}
+
+TEST_CASE("The whole file isn't taken while other ranges are downloading", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        chunk c, whole;
+        chunk_scheduler::active_handle first, other;
+        REQUIRE(scheduler.next(c, first));
+        scheduler.set_file_size(1000);
+        REQUIRE(scheduler.next(c, other));
+        REQUIRE(c.first_byte == 100);
+        // Another mirror answers with all of the file
+        REQUIRE_THROWS(scheduler.whole_file(other, whole, 1000));
+        REQUIRE(scheduler.claim(first, 100) == 100);
+        scheduler.finish(first);
+        // The chunk goes to someone else
+        scheduler.requeue(other, 0);
+        REQUIRE(scheduler.next(c, other));
+        REQUIRE(c.first_byte == 100);
+        REQUIRE_THROWS(scheduler.whole_file(other, whole, 2000));
+}
+
+TEST_CASE("A broken single stream starts again from the beginning", "[scheduler]") {
+        chunk_scheduler scheduler(100, SIZE_MAX, 64);
+        chunk c;
+        chunk_scheduler::active_handle stream;
+        REQUIRE(scheduler.next(c, stream));
+        REQUIRE(scheduler.whole_file(stream, c, 1000));
+        REQUIRE(scheduler.claim(stream, 500) == 500);
+        scheduler.requeue(stream, 300);
+        REQUIRE(scheduler.next(c, stream));
+        REQUIRE(c.first_byte == 0);
+        REQUIRE(c.last_byte == 999);
+        REQUIRE(scheduler.whole_file(stream, c, 1000));
+}
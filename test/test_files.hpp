@@ -0,0 +1,16 @@
+#ifndef TEST_FILES_HPP
+#define TEST_FILES_HPP
+
+#include <fstream>
+#include <iterator>
+#include <string>
+
+// The contents of the file at path, or an empty string if it can't be read
+inline std::string read_file(const std::string& path)
+{
+        std::ifstream fs(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(fs),
+                           std::istreambuf_iterator<char>());
+}
+
+#endif